@@ -1,5 +1,9 @@
 #define main(ARGC, ARGV) patchelf_main(ARGC, ARGV)
 #define _FILE_OFFSET_BITS 64
+#include <algorithm>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 #include "libpatchelf.h"
 #include "patchelf/src/patchelf.cc"
 
@@ -96,3 +100,735 @@ int patchelf_set_rpath(const char *filename, const char *filename_new,
     }
     return 0;
 }
+
+static patchelf_span_fn spanHook = nullptr;
+
+void patchelf_set_span_hook(patchelf_span_fn fn)
+{
+    spanHook = fn;
+}
+
+static int64_t spanNow()
+{
+    struct timespec ts;
+
+    if (!spanHook) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void spanEnd(const char *name, int64_t & begin)
+{
+    int64_t end = spanNow();
+
+    if (spanHook && begin) {
+        spanHook(name, begin, end);
+    }
+
+    begin = end;
+}
+
+/*
+ * Set the interpreter and DT_RUNPATH of `contents`, which may be replaced.
+ * Returns 1 if there is no PT_INTERP.
+ */
+static int patchContents(FileContents & contents, const char *interpreter,
+                         const char *rpath, std::string & interp, int64_t & t)
+{
+    std::string newInterpreter(interpreter), newRPath(rpath);
+
+    if (getElfType(contents).is32Bit) {
+        ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off,
+                Elf32_Dyn, Elf32_Sym, Elf32_Versym, Elf32_Verdef,
+                Elf32_Verdaux, Elf32_Verneed, Elf32_Vernaux, Elf32_Rel,
+                Elf32_Rela, 32> elfFile(contents);
+        try {
+            interp = elfFile.getInterpreter();
+        } catch (std::exception &) {
+            // no PT_INTERP: static binary or shared object
+            return 1;
+        }
+        elfFile.setInterpreter(newInterpreter);
+        elfFile.setRPath(newRPath);
+        contents = elfFile.fileContents;
+    } else {
+        ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off,
+                Elf64_Dyn, Elf64_Sym, Elf64_Versym, Elf64_Verdef,
+                Elf64_Verdaux, Elf64_Verneed, Elf64_Vernaux, Elf64_Rel,
+                Elf64_Rela, 64> elfFile(contents);
+        try {
+            interp = elfFile.getInterpreter();
+        } catch (std::exception &) {
+            // no PT_INTERP: static binary or shared object
+            return 1;
+        }
+        elfFile.setInterpreter(newInterpreter);
+        elfFile.setRPath(newRPath);
+        contents = elfFile.fileContents;
+    }
+
+    spanEnd("parse_modify", t);
+    return 0;
+}
+
+static void writeFd(int fd, const FileContents & contents)
+{
+    size_t done = 0;
+
+    while (done < contents->size()) {
+        ssize_t n = write(fd, contents->data() + done,
+                          contents->size() - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error(std::string("write(): ") + strerror(errno));
+        }
+        done += n;
+    }
+}
+
+int patchelf_set_interpreter_rpath(const char *filename,
+                                   const char *filename_new,
+                                   const char *interpreter, const char *rpath,
+                                   char *interpreter_old, size_t n,
+                                   int print_err)
+{
+    int64_t t = spanNow();
+    int ret;
+
+    try {
+        auto fileContents = readFile(filename);
+        std::string interp;
+
+        spanEnd("readFile", t);
+
+        if ((ret = patchContents(fileContents, interpreter, rpath, interp,
+                                 t)) != 0)
+            return ret;
+
+        writeFile(filename_new, fileContents);
+        spanEnd("writeFile", t);
+
+        if (interpreter_old && n) {
+            strncpy(interpreter_old, interp.c_str(), n - 1);
+            interpreter_old[n - 1] = '\0';
+        }
+    } catch (std::exception & e) {
+        if (print_err) {
+            fprintf(stderr, "patchelf: %s\n", e.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int patchelf_set_interpreter_rpath_mem(const void *data, size_t size,
+                                       int fd_new, const char *interpreter,
+                                       const char *rpath,
+                                       char *interpreter_old, size_t n,
+                                       int print_err)
+{
+    int64_t t = spanNow();
+    int ret;
+
+    try {
+        auto begin = static_cast<const unsigned char *>(data);
+        auto fileContents =
+            std::make_shared<std::vector<unsigned char>>(begin, begin + size);
+        std::string interp;
+
+        spanEnd("copy", t);
+
+        if ((ret = patchContents(fileContents, interpreter, rpath, interp,
+                                 t)) != 0)
+            return ret;
+
+        writeFd(fd_new, fileContents);
+        spanEnd("writeFile", t);
+
+        if (interpreter_old && n) {
+            strncpy(interpreter_old, interp.c_str(), n - 1);
+            interpreter_old[n - 1] = '\0';
+        }
+    } catch (std::exception & e) {
+        if (print_err) {
+            fprintf(stderr, "patchelf: %s\n", e.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * What the probes read from: a file descriptor, or a buffer if `data` is
+ * set.
+ */
+struct ElfSource {
+    int fd;
+    const unsigned char *data;
+    size_t size;
+};
+
+static ssize_t preadFull(const ElfSource & src, void *buf, size_t count,
+                         off_t offset)
+{
+    size_t done = 0;
+
+    if (src.data) {
+        if (offset < 0 || (uint64_t) offset >= src.size)
+            return 0;
+        count = std::min<uint64_t>(count, src.size - offset);
+        memcpy(buf, src.data + offset, count);
+        return count;
+    }
+
+    while (done < count) {
+        ssize_t n = pread(src.fd, (char *) buf + done, count - done,
+                          offset + done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+static int preadString(const ElfSource & src, off_t offset, char *buf,
+                       size_t n)
+{
+    ssize_t len = preadFull(src, buf, n, offset);
+
+    if (len <= 0 || !memchr(buf, '\0', len))
+        return -1;
+    return 0;
+}
+
+template<class Elf_Phdr>
+static int64_t addrToOffset(const std::vector<Elf_Phdr> & phdrs, uint64_t addr)
+{
+    for (auto & phdr : phdrs) {
+        if (phdr.p_type == PT_LOAD && addr >= phdr.p_vaddr &&
+            addr < phdr.p_vaddr + phdr.p_filesz)
+            return phdr.p_offset + (addr - phdr.p_vaddr);
+    }
+    return -1;
+}
+
+template<class Elf_Ehdr, class Elf_Phdr, class Elf_Dyn>
+static int probeElf(const ElfSource & src, struct patchelf_probe *info)
+{
+    Elf_Ehdr ehdr;
+    std::vector<Elf_Phdr> phdrs;
+    std::vector<Elf_Dyn> dyns;
+    int64_t strtab = -1;
+    uint64_t strtabAddr = 0, runpathOff = 0, verneedAddr = 0, verdefAddr = 0;
+    uint64_t lastStrOff = 0;
+    bool haveStrtab = false;
+
+    if (preadFull(src, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr))
+        return 1;
+
+    info->elf_type = ehdr.e_type;
+    info->elf_machine = ehdr.e_machine;
+
+    if (ehdr.e_phentsize != sizeof(Elf_Phdr) || ehdr.e_phnum == 0 ||
+        ehdr.e_phnum > PATCHELF_PROBE_MAX_PHDRS)
+        return 0;
+
+    phdrs.resize(ehdr.e_phnum);
+    if (preadFull(src, phdrs.data(), phdrs.size() * sizeof(Elf_Phdr),
+                  ehdr.e_phoff) != (ssize_t) (phdrs.size() * sizeof(Elf_Phdr)))
+        return -1;
+
+    for (auto & phdr : phdrs) {
+        if (phdr.p_type == PT_INTERP && !info->has_interp) {
+            size_t len = std::min<uint64_t>(phdr.p_filesz,
+                                            sizeof(info->interpreter));
+            if (preadString(src, phdr.p_offset, info->interpreter, len) < 0)
+                return -1;
+            info->has_interp = 1;
+            info->interp_offset = phdr.p_offset;
+            info->interp_size = phdr.p_filesz;
+        } else if (phdr.p_type == PT_DYNAMIC && dyns.empty()) {
+            size_t n = std::min<uint64_t>(phdr.p_filesz / sizeof(Elf_Dyn),
+                                          PATCHELF_PROBE_MAX_DYNS);
+            dyns.resize(n);
+            if (preadFull(src, dyns.data(), n * sizeof(Elf_Dyn),
+                          phdr.p_offset) != (ssize_t) (n * sizeof(Elf_Dyn)))
+                return -1;
+            info->has_dynamic = 1;
+            info->dynamic_offset = phdr.p_offset;
+        }
+    }
+
+    for (size_t i = 0; i < dyns.size() && dyns[i].d_tag != DT_NULL; i++) {
+        switch (dyns[i].d_tag) {
+        case DT_STRTAB:
+            strtabAddr = dyns[i].d_un.d_ptr;
+            haveStrtab = true;
+            break;
+        case DT_STRSZ:
+            info->strtab_size = dyns[i].d_un.d_val;
+            break;
+        case DT_NEEDED:
+            info->n_needed++;
+            lastStrOff = std::max<uint64_t>(lastStrOff, dyns[i].d_un.d_val);
+            break;
+        case DT_SONAME:
+            lastStrOff = std::max<uint64_t>(lastStrOff, dyns[i].d_un.d_val);
+            break;
+        case DT_VERNEED:
+            verneedAddr = dyns[i].d_un.d_ptr;
+            break;
+        case DT_VERNEEDNUM:
+            info->verneed_num = dyns[i].d_un.d_val;
+            break;
+        case DT_VERDEF:
+            verdefAddr = dyns[i].d_un.d_ptr;
+            break;
+        case DT_VERDEFNUM:
+            info->verdef_num = dyns[i].d_un.d_val;
+            break;
+        case DT_RUNPATH:
+        case DT_RPATH:
+        case PATCHELF_DT_RUNPATH_SLOT:
+            if (dyns[i].d_tag == DT_RUNPATH ||
+                info->runpath_tag != DT_RUNPATH) {
+                if (info->runpath_tag)
+                    lastStrOff = std::max<uint64_t>(lastStrOff, runpathOff);
+                info->runpath_tag = dyns[i].d_tag;
+                info->runpath_index = i;
+                runpathOff = dyns[i].d_un.d_val;
+            } else {
+                lastStrOff = std::max<uint64_t>(lastStrOff,
+                                                dyns[i].d_un.d_val);
+            }
+            break;
+        }
+    }
+
+    if (!haveStrtab) {
+        info->verneed_num = info->verdef_num = 0;
+        return info->runpath_tag ? -1 : 0;
+    }
+
+    // dynamic entries hold addresses: map them back through the PT_LOADs
+    strtab = addrToOffset(phdrs, strtabAddr);
+    if (info->verneed_num &&
+        (int64_t) (info->verneed_offset = addrToOffset(phdrs, verneedAddr)) < 0)
+        info->verneed_num = 0;
+    if (info->verdef_num &&
+        (int64_t) (info->verdef_offset = addrToOffset(phdrs, verdefAddr)) < 0)
+        info->verdef_num = 0;
+
+    if (strtab < 0) {
+        info->verneed_num = info->verdef_num = 0;
+        return info->runpath_tag ? -1 : 0;
+    }
+
+    info->strtab_offset = strtab;
+
+    if (!info->runpath_tag)
+        return 0;
+
+    info->runpath_offset = strtab + runpathOff;
+    if (preadString(src, info->runpath_offset, info->runpath,
+                    sizeof(info->runpath)) < 0)
+        return -1;
+
+    info->runpath_size = strlen(info->runpath) + 1;
+
+    // a slot left by patchelf_prepatch() or an earlier in-place patch:
+    // a padded interpreter and the last string of the table, followed
+    // only by NULs
+    if (info->has_interp &&
+        info->interp_size > strlen(info->interpreter) + 1 &&
+        runpathOff >= lastStrOff &&
+        runpathOff + info->runpath_size < info->strtab_size &&
+        info->strtab_size - runpathOff <= sizeof(info->runpath)) {
+        size_t tail = info->strtab_size - runpathOff - info->runpath_size;
+        char pad[sizeof(info->runpath)];
+
+        if (preadFull(src, pad, tail, info->runpath_offset +
+                      info->runpath_size) == (ssize_t) tail &&
+            std::all_of(pad, pad + tail, [](char c) { return c == 0; }))
+            info->runpath_size += tail;
+    }
+
+    return 0;
+}
+
+static int probeSource(const ElfSource & src, struct patchelf_probe *info)
+{
+    unsigned char ident[EI_NIDENT];
+    static const unsigned char hostData =
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        ELFDATA2LSB;
+#else
+        ELFDATA2MSB;
+#endif
+
+    memset(info, 0, sizeof(*info));
+
+    if (preadFull(src, ident, EI_NIDENT, 0) != EI_NIDENT ||
+        memcmp(ident, ELFMAG, SELFMAG) != 0)
+        return 1;
+
+    // foreign byte order is left to the full ElfFile path
+    if (ident[EI_DATA] != hostData)
+        return 1;
+
+    info->elf_class = ident[EI_CLASS];
+
+    if (ident[EI_CLASS] == ELFCLASS32)
+        return probeElf<Elf32_Ehdr, Elf32_Phdr, Elf32_Dyn>(src, info);
+    else if (ident[EI_CLASS] == ELFCLASS64)
+        return probeElf<Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn>(src, info);
+
+    return 1;
+}
+
+int patchelf_probe_fd(int fd, struct patchelf_probe *info)
+{
+    return probeSource(ElfSource{fd, nullptr, 0}, info);
+}
+
+int patchelf_probe_mem(const void *data, size_t size,
+                       struct patchelf_probe *info)
+{
+    return probeSource(ElfSource{-1, static_cast<const unsigned char *>(data),
+                                 size}, info);
+}
+
+int patchelf_probe(const char *filename, struct patchelf_probe *info)
+{
+    int fd, ret;
+
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+
+    ret = patchelf_probe_fd(fd, info);
+    close(fd);
+    return ret;
+}
+
+static uint32_t parseVersion(const char *s)
+{
+    uint32_t parts[3] = {0, 0, 0};
+    int n = 0;
+
+    while (n < 3 && *s >= '0' && *s <= '9') {
+        while (*s >= '0' && *s <= '9')
+            parts[n] = parts[n] * 10 + (*s++ - '0');
+        n++;
+        if (*s != '.')
+            break;
+        s++;
+    }
+
+    if (!n || *s || parts[1] > 99 || parts[2] > 99)
+        return 0;
+    return parts[0] * 10000 + parts[1] * 100 + parts[2];
+}
+
+static void addVersion(struct patchelf_versions *v, const char *name)
+{
+    static const struct {
+        const char *prefix;
+        size_t len;
+        uint32_t patchelf_versions::*field;
+    } families[] = {
+        {"GLIBC_", 6, &patchelf_versions::glibc},
+        {"GLIBCXX_", 8, &patchelf_versions::glibcxx},
+        {"CXXABI_", 7, &patchelf_versions::cxxabi},
+        {"GCC_", 4, &patchelf_versions::gcc},
+    };
+
+    for (auto & f : families) {
+        if (strncmp(name, f.prefix, f.len) != 0)
+            continue;
+        uint32_t ver = parseVersion(name + f.len);
+        if (ver) {
+            v->*f.field = std::max(v->*f.field, ver);
+        } else if (f.field == &patchelf_versions::glibc) {
+            // GLIBC_PRIVATE, GLIBC_ABI_DT_RELR, ...; CXXABI_TM_1 and
+            // the like predate every host this runs on
+            v->glibc_other++;
+        }
+        return;
+    }
+}
+
+static int readVersionName(const ElfSource & src,
+                           const struct patchelf_probe *probe,
+                           uint32_t name, char *buf, size_t n)
+{
+    if (probe->strtab_size && name >= probe->strtab_size)
+        return -1;
+    return preadString(src, probe->strtab_offset + name, buf, n);
+}
+
+static int requiredVersions(const ElfSource & src,
+                            const struct patchelf_probe *probe,
+                            struct patchelf_versions *req)
+{
+    // Elf32_Verneed/Vernaux and their 64-bit variants are identical
+    Elf64_Verneed vn;
+    Elf64_Vernaux vna;
+    uint64_t off = probe->verneed_offset;
+    char name[256];
+
+    memset(req, 0, sizeof(*req));
+
+    for (uint32_t i = 0; i < probe->verneed_num; i++) {
+        if (preadFull(src, &vn, sizeof(vn), off) != sizeof(vn) ||
+            vn.vn_version != VER_NEED_CURRENT)
+            return -1;
+
+        uint64_t aux = off + vn.vn_aux;
+        for (uint32_t j = 0; j < vn.vn_cnt && j < PATCHELF_PROBE_MAX_DYNS;
+             j++) {
+            if (preadFull(src, &vna, sizeof(vna), aux) != sizeof(vna) ||
+                readVersionName(src, probe, vna.vna_name, name,
+                                sizeof(name)) < 0)
+                return -1;
+            addVersion(req, name);
+            req->has_versions = 1;
+            if (!vna.vna_next)
+                break;
+            aux += vna.vna_next;
+        }
+
+        if (!vn.vn_next)
+            break;
+        off += vn.vn_next;
+    }
+
+    return 0;
+}
+
+int patchelf_required_versions(int fd, const struct patchelf_probe *probe,
+                               struct patchelf_versions *req)
+{
+    return requiredVersions(ElfSource{fd, nullptr, 0}, probe, req);
+}
+
+int patchelf_required_versions_mem(const void *data, size_t size,
+                                   const struct patchelf_probe *probe,
+                                   struct patchelf_versions *req)
+{
+    return requiredVersions(ElfSource{-1,
+                                      static_cast<const unsigned char *>(data),
+                                      size}, probe, req);
+}
+
+template<class Elf_Dyn>
+static int neededName(const ElfSource & src,
+                      const struct patchelf_probe *probe, size_t index,
+                      char *name, size_t n)
+{
+    Elf_Dyn dyn;
+
+    if (!probe->has_dynamic || !probe->strtab_offset)
+        return 1;
+
+    for (size_t i = 0; i < PATCHELF_PROBE_MAX_DYNS; i++) {
+        if (preadFull(src, &dyn, sizeof(dyn),
+                      probe->dynamic_offset + i * sizeof(dyn)) != sizeof(dyn))
+            return -1;
+        if (dyn.d_tag == DT_NULL)
+            break;
+        if (dyn.d_tag != DT_NEEDED || index--)
+            continue;
+        if (probe->strtab_size && dyn.d_un.d_val >= probe->strtab_size)
+            return -1;
+        return preadString(src, probe->strtab_offset + dyn.d_un.d_val, name,
+                           n);
+    }
+
+    return 1;
+}
+
+int patchelf_needed(int fd, const struct patchelf_probe *probe, size_t index,
+                    char *name, size_t n)
+{
+    const ElfSource src{fd, nullptr, 0};
+
+    if (probe->elf_class == ELFCLASS32)
+        return neededName<Elf32_Dyn>(src, probe, index, name, n);
+    return neededName<Elf64_Dyn>(src, probe, index, name, n);
+}
+
+int patchelf_defined_versions(int fd, const struct patchelf_probe *probe,
+                              struct patchelf_versions *def)
+{
+    const ElfSource src{fd, nullptr, 0};
+
+    Elf64_Verdef vd;
+    Elf64_Verdaux vda;
+    uint64_t off = probe->verdef_offset;
+    char name[256];
+
+    memset(def, 0, sizeof(*def));
+
+    for (uint32_t i = 0; i < probe->verdef_num; i++) {
+        if (preadFull(src, &vd, sizeof(vd), off) != sizeof(vd) ||
+            vd.vd_version != VER_DEF_CURRENT)
+            return -1;
+
+        // the first auxiliary entry names the version itself
+        if (vd.vd_cnt && !(vd.vd_flags & VER_FLG_BASE)) {
+            if (preadFull(src, &vda, sizeof(vda), off + vd.vd_aux) !=
+                    sizeof(vda) ||
+                readVersionName(src, probe, vda.vda_name, name,
+                                sizeof(name)) < 0)
+                return -1;
+            addVersion(def, name);
+            def->has_versions = 1;
+        }
+
+        if (!vd.vd_next)
+            break;
+        off += vd.vd_next;
+    }
+
+    return 0;
+}
+
+// an edit setting the d_tag of the probed DT_RUNPATH (or DT_RPATH) entry
+static void planTag(const struct patchelf_probe *probe, int64_t tag,
+                    struct patchelf_edit *edit)
+{
+    if (probe->elf_class == ELFCLASS32) {
+        Elf32_Sword tag32 = tag;
+        edit->offset = probe->dynamic_offset +
+                       probe->runpath_index * sizeof(Elf32_Dyn);
+        edit->size = sizeof(tag32);
+        memcpy(edit->data, &tag32, sizeof(tag32));
+    } else {
+        Elf64_Sxword tag64 = tag;
+        edit->offset = probe->dynamic_offset +
+                       probe->runpath_index * sizeof(Elf64_Dyn);
+        edit->size = sizeof(tag64);
+        memcpy(edit->data, &tag64, sizeof(tag64));
+    }
+}
+
+int patchelf_plan_inplace(const struct patchelf_probe *probe,
+                          const char *interpreter, const char *rpath,
+                          struct patchelf_edit *edits, size_t *n_edits)
+{
+    size_t interpLen = strlen(interpreter), rpathLen = strlen(rpath);
+    size_t oldInterpLen = strlen(probe->interpreter);
+    size_t oldRPathLen = strlen(probe->runpath), n = 0;
+
+    *n_edits = 0;
+
+    if (!probe->has_interp || !probe->runpath_tag)
+        return 1;
+
+    // the new strings must fit in the slots that are already there
+    if (interpLen + 1 > probe->interp_size ||
+        interpLen + 1 > sizeof(edits[0].data) ||
+        rpathLen + 1 > probe->runpath_size ||
+        rpathLen + 1 > sizeof(edits[0].data))
+        return 1;
+
+    // past the NUL of the old strings, a padded slot is already zero
+    edits[n].offset = probe->interp_offset;
+    edits[n].size = std::min<uint64_t>(std::max(oldInterpLen, interpLen) + 1,
+                                       probe->interp_size);
+    memset(edits[n].data, 0, edits[n].size);
+    memcpy(edits[n].data, interpreter, interpLen);
+    n++;
+
+    edits[n].offset = probe->runpath_offset;
+    edits[n].size = std::max(oldRPathLen, rpathLen) + 1;
+    memset(edits[n].data, 0, edits[n].size);
+    memcpy(edits[n].data, rpath, rpathLen);
+    n++;
+
+    if (probe->runpath_tag != DT_RUNPATH) {
+        // DT_RPATH or a reserved slot -> DT_RUNPATH, as patchelf
+        // --set-rpath does
+        planTag(probe, DT_RUNPATH, &edits[n++]);
+    }
+
+    *n_edits = n;
+    return 0;
+}
+
+int patchelf_prepatch(const char *filename, const char *filename_new,
+                      size_t slot_size, int print_err)
+{
+    struct patchelf_probe orig, probe;
+    struct patchelf_edit edits[PATCHELF_MAX_EDITS];
+    size_t n_edits;
+    int64_t t = 0;
+
+    if (slot_size < 2 || slot_size > sizeof(edits[0].data)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    try {
+        auto fileContents = readFile(filename);
+        std::string placeholder(slot_size - 1, '_'), interp;
+
+        if (probeSource(ElfSource{-1, fileContents->data(),
+                                  fileContents->size()}, &orig) != 0)
+            error("not a probeable ELF file");
+        if (!orig.has_interp ||
+            (orig.interp_size >= slot_size && orig.runpath_size >= slot_size))
+            return 1;
+        if (strlen(orig.interpreter) >= slot_size ||
+            strlen(orig.runpath) >= slot_size)
+            error("interpreter or run path longer than the slot");
+
+        // patchelf appends strings that do not fit to .dynstr, so both
+        // placeholders get slots of their own...
+        if (patchContents(fileContents, placeholder.c_str(),
+                          placeholder.c_str(), interp, t) != 0)
+            return 1;
+
+        if (probeSource(ElfSource{-1, fileContents->data(),
+                                  fileContents->size()}, &probe) != 0 ||
+            patchelf_plan_inplace(&probe, orig.interpreter, orig.runpath,
+                                  edits, &n_edits) != 0)
+            error("placeholders not found after rewriting");
+
+        // ...which then hold the original strings and, for a file without
+        // a run path, a tag the loader ignores
+        if (orig.runpath_tag != DT_RUNPATH)
+            planTag(&probe, orig.runpath_tag ? orig.runpath_tag
+                                             : PATCHELF_DT_RUNPATH_SLOT,
+                    &edits[n_edits++]);
+
+        for (size_t i = 0; i < n_edits; i++) {
+            if (edits[i].offset + edits[i].size > fileContents->size())
+                error("edit out of bounds");
+            memcpy(fileContents->data() + edits[i].offset, edits[i].data,
+                   edits[i].size);
+        }
+
+        if (probeSource(ElfSource{-1, fileContents->data(),
+                                  fileContents->size()}, &probe) != 0 ||
+            probe.interp_size < slot_size || probe.runpath_size < slot_size)
+            error("slots not found after rewriting");
+
+        writeFile(filename_new, fileContents);
+    } catch (std::exception & e) {
+        if (print_err) {
+            fprintf(stderr, "patchelf: %s\n", e.what());
+        }
+        return -1;
+    }
+    return 0;
+}
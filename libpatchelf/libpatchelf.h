@@ -1,7 +1,77 @@
 #ifndef LIBPATCHELF_H
 #define LIBPATCHELF_H
 
+#include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#define PATCHELF_PROBE_MAX_PHDRS 256
+#define PATCHELF_PROBE_MAX_DYNS 4096
+
+/*
+ * Result of patchelf_probe(): the ELF identification plus the program
+ * interpreter and DT_RUNPATH (or DT_RPATH) string, with their file
+ * offsets, read with a few pread()s and without loading the file.
+ * interp_size and runpath_size are the bytes available in place,
+ * including the NUL padding of a prepatched file.
+ */
+struct patchelf_probe {
+    int elf_class;
+    int elf_type;
+    int elf_machine;
+    int has_interp;
+    int has_dynamic;
+    int runpath_tag;
+    size_t runpath_index;
+    uint64_t interp_offset;
+    uint64_t interp_size;
+    uint64_t dynamic_offset;
+    uint64_t runpath_offset;
+    uint64_t runpath_size;
+    uint64_t strtab_offset;
+    uint64_t strtab_size;
+    uint64_t verneed_offset;
+    uint64_t verdef_offset;
+    uint32_t verneed_num;
+    uint32_t verdef_num;
+    uint32_t n_needed;
+    char interpreter[PATH_MAX];
+    char runpath[PATH_MAX];
+};
+
+/*
+ * d_tag of a run path slot that patchelf_prepatch() reserved in a file
+ * without DT_RUNPATH. In the OS-specific range and unknown to the loader,
+ * which skips it; patchelf_plan_inplace() turns it into DT_RUNPATH.
+ */
+#define PATCHELF_DT_RUNPATH_SLOT 0x6fffe000
+
+/*
+ * Symbol versions of the toolchain libraries, each encoded as
+ * x * 10000 + y * 100 + z for FAMILY_x.y.z. As required by a file
+ * (.gnu.version_r), the highest version of each family; as defined by a
+ * library (.gnu.version_d), the highest one it provides.
+ */
+struct patchelf_versions {
+    uint32_t glibc;
+    uint32_t glibcxx;
+    uint32_t cxxabi;
+    uint32_t gcc;
+    int has_versions;
+    int glibc_other;
+};
+
+/*
+ * A byte range to overwrite in place, produced by patchelf_plan_inplace().
+ */
+struct patchelf_edit {
+    uint64_t offset;
+    size_t size;
+    char data[PATH_MAX];
+};
+
+#define PATCHELF_MAX_EDITS 3
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,6 +84,98 @@ int patchelf_set_interpreter(const char *filename, const char *filename_new,
 int patchelf_set_rpath(const char *filename, const char *filename_new,
                       const char *rpath, int print_err);
 
+/*
+ * Read `filename` once and, if it has a PT_INTERP, rewrite both the
+ * interpreter and DT_RUNPATH into `filename_new` in a single pass.
+ * The original interpreter is copied to `interpreter_old` if non-NULL.
+ * Returns 0 on success, 1 if the file has no interpreter (nothing is
+ * written) and -1 on error.
+ */
+int patchelf_set_interpreter_rpath(const char *filename,
+                                   const char *filename_new,
+                                   const char *interpreter, const char *rpath,
+                                   char *interpreter_old, size_t n,
+                                   int print_err);
+
+/*
+ * Like patchelf_set_interpreter_rpath(), for a file that is already in
+ * memory (`size` bytes at `data`, left unchanged). The patched file is
+ * written to `fd_new`; nothing is written if there is no interpreter.
+ */
+int patchelf_set_interpreter_rpath_mem(const void *data, size_t size,
+                                       int fd_new, const char *interpreter,
+                                       const char *rpath,
+                                       char *interpreter_old, size_t n,
+                                       int print_err);
+
+/*
+ * Optional hook, called with CLOCK_MONOTONIC timestamps around the read,
+ * parse and write phases of patchelf_set_interpreter_rpath(). Pass NULL
+ * to remove it.
+ */
+typedef void (*patchelf_span_fn)(const char *name, int64_t begin_ns,
+                                 int64_t end_ns);
+
+void patchelf_set_span_hook(patchelf_span_fn fn);
+
+/*
+ * Probe an ELF file. Returns 0 if `info` was filled in, 1 if the file is
+ * not an ELF file of the host byte order and -1 on I/O errors or
+ * malformed headers.
+ */
+int patchelf_probe(const char *filename, struct patchelf_probe *info);
+
+int patchelf_probe_fd(int fd, struct patchelf_probe *info);
+
+int patchelf_probe_mem(const void *data, size_t size,
+                       struct patchelf_probe *info);
+
+/*
+ * Collect the GLIBC_, GLIBCXX_, CXXABI_ and GCC_ versions a probed file
+ * requires (patchelf_required_versions) or a library defines
+ * (patchelf_defined_versions). Unnumbered GLIBC_ versions such as
+ * GLIBC_PRIVATE or GLIBC_ABI_DT_RELR are counted in `glibc_other`.
+ * Returns 0 on success and -1 on I/O errors or malformed tables.
+ */
+int patchelf_required_versions(int fd, const struct patchelf_probe *probe,
+                               struct patchelf_versions *req);
+
+int patchelf_required_versions_mem(const void *data, size_t size,
+                                   const struct patchelf_probe *probe,
+                                   struct patchelf_versions *req);
+
+int patchelf_defined_versions(int fd, const struct patchelf_probe *probe,
+                              struct patchelf_versions *def);
+
+/*
+ * Copy the `index`th DT_NEEDED name of a probed file, in table order, to
+ * `name`. Returns 0 on success, 1 past the last one and -1 on I/O errors
+ * or malformed tables.
+ */
+int patchelf_needed(int fd, const struct patchelf_probe *probe, size_t index,
+                    char *name, size_t n);
+
+/*
+ * Plan an in-place rewrite of the interpreter and DT_RUNPATH of a probed
+ * file, for when both new strings fit in the existing slots. Fills up to
+ * PATCHELF_MAX_EDITS entries of `edits`. Returns 0 on success and 1 if
+ * the file has to be rewritten with patchelf_set_interpreter_rpath().
+ */
+int patchelf_plan_inplace(const struct patchelf_probe *probe,
+                          const char *interpreter, const char *rpath,
+                          struct patchelf_edit *edits, size_t *n_edits);
+
+/*
+ * Give `filename` a `slot_size` byte interpreter and DT_RUNPATH slot
+ * each, written to `filename_new`. The slots hold the original strings,
+ * NUL-padded, so the file still runs as before, and any path shorter than
+ * `slot_size` can later be planned in place. Returns 0 on success, 1 if
+ * there is no interpreter or the slots already exist (nothing is
+ * written) and -1 on error.
+ */
+int patchelf_prepatch(const char *filename, const char *filename_new,
+                      size_t slot_size, int print_err);
+
 #ifdef __cplusplus
 }
 #endif
@@ -142,3 +142,83 @@ make distclean
 
 make -j$(nproc)
 make install
+
+
+# ====================
+# glibc-hwcaps variants (optional)
+#
+# libm, libstdc++ and libgcc_s are rebuilt for each level in $HWCAPS and
+# installed to lib/glibc-hwcaps/<level>, where the loader prefers them on
+# CPUs that support the level. libc.so.6 stays generic: it has to come
+# from the same build as the loader, and its string functions already
+# pick an AVX2/EVEX implementation at runtime.
+
+# levels dropped from $HWCAPS since the last build must not be shipped
+rm -rf "$PREFIX/$TARGET_TRIPLET/lib/glibc-hwcaps"
+
+for level in ${HWCAPS:-}; do
+    case "$TARGET_TRIPLET:$level" in
+        x86_64-*:x86-64-v[234])
+            ;;
+        *)
+            echo "glibc-hwcaps: $level is not available for $TARGET_TRIPLET" >&2
+            exit 1
+            ;;
+    esac
+
+    HWCAPS_DIR="$PREFIX/$TARGET_TRIPLET/lib/glibc-hwcaps/$level"
+    STAGE_DIR="$BUILDDIR/hwcaps-$level"
+    mkdir -p "$HWCAPS_DIR"
+
+    mkdir -p "$BUILDDIR/glibc/builddir-$level"
+    cd "$BUILDDIR/glibc/builddir-$level"
+
+    ../configure \
+        CC="$PREFIX/bin/$TARGET_TRIPLET-gcc" \
+        CXX="$PREFIX/bin/$TARGET_TRIPLET-g++" \
+        CFLAGS="-O2 -march=$level" \
+        --build="$BUILD_TRIPLET" \
+        --host="$TARGET_TRIPLET" \
+        --prefix="$PREFIX/$TARGET_TRIPLET" \
+        --enable-kernel=3.10.0 \
+        --enable-static-nss \
+        --disable-nscd \
+        --without-selinux
+
+    make -j$(nproc)
+    make install install_root="$STAGE_DIR"
+
+    # libmvec is only built where glibc has vector math
+    for lib in libm.so.6 libmvec.so.1; do
+        found=
+        for dir in lib64 lib; do
+            if [ -e "$STAGE_DIR/$PREFIX/$TARGET_TRIPLET/$dir/$lib" ]; then
+                cp -L "$STAGE_DIR/$PREFIX/$TARGET_TRIPLET/$dir/$lib" "$HWCAPS_DIR"
+                found=1
+                break
+            fi
+        done
+        if [ -z "$found" ] && [ "$lib" = libm.so.6 ]; then
+            echo "glibc-hwcaps: $lib was not built for $level" >&2
+            exit 1
+        fi
+    done
+
+    mkdir -p "$BUILDDIR/gcc/builddir-$level"
+    cd "$BUILDDIR/gcc/builddir-$level"
+
+    ../configure \
+        CFLAGS_FOR_TARGET="-O2 -march=$level" \
+        CXXFLAGS_FOR_TARGET="-O2 -march=$level" \
+        --build="$BUILD_TRIPLET" \
+        --host="$BUILD_TRIPLET" \
+        --target="$TARGET_TRIPLET" \
+        --prefix="$PREFIX" \
+        --includedir="$PREFIX/$TARGET_TRIPLET/include" \
+        --enable-languages=c,c++ \
+        --disable-multilib
+
+    make -j$(nproc) all-target-libgcc all-target-libstdc++-v3
+    cp -L "$TARGET_TRIPLET/libgcc/libgcc_s.so.1" "$HWCAPS_DIR"
+    cp -L "$TARGET_TRIPLET/libstdc++-v3/src/.libs/libstdc++.so.6" "$HWCAPS_DIR"
+done
@@ -0,0 +1,281 @@
+#!/usr/bin/python3
+#
+# Generate an ld.so.cache for the bundled gnu/ directory.
+#
+# The patched loader (patches/glibc.patch) reads ld.so.cache from its own
+# directory. Paths in that cache are relative to the directory, so the
+# same file works wherever the tarball is unpacked. The generator is
+# written in Python because the target ldconfig cannot run on the build
+# host when cross compiling.
+#
+# Variants in glibc-hwcaps/<name>/ subdirectories are added as glibc-hwcaps
+# entries, so the loader picks the best one the CPU supports.
+#
+# Usage: scripts/gen-ld-so-cache.py <gnu-dir> [output]
+#
+import functools
+import os
+import struct
+import sys
+
+CACHE_MAGIC = b'glibc-ld.so.cache1.1'
+
+FLAG_ELF_LIBC6 = 0x0003
+FLAG_X8664_LIB64 = 0x0300
+FLAG_ARM_LIBHF = 0x0900
+FLAG_AARCH64_LIB64 = 0x0a00
+
+CACHE_FLAGS_ENDIAN_LITTLE = 2
+CACHE_FLAGS_ENDIAN_BIG = 3
+
+CACHE_EXTENSION_MAGIC = 0xeaa42174
+CACHE_EXTENSION_TAG_GLIBC_HWCAPS = 1
+DL_CACHE_HWCAP_EXTENSION = 1 << 62
+HWCAPS_SUBDIR = 'glibc-hwcaps'
+
+EM_386 = 3
+EM_ARM = 40
+EM_X86_64 = 62
+EM_AARCH64 = 183
+EF_ARM_ABI_FLOAT_HARD = 0x400
+
+ET_DYN = 3
+PT_LOAD = 1
+PT_DYNAMIC = 2
+DT_NULL = 0
+DT_STRTAB = 5
+DT_SONAME = 14
+
+
+def eprint(msg):
+    sys.stderr.write("%s\n" % (msg,))
+
+
+class ElfInfo:
+    def __init__(self, flags, soname, little_endian):
+        self.flags = flags
+        self.soname = soname
+        self.little_endian = little_endian
+
+
+def read_elf(path):
+    """Return the cache flags and DT_SONAME of a shared object, or None."""
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    if len(data) < 52 or data[:4] != b'\x7fELF':
+        return None
+
+    is64 = data[4] == 2
+    end = '<' if data[5] == 1 else '>'
+    if is64:
+        e_type, e_machine, _, _, e_phoff, _, e_flags, _, e_phentsize, \
+            e_phnum = struct.unpack_from(end + 'HHIQQQIHHH', data, 16)
+        phdr_fmt, dyn_fmt = end + 'IIQQQQQQ', end + 'qQ'
+    else:
+        e_type, e_machine, _, _, e_phoff, _, e_flags, _, e_phentsize, \
+            e_phnum = struct.unpack_from(end + 'HHIIIIIHHH', data, 16)
+        phdr_fmt, dyn_fmt = end + 'IIIIIIII', end + 'iI'
+
+    if e_type != ET_DYN:
+        return None
+
+    if e_machine == EM_X86_64 and is64:
+        flags = FLAG_ELF_LIBC6 | FLAG_X8664_LIB64
+    elif e_machine == EM_AARCH64 and is64:
+        flags = FLAG_ELF_LIBC6 | FLAG_AARCH64_LIB64
+    elif e_machine == EM_ARM and e_flags & EF_ARM_ABI_FLOAT_HARD:
+        flags = FLAG_ELF_LIBC6 | FLAG_ARM_LIBHF
+    elif e_machine in (EM_386, EM_ARM):
+        flags = FLAG_ELF_LIBC6
+    else:
+        return None
+
+    loads, dynamic = [], None
+    for i in range(e_phnum):
+        off = e_phoff + i * e_phentsize
+        if is64:
+            p_type, _, p_offset, p_vaddr, _, p_filesz, _, _ = \
+                struct.unpack_from(phdr_fmt, data, off)
+        else:
+            p_type, p_offset, p_vaddr, _, p_filesz, _, _, _ = \
+                struct.unpack_from(phdr_fmt, data, off)
+        if p_type == PT_LOAD:
+            loads.append((p_vaddr, p_offset, p_filesz))
+        elif p_type == PT_DYNAMIC:
+            dynamic = (p_offset, p_filesz)
+
+    soname = None
+    if dynamic:
+        strtab, soname_off = None, None
+        size = struct.calcsize(dyn_fmt)
+        for off in range(dynamic[0], dynamic[0] + dynamic[1], size):
+            tag, val = struct.unpack_from(dyn_fmt, data, off)
+            if tag == DT_NULL:
+                break
+            elif tag == DT_STRTAB:
+                strtab = val
+            elif tag == DT_SONAME:
+                soname_off = val
+        if strtab is not None and soname_off is not None:
+            for vaddr, offset, filesz in loads:
+                if vaddr <= strtab < vaddr + filesz:
+                    start = offset + strtab - vaddr + soname_off
+                    soname = data[start:data.index(b'\0', start)].decode()
+                    break
+
+    return ElfInfo(flags, soname, end == '<')
+
+
+def libcmp(a, b):
+    """_dl_cache_libcmp(): compare names, runs of digits numerically."""
+    i = j = 0
+    while i < len(a):
+        if a[i].isdigit():
+            if j >= len(b) or not b[j].isdigit():
+                return 1
+            m, n = i, j
+            while i < len(a) and a[i].isdigit():
+                i += 1
+            while j < len(b) and b[j].isdigit():
+                j += 1
+            if int(a[m:i]) != int(b[n:j]):
+                return int(a[m:i]) - int(b[n:j])
+        elif j < len(b) and b[j].isdigit():
+            return -1
+        elif j >= len(b) or a[i] != b[j]:
+            return ord(a[i]) - (ord(b[j]) if j < len(b) else 0)
+        else:
+            i += 1
+            j += 1
+    return 0 if j >= len(b) else -ord(b[j])
+
+
+def scan(libdir, prefix, hwcaps, entries):
+    """Add (key, flags, relative path, hwcaps) for the libraries in libdir,
+    pointing at the soname link, as ldconfig -n does, if there is one."""
+    found = {}
+    little_endian = None
+    for name in sorted(os.listdir(libdir)):
+        path = os.path.join(libdir, name)
+        if '.so' not in name or not os.path.isfile(path):
+            continue
+        try:
+            info = read_elf(path)
+        except (OSError, struct.error, ValueError):
+            info = None
+        if info is None:
+            continue
+        little_endian = info.little_endian
+        key = info.soname or name
+        value = key if os.path.exists(os.path.join(libdir, key)) else name
+        if key not in found or name == key:
+            found[key] = (info.flags, prefix + value)
+    for key, (flags, value) in found.items():
+        entries.append((key, flags, value, hwcaps))
+    return little_endian
+
+
+def collect(gnudir):
+    entries = []
+    little_endian = scan(gnudir, '', None, entries)
+    hwcapsdir = os.path.join(gnudir, HWCAPS_SUBDIR)
+    if os.path.isdir(hwcapsdir):
+        for name in sorted(os.listdir(hwcapsdir)):
+            subdir = os.path.join(hwcapsdir, name)
+            if os.path.isdir(subdir):
+                scan(subdir, '%s/%s/' % (HWCAPS_SUBDIR, name), name, entries)
+    return entries, little_endian is not False
+
+
+def compare(a, b):
+    """ldconfig's order: descending by key and flags, glibc-hwcaps entries
+    (sorted by subdirectory) before the regular one, since the loader
+    stops at the first regular entry."""
+    res = libcmp(b[0], a[0])
+    if res == 0:
+        if a[1] != b[1]:
+            return 1 if a[1] < b[1] else -1
+        if (a[3] is None) != (b[3] is None):
+            return 1 if a[3] is None else -1
+        if a[3] is not None and a[3] != b[3]:
+            return -1 if a[3] < b[3] else 1
+    return res
+
+
+def build_cache(entries, little_endian):
+    end = '<' if little_endian else '>'
+    header_fmt = end + '20sIIB3sI12s'
+    entry_fmt = end + 'iIIIQ'
+
+    # the loader bisects: keys must be in descending _dl_cache_libcmp order
+    entries = sorted(entries, key=functools.cmp_to_key(compare))
+    hwcaps = sorted(set(e[3] for e in entries if e[3] is not None))
+
+    strings = bytearray()
+    offsets = {}
+    strings_base = struct.calcsize(header_fmt) + \
+        len(entries) * struct.calcsize(entry_fmt)
+
+    def intern(s):
+        if s not in offsets:
+            offsets[s] = strings_base + len(strings)
+            strings.extend(s.encode() + b'\0')
+        return offsets[s]
+
+    body = bytearray()
+    for key, flags, value, subdir in entries:
+        hwcap = 0
+        if subdir is not None:
+            hwcap = DL_CACHE_HWCAP_EXTENSION | hwcaps.index(subdir)
+        body += struct.pack(entry_fmt, flags, intern(key), intern(value), 0,
+                            hwcap)
+    hwcaps_offsets = [intern(name) for name in hwcaps]
+
+    extension = b''
+    extension_offset = 0
+    if hwcaps:
+        # one section: the subdirectory names, indexed by the entries
+        extension_offset = strings_base + len(strings)
+        extension_offset += -extension_offset % 4
+        strings.extend(b'\0' * (extension_offset - strings_base - len(strings)))
+        section_offset = extension_offset + struct.calcsize(end + 'II') + \
+            struct.calcsize(end + 'IIII')
+        extension = struct.pack(end + 'II', CACHE_EXTENSION_MAGIC, 1) + \
+            struct.pack(end + 'IIII', CACHE_EXTENSION_TAG_GLIBC_HWCAPS, 0,
+                        section_offset, 4 * len(hwcaps)) + \
+            struct.pack(end + '%dI' % len(hwcaps), *hwcaps_offsets)
+
+    endian = CACHE_FLAGS_ENDIAN_LITTLE if little_endian \
+        else CACHE_FLAGS_ENDIAN_BIG
+    header = struct.pack(header_fmt, CACHE_MAGIC, len(entries), len(strings),
+                         endian, b'\0' * 3, extension_offset, b'\0' * 12)
+    return bytes(header + body + strings + extension)
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        eprint("Usage: %s <gnu-dir> [output]" % (sys.argv[0],))
+        return 1
+
+    gnudir = sys.argv[1]
+    output = sys.argv[2] if len(sys.argv) == 3 \
+        else os.path.join(gnudir, 'ld.so.cache')
+
+    entries, little_endian = collect(gnudir)
+    if not entries:
+        eprint("%s: no shared libraries found" % (gnudir,))
+        return 1
+
+    tmp = output + '.tmp'
+    with open(tmp, 'wb') as f:
+        f.write(build_cache(entries, little_endian))
+    os.chmod(tmp, 0o644)
+    os.rename(tmp, output)
+
+    eprint("%s: %d libraries" % (output, len(entries)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
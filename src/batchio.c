@@ -0,0 +1,390 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#include "batchio.h"
+
+// a read and a close per file in the second step of batchio_head()
+#define BATCHIO_ENTRIES (2 * BATCHIO_MAX)
+
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned n)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+
+// the kernel's io_uring may predate the operations used here
+static int uring_supported(int fd)
+{
+    static const int ops[] = {
+        IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE,
+    };
+    struct io_uring_probe *probe;
+    size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int ret = 0;
+    size_t i;
+
+    if (!(probe = calloc(1, len))) {
+        return 0;
+    }
+
+    if (uring_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        goto end;
+    }
+
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op ||
+            !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            goto end;
+        }
+    }
+    ret = 1;
+
+end:
+    free(probe);
+    return ret;
+}
+
+
+int batchio_init(struct batchio *io, int use_uring)
+{
+    struct io_uring_params p;
+    unsigned char *sq;
+
+    memset(io, 0, sizeof(*io));
+    io->ring_fd = -1;
+
+    if (!use_uring) {
+        return 0;
+    }
+
+    memset(&p, 0, sizeof(p));
+    // ENOSYS before 5.1, EPERM under seccomp or kernel.io_uring_disabled
+    if ((io->ring_fd = uring_setup(BATCHIO_ENTRIES, &p)) < 0) {
+        io->ring_fd = -1;
+        return 0;
+    }
+
+    if (!uring_supported(io->ring_fd) ||
+        !(io->stx = calloc(BATCHIO_MAX, sizeof(struct statx)))) {
+        goto fail;
+    }
+
+    io->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_map_size = p.cq_off.cqes +
+                      p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cq_map_size > io->sq_map_size) {
+            io->sq_map_size = io->cq_map_size;
+        }
+        io->cq_map_size = 0;
+    }
+
+    io->sq_map = mmap(NULL, io->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                      IORING_OFF_SQ_RING);
+    if (io->sq_map == MAP_FAILED) {
+        io->sq_map = NULL;
+        goto fail;
+    }
+
+    if (io->cq_map_size) {
+        io->cq_map = mmap(NULL, io->cq_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                          IORING_OFF_CQ_RING);
+        if (io->cq_map == MAP_FAILED) {
+            io->cq_map = NULL;
+            goto fail;
+        }
+    }
+
+    io->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                    IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED) {
+        io->sqes = NULL;
+        goto fail;
+    }
+
+    sq = io->sq_map;
+    io->sq_head = (unsigned *) (sq + p.sq_off.head);
+    io->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    io->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    io->sq_array = (unsigned *) (sq + p.sq_off.array);
+
+    sq = io->cq_map ? io->cq_map : io->sq_map;
+    io->cq_head = (unsigned *) (sq + p.cq_off.head);
+    io->cq_tail = (unsigned *) (sq + p.cq_off.tail);
+    io->cq_mask = (unsigned *) (sq + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *) (sq + p.cq_off.cqes);
+
+    return 1;
+
+fail:
+    batchio_free(io);
+    return 0;
+}
+
+
+void batchio_free(struct batchio *io)
+{
+    if (io->sqes) {
+        munmap(io->sqes, io->sqes_size);
+    }
+    if (io->cq_map) {
+        munmap(io->cq_map, io->cq_map_size);
+    }
+    if (io->sq_map) {
+        munmap(io->sq_map, io->sq_map_size);
+    }
+    if (io->ring_fd >= 0) {
+        close(io->ring_fd);
+    }
+    free(io->stx);
+    memset(io, 0, sizeof(*io));
+    io->ring_fd = -1;
+}
+
+
+static struct io_uring_sqe *uring_sqe(struct batchio *io, uint8_t opcode,
+                                      uint64_t user_data)
+{
+    unsigned tail = *io->sq_tail, idx = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    io->sq_array[idx] = idx;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+
+/*
+ * Submits the n queued entries and stores the result of entry i, given as
+ * user_data, in res[i]. Once this fails, the ring is not used again:
+ * entries may be left in it.
+ */
+static int uring_run(struct batchio *io, unsigned n, int *res)
+{
+    unsigned to_submit = n, done = 0, head, tail;
+    int ret;
+
+    while (done < n) {
+        if ((ret = uring_enter(io->ring_fd, to_submit, 1,
+                               IORING_ENTER_GETEVENTS)) < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                // completions are reaped below, which makes room
+                ret = 0;
+            } else {
+                return -1;
+            }
+        }
+        to_submit -= ret;
+
+        head = *io->cq_head;
+        tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, done++) {
+            struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+            res[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+
+// after a failed uring_run(): the requests still in flight may write to
+// io->stx, so that is not freed
+static void uring_abandon(struct batchio *io)
+{
+    io->stx = NULL;
+    batchio_free(io);
+}
+
+
+static void stat_from_statx(struct stat *sb, const struct statx *stx)
+{
+    memset(sb, 0, sizeof(*sb));
+    sb->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    sb->st_ino = stx->stx_ino;
+    sb->st_mode = stx->stx_mode;
+    sb->st_nlink = stx->stx_nlink;
+    sb->st_uid = stx->stx_uid;
+    sb->st_gid = stx->stx_gid;
+    sb->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    sb->st_size = stx->stx_size;
+    sb->st_blksize = stx->stx_blksize;
+    sb->st_blocks = stx->stx_blocks;
+    sb->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    sb->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+
+void batchio_stat(struct batchio *io, struct batchio_req *reqs, size_t n)
+{
+    struct statx *stx = io->stx;
+    int res[BATCHIO_MAX];
+    size_t i;
+
+    if (io->ring_fd >= 0) {
+        for (i = 0; i < n; i++) {
+            struct io_uring_sqe *sqe = uring_sqe(io, IORING_OP_STATX, i);
+
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t) reqs[i].path;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (uintptr_t) &stx[i];
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        }
+
+        if (uring_run(io, n, res) == 0) {
+            for (i = 0; i < n; i++) {
+                if ((reqs[i].err = res[i] < 0 ? -res[i] : 0) == 0) {
+                    stat_from_statx(&reqs[i].sb, &stx[i]);
+                }
+            }
+            return;
+        }
+        uring_abandon(io);
+    }
+
+    for (i = 0; i < n; i++) {
+        reqs[i].err = lstat(reqs[i].path, &reqs[i].sb) < 0 ? errno : 0;
+    }
+}
+
+
+void batchio_head(struct batchio *io, struct batchio_req **reqs, size_t n)
+{
+    int res[BATCHIO_ENTRIES];
+    size_t opened[BATCHIO_MAX], i, n_open = 0;
+    ssize_t len;
+
+    for (i = 0; i < n; i++) {
+        reqs[i]->fd = -1;
+        reqs[i]->head_len = 0;
+        reqs[i]->err = 0;
+    }
+
+    if (io->ring_fd >= 0) {
+        for (i = 0; i < n; i++) {
+            struct io_uring_sqe *sqe = uring_sqe(io, IORING_OP_OPENAT, i);
+
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t) reqs[i]->path;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        }
+
+        if (uring_run(io, n, res) < 0) {
+            uring_abandon(io);
+            goto sync;
+        }
+
+        // then the read and close of each opened file, linked: the close
+        // waits for the read, and runs even if the read came short
+        for (i = 0; i < n; i++) {
+            struct io_uring_sqe *sqe;
+
+            if (res[i] < 0) {
+                reqs[i]->err = -res[i];
+                continue;
+            }
+            reqs[i]->fd = res[i];
+
+            sqe = uring_sqe(io, IORING_OP_READ, 2 * n_open);
+            sqe->fd = reqs[i]->fd;
+            sqe->addr = (uintptr_t) reqs[i]->head;
+            sqe->len = BATCHIO_HEAD;
+            sqe->flags = IOSQE_IO_HARDLINK;
+
+            sqe = uring_sqe(io, IORING_OP_CLOSE, 2 * n_open + 1);
+            sqe->fd = reqs[i]->fd;
+
+            opened[n_open++] = i;
+        }
+
+        if (uring_run(io, 2 * n_open, res) < 0) {
+            // the descriptors are lost, but the batch is still answered
+            uring_abandon(io);
+            goto sync;
+        }
+
+        for (i = 0; i < n_open; i++) {
+            struct batchio_req *req = reqs[opened[i]];
+
+            if (res[2 * i] < 0) {
+                req->err = -res[2 * i];
+            } else {
+                req->head_len = res[2 * i];
+            }
+            if (res[2 * i + 1] < 0) {
+                close(req->fd);
+            }
+            req->fd = -1;
+        }
+        return;
+    }
+
+sync:
+    for (i = 0; i < n; i++) {
+        reqs[i]->head_len = 0;
+        reqs[i]->err = 0;
+        if ((reqs[i]->fd = open(reqs[i]->path, O_RDONLY | O_CLOEXEC)) < 0) {
+            reqs[i]->err = errno;
+            continue;
+        }
+        if ((len = read(reqs[i]->fd, reqs[i]->head, BATCHIO_HEAD)) < 0) {
+            reqs[i]->err = errno;
+        } else {
+            reqs[i]->head_len = len;
+        }
+        close(reqs[i]->fd);
+        reqs[i]->fd = -1;
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BATCHIO_H
+#define BATCHIO_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+// requests per batch, and the size of the submission queue
+#define BATCHIO_MAX 64
+// bytes read by batchio_head(): an ELF header
+#define BATCHIO_HEAD 64
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/*
+ * The metadata and first bytes of a file, filled by the calls below. err
+ * is the errno of the step that failed, or 0.
+ */
+struct batchio_req {
+    const char *path;
+    struct stat sb;
+    unsigned char head[BATCHIO_HEAD];
+    size_t head_len;
+    int err;
+    int fd;
+};
+
+/*
+ * Submits each step of a batch at once through an io_uring, which needs
+ * Linux 5.6. On older kernels, or where io_uring is disabled or filtered
+ * by seccomp, the same calls are made one by one. Not thread safe: one
+ * per thread.
+ */
+struct batchio {
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    void *stx;
+};
+
+/*
+ * Sets up io, with an io_uring if use_uring is set and the kernel has what
+ * it takes. Returns 1 if it does, 0 if the calls are made one by one.
+ */
+int batchio_init(struct batchio *io, int use_uring);
+
+void batchio_free(struct batchio *io);
+
+/*
+ * lstat() of the n (up to BATCHIO_MAX) reqs.
+ */
+void batchio_stat(struct batchio *io, struct batchio_req *reqs, size_t n);
+
+/*
+ * Reads the first BATCHIO_HEAD bytes, or fewer, of the n (up to
+ * BATCHIO_MAX) reqs: open(), read() and close() for each.
+ */
+void batchio_head(struct batchio *io, struct batchio_req **reqs, size_t n);
+
+#endif /* BATCHIO_H */
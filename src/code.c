@@ -15,85 +15,542 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <ftw.h>
+#include <elf.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
-#include <sys/inotify.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
-#include <libfastjson/json.h>
+#include <linux/fs.h>
 #include <libpatchelf/libpatchelf.h>
-
-#define E(...) \
-    E_(__FILE__, __FUNCTION__, __LINE__, errno, __VA_ARGS__)
-
-#define INOBUFLEN (sizeof(struct inotify_event) + NAME_MAX + 1)
+#include "batchio.h"
+#include "elflist.h"
+#include "extjson.h"
+#include "install.h"
+#include "log.h"
+#include "sha256.h"
+#include "treewatch.h"
+
+#define EXTJSON_NAME "extensions.json"
+
+#define DEBOUNCE_MIN_NS  100000000LL
+#define DEBOUNCE_MAX_NS  500000000LL
+#define DEBOUNCE_CAP_NS 3000000000LL
+
+// files below the extensions are patched once quiet for WATCH_SETTLE_NS
+#define WATCH_SETTLE_NS       20000000LL
+#define WATCH_SETTLE_CAP_NS  200000000LL
+#define WATCH_DIRS_DEFAULT 8192
+#define WATCH_PENDING_MAX 4096
+
+#define PATCH_DEQUE_SIZE 1024
+#define PATCH_JOBS_MAX 256
+#define PATCH_JOBS_DEFAULT 16
+#define PATCH_IDLE_NSEC 5000000L
+// directories run inline when the deque is full, with that many still open
+#define PATCH_INLINE_DEPTH 8
+#define PATCH_BATCH BATCHIO_MAX
+// libraries followed through DT_NEEDED when checking versions
+#define NEEDED_DEPTH 4
 
 #define BAKEXT ".patchbak"
 #define TMPEXT ".patchtmp"
+#define UNDOEXT ".patchundo"
+#define MANIFESTEXT ".manifest"
+#define ELFLISTEXT ".elflist"
+#define JOURNALEXT ".journal"
+
+#define MANIFEST_MAGIC "VSCPMAN1"
+#define MANIFEST_VERSION 1
+
+#define STAMP_MAGIC "VSCPSTM1"
+#define STAMP_VERSION 1
+
+#define STORE_OBJECTS "objects-v1"
+#define STORE_HASH_BUFSIZE (256 * 1024)
+
+// one byte requests and replies on the daemon socket
+#define DAEMON_REQ_PATCH 'P'
+#define DAEMON_REP_OK 'K'
+#define DAEMON_REP_FAIL 'F'
+#define DAEMON_CONNECT_TRIES 50
+#define DAEMON_CONNECT_NSEC 10000000L
+#define DAEMON_LINGER_MS 1000
+#define DAEMON_CHECK_MS 1000
+
+#define UNDO_MAGIC "VSCPUND1"
+
+#define JOURNAL_MAGIC "VSCPJRN1"
+#define JOURNAL_REC_MAGIC "JREC"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BLOCK 512
+#define JOURNAL_OP_COPY 0
+#define JOURNAL_OP_DATA 1
+
+#define TXNEXT ".txn"
+#define TXN_MAGIC "VSCPTXN1"
+#define TXN_COMMIT_MAGIC "TXNC"
+#define TXN_VERSION 1
+#define LOCKEXT ".lock"
+// how long a run waits for another one on the same root
+#define TXN_LOCK_TRIES 1500
+#define TXN_LOCK_NSEC 20000000L
+#define TXN_OP_BACKUP 0
+#define TXN_OP_RENAME 1
+#define TXN_OP_EDIT 2
+#define TXN_MAX_SIZE (64 * 1024 * 1024)
 
 #if defined(__i386__)
 #   define LIBDIR "/lib"
 #   define INTERP "ld-linux.so.2"
+#   define MULTIARCH "i386-linux-gnu"
 #elif defined(__x86_64__)
 #   define LIBDIR "/lib64"
 #   define INTERP "ld-linux-x86-64.so.2"
+#   define MULTIARCH "x86_64-linux-gnu"
 #elif defined(__arm__)
 #   define LIBDIR "/lib"
 #   define INTERP "ld-linux-armhf.so.3"
+#   define MULTIARCH "arm-linux-gnueabihf"
 #elif defined(__aarch64__)
 #   define LIBDIR "/lib"
 #   define INTERP "ld-linux-aarch64.so.1"
+#   define MULTIARCH "aarch64-linux-gnu"
 #else
 #   error "Unsupported CPU architecture"
 #endif
 
+enum patch_class {
+    PATCH_FAILED = -1,
+    PATCH_DONE = 0,
+    PATCH_NOT_ELF = 1,
+    PATCH_NO_INTERP = 2,
+    PATCH_COMPATIBLE = 3,
+    // put in place by txn_commit(), never in a manifest
+    PATCH_STAGED = 4,
+};
+
+/*
+ * On-disk manifest of a patched tree: a header followed by entries sorted
+ * by (dev, ino). A file whose size, mtime and ctime still match its entry
+ * is not opened again.
+ */
+struct manifest_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+    uint64_t config_hash;
+    uint64_t reserved;
+};
+
+struct manifest_entry {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    int32_t klass;
+    uint32_t reserved;
+};
+
+/*
+ * Generation stamp written after the CLI, the server directory and every
+ * extension were verified. It holds the identity of extensions.json at
+ * that time, so a launch can tell with one read and one stat whether
+ * anything may need patching.
+ */
+struct stamp {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t config_hash;
+    uint64_t extjson_dev;
+    uint64_t extjson_ino;
+    int64_t extjson_size;
+    int64_t extjson_mtime_ns;
+};
+
+struct manifest {
+    void *map;
+    size_t size;
+    const struct manifest_entry *entries;
+    size_t n_entries;
+};
+
+/*
+ * The list of executables shipped next to a tree (src/elflist.h). If
+ * there is one, only the listed files are patched, without a walk.
+ */
+struct elflist {
+    void *map;
+    size_t size;
+    const struct elflist_entry *entries;
+    size_t n_entries;
+    const char *strings;
+};
+
+/*
+ * Coalesces a burst of extensions.json writes into one patch pass: the
+ * quiet window starts at DEBOUNCE_MIN_NS, doubles with every further
+ * event up to DEBOUNCE_MAX_NS, and never delays a pass beyond
+ * DEBOUNCE_CAP_NS after the first event.
+ */
+struct debounce {
+    int64_t first_ns;
+    int64_t window_ns;
+};
+
+/*
+ * Files and directories that appeared inside installed extensions, and
+ * what else the extensions watch saw, since they were last handled.
+ */
+struct watch_item {
+    char *path;
+    int what;
+};
+
+struct watch_pending {
+    struct watch_item *items;
+    size_t n, cap;
+    int64_t first_ns;
+    int changed, lost, rewatch;
+    // put in place by the last and the current watch_patch(): the events
+    // of these are our own
+    struct stat *own, *own_next;
+    size_t n_own, cap_own, n_own_next, cap_own_next;
+};
+
+/*
+ * A `code` invocation that connected to the per-user daemon, followed
+ * until its process, which execs the CLI, exits.
+ */
+struct daemon_peer {
+    pid_t pid;
+    // tells the process from a later one that reuses its pid
+    unsigned long long start;
+};
+
+/*
+ * Connections to the per-user daemon, which last one request, and the
+ * processes that made them.
+ */
+struct daemon_clients {
+    int *fds;
+    size_t n;
+    size_t cap;
+    struct daemon_peer *peers;
+    size_t n_peers, cap_peers;
+    int64_t reaped;
+    int verified;
+};
+
+struct ext_state {
+    char *path;
+    char *version;
+    uint64_t fingerprint;
+};
+
+/*
+ * Per-root undo journal: a header followed by one record per patched file.
+ * A record rebuilds the original from the patched file with COPY ops
+ * (ranges of the patched file, which patchelf mostly just shifted) and
+ * DATA ops (original bytes, i.e. the headers that were rewritten). The
+ * last record of a path wins, and only while the patched file is still
+ * the one it was written for.
+ */
+struct journal_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct journal_record {
+    char magic[4];
+    uint32_t path_len;
+    uint32_t n_ops;
+    uint32_t mode;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t orig_size;
+    uint64_t data_len;
+    uint64_t data_hash;
+};
+
+struct journal_op {
+    uint32_t kind;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t len;
+};
+
+struct journal_buf {
+    char *data;
+    size_t len, cap;
+    size_t last;
+    uint32_t n_ops;
+};
+
+struct journal_entry {
+    char *relpath;
+    uint64_t offset;
+    int dead;
+};
+
+struct journal {
+    pthread_mutex_t lock;
+    const char *root;
+    size_t root_len;
+    char path[PATH_MAX];
+    int fd;
+    int loaded;
+    // loaded without create, and there was no journal
+    int missing;
+    uint64_t size;
+    size_t n_records;
+    struct journal_entry *entries;
+    size_t n_entries, cap_entries;
+    uint64_t *appended;
+    size_t n_appended, cap_appended;
+};
+
+/*
+ * Intent of a group commit (txn_commit()), a sidecar of the root: the ops
+ * that put the staged outputs of a run in place, made durable with them
+ * by one syncfs(), then a commit record appended once that returned. The
+ * file is removed when every op is applied.
+ *
+ * BACKUP renames src (a file) to dst unless dst exists, RENAME renames
+ * src (a staged file) to dst, EDIT writes n_edits ranges (a txn_edit and
+ * its bytes each) into dst if it is still the file (ino, size) they were
+ * planned for. Paths are absolute and NUL-terminated; ops_hash covers
+ * everything between the header and the commit record.
+ */
+struct txn_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_ops;
+    uint64_t ops_size;
+    uint64_t ops_hash;
+};
+
+struct txn_record {
+    uint32_t kind;
+    uint32_t src_len;
+    uint32_t dst_len;
+    uint32_t n_edits;
+    uint64_t ino;
+    uint64_t size;
+};
+
+struct txn_edit {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct txn_commit {
+    char magic[4];
+    uint32_t reserved;
+    uint64_t ops_hash;
+};
+
+// a record as parsed, pointing into the encoded ops
+struct txn_op {
+    uint32_t kind;
+    const char *src;
+    const char *dst;
+    uint32_t n_edits;
+    const char *edits;
+    uint64_t ino;
+    uint64_t size;
+};
+
+struct txn_done {
+    const char *path;
+    struct stat sb;
+};
+
+/*
+ * Outputs of patch_file() below root, staged by the patch workers and put
+ * in place together. ops holds them encoded as in the intent.
+ */
+struct txn {
+    pthread_mutex_t lock;
+    const char *root;
+    struct journal *jr;
+    struct journal_buf ops;
+    uint32_t n_ops;
+    struct txn_done *done;
+    size_t n_done, cap_done;
+    size_t n_failed;
+    // the root's lock sidecar, flock()ed by txn_recover(), released by
+    // txn_free()
+    int lock_fd;
+};
+
+/*
+ * Undo record of an in-place patch written by earlier versions, which is
+ * still replayed: the original bytes of each edited range.
+ */
+struct undo_header {
+    char magic[8];
+    uint32_t n_ranges;
+    uint32_t reserved;
+    uint64_t ino;
+    uint64_t size;
+};
+
+struct undo_range {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct trace_event {
+    const char *name;
+    int64_t ts_ns;
+    int64_t dur_ns;
+    char *arg;
+};
+
+struct trace_buf {
+    struct trace_buf *next;
+    long tid;
+    char name[32];
+    struct trace_event *events;
+    size_t n_events, cap_events;
+};
+
+/*
+ * A directory, a file, or a batch of files: then path is the directory,
+ * followed by n_names NUL-terminated names.
+ */
+struct patch_task {
+    int is_dir;
+    size_t n_names;
+    const struct elflist_entry *listed;
+    // in patch_worker.overflow
+    struct patch_task *next;
+    char path[];
+};
+
+struct patch_deque {
+    pthread_mutex_t lock;
+    size_t top, bottom;
+    struct patch_task *tasks[PATCH_DEQUE_SIZE];
+};
+
+struct patch_result {
+    char *path;
+    size_t logoff, loglen;
+    struct patch_worker *worker;
+};
+
+struct patch_worker {
+    struct patch_pool *pool;
+    struct patch_deque deque;
+    pthread_t thread;
+    int index;
+    FILE *logcap;
+    char *logbuf;
+    size_t loglen;
+    struct patch_result *results;
+    size_t n_results, cap_results;
+    struct manifest_entry *entries;
+    size_t n_entries, cap_entries;
+    struct batchio io;
+    int has_io;
+    // directories being read by tasks run inline
+    int inline_depth;
+    // directories pushed past a full deque, deep in inline runs
+    struct patch_task *overflow;
+};
+
+struct patch_pool {
+    struct patch_worker *workers;
+    int n_workers;
+    const struct manifest *manifest;
+    struct journal *journal;
+    struct txn *txn;
+    int unpatch;
+    atomic_long pending;
+    atomic_int n_idle;
+    atomic_int n_errors;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/*
+ * State of --install: files below the server directory and the CLI are
+ * patched on the way and recorded in their journals and the manifest.
+ */
+struct install_state {
+    struct journal srv_journal;
+    struct journal cli_journal;
+    struct manifest_entry *entries;
+    size_t n_entries, cap_entries;
+    int has_cli, cli_klass;
+    // of the ELF member being installed
+    int klass;
+    size_t n_patched, n_errors;
+};
+
 static int opt_patch_now = 0;
-static FILE *logfp = NULL;
+static int opt_jobs = 1;
+static int opt_inplace = 1;
+static int opt_patch_all = 0;
+static int opt_fast_start = 1;
+static int opt_daemon = 0;
+static int opt_io_uring = 1;
+static size_t opt_watch_dirs = WATCH_DIRS_DEFAULT;
+static int opt_fanotify;
+// directories below the extensions are not watched: no pass is skipped
+static int ext_unwatched = 0;
+static const char *opt_store = NULL;
+static const char *opt_trace = NULL;
+static __thread struct trace_buf *trace_tb = NULL;
+static struct trace_buf *trace_bufs = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t trace_t0 = 0;
 static const char *glibc_interp = LIBDIR "/" INTERP;
+static struct patchelf_versions host_versions;
+static pthread_once_t host_versions_once = PTHREAD_ONCE_INIT;
 static char glibc_interp_new[PATH_MAX];
+static char gnudir_path[PATH_MAX];
 static char serverdir_path[PATH_MAX];
 static char extdir_path[PATH_MAX];
 static char extjson_path[PATH_MAX];
+static char extstate_path[PATH_MAX];
 static char realcli_path[PATH_MAX];
 static char patchlog_path[PATH_MAX];
-
-
-static void E_(const char *filename, const char *funcname, long line,
-               int errnum, const char *fmt, ...)
-{
-    va_list args;
-    time_t t = time(NULL);
-    char *errmsg, *stime = ctime(&t);
-    FILE *fp = logfp ? logfp : stderr;
-
-    va_start(args, fmt);
-
-    if (stime) {
-        stime[strlen(stime)-1] = '\0';
-        fprintf(fp, "%s ", stime);
-    }
-
-    fprintf(fp, "[%s:%s():%lu] ", filename, funcname, line);
-    vfprintf(fp, fmt, args);
-
-    if (errnum && (errmsg = strerror(errnum))) {
-        fprintf(fp, ": %s", errmsg);
-    }
-
-    fputc('\n', fp);
-    fflush(fp);
-    errno = 0;
-    va_end(args);
-}
+static char stamp_path[PATH_MAX];
+static char store_interp[PATH_MAX];
+static char store_rpath[PATH_MAX];
+static char store_copy_dst[PATH_MAX];
+static size_t store_copy_base;
+static uint64_t store_gnu_hash;
+static int store_ok = 0;
+static pthread_once_t store_once = PTHREAD_ONCE_INIT;
 
 
 static int split_path(const char *path, char *dname, char *bname) {
@@ -110,7 +567,7 @@ static int split_path(const char *path, char *dname, char *bname) {
     memcpy(tmp, path, path_len + 1);
 
     if (!(dname_ = dirname(tmp))) {
-        E("dirname()", tmp);
+        E("dirname(): %s", tmp);
         goto end;
     }
 
@@ -119,7 +576,7 @@ static int split_path(const char *path, char *dname, char *bname) {
     memcpy(tmp, path, path_len + 1);
 
     if (!(bname_ = basename(tmp))) {
-        E("basename()", tmp);
+        E("basename(): %s", tmp);
         goto end;
     }
 
@@ -188,7 +645,18 @@ static int setup_paths(void)
         goto end;
     }
 
-    siz = snprintf(extjson_path, PATH_MAX, "%s/extensions/extensions.json",
+    siz = snprintf(extjson_path, PATH_MAX, "%s/extensions/" EXTJSON_NAME,
+                   dname);
+    if (siz < 0) {
+        E("snprintf(): %s", dname);
+        goto end;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", dname);
+        goto end;
+    }
+
+    siz = snprintf(extstate_path, PATH_MAX, "%s/extensions/.extensions.state",
                    dname);
     if (siz < 0) {
         E("snprintf(): %s", dname);
@@ -209,6 +677,16 @@ static int setup_paths(void)
         goto end;
     }
 
+    siz = snprintf(gnudir_path, PATH_MAX, "%s/gnu", dname);
+    if (siz < 0) {
+        E("snprintf(): %s", dname);
+        goto end;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", dname);
+        goto end;
+    }
+
     siz = snprintf(realcli_path, PATH_MAX, "%s/%s-cli", dname, fname);
     if (siz < 0) {
         E("snprintf(): %s", dname);
@@ -229,6 +707,16 @@ static int setup_paths(void)
         goto end;
     }
 
+    siz = snprintf(stamp_path, PATH_MAX, "%s/.%s.stamp", dname, fname);
+    if (siz < 0) {
+        E("snprintf(): %s", dname);
+        goto end;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", dname);
+        goto end;
+    }
+
     ret = 0;
 
 end:
@@ -240,8 +728,8 @@ static int setup_logfp(void)
 {
     int ret = -1;
 
-    if ((logfp = fopen(patchlog_path, "a")) == NULL) {
-        E("fopen(): %s", patchlog_path);
+    if (log_open(patchlog_path) < 0) {
+        E("open(): %s", patchlog_path);
         goto end;
     }
 
@@ -252,511 +740,6094 @@ end:
 }
 
 
-static int patch_file(const char *fpath, const struct stat *sb)
+static int array_reserve(void *arrp, size_t *cap, size_t n, size_t elsize)
 {
-    static const char elfmagic[] = {'\x7f', 'E', 'L', 'F'};
-
-    char interpreter[PATH_MAX], tmppath[PATH_MAX], bakpath[PATH_MAX];
-    char dname[PATH_MAX], fname[PATH_MAX];
-    char buff[4] = {0};
-    int ret = -1, fd = -1, siz;
+    void **arr = arrp, *p;
+    size_t newcap;
 
-    if (str_ends_with(fpath, BAKEXT) || str_ends_with(fpath, TMPEXT)) {
-        // backed up file or temp file
-        ret = 1;
-        goto end;
+    if (n < *cap) {
+        return 0;
     }
 
-    if (!S_ISREG(sb->st_mode) || sb->st_size <= 4) {
-        // cannot be a regular ELF file
-        ret = 1;
-        goto end;
+    newcap = *cap ? *cap * 2 : 64;
+    if (!(p = realloc(*arr, newcap * elsize))) {
+        E("realloc()");
+        return -1;
     }
 
-    if ((fd = open(fpath, O_RDONLY)) < 0) {
-        E("open(): %s", fpath);
-        goto end;
-    }
+    *arr = p;
+    *cap = newcap;
+    return 0;
+}
 
-    if (read(fd, buff, 4) <= 0) {
-        E("read(): %s", fpath);
-        goto end;
-    }
 
-    close(fd);
-    fd = -1;
+static uint64_t fnv1a64(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
 
-    if (memcmp(buff, elfmagic, 4) != 0) {
-        // not an ELF file
-        ret = 1;
-        goto end;
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
     }
 
-    if (split_path(fpath, dname, fname) < 0) {
-        E("split_path()");
-        goto end;
-    }
+    return h;
+}
 
-    siz = snprintf(tmppath, PATH_MAX, "%s/.%s%s", dname, fname, TMPEXT);
-    if (siz < 0) {
-        E("snprintf(): %s", fpath);
-        goto end;
-    } else if (siz >= PATH_MAX) {
-        errno = ENAMETOOLONG;
-        E("snprintf(): %s", fpath);
-        goto end;
-    }
 
-    siz = snprintf(bakpath, PATH_MAX, "%s/.%s%s", dname, fname, BAKEXT);
-    if (siz < 0) {
-        E("snprintf(): %s", fpath);
-        goto end;
-    } else if (siz >= PATH_MAX) {
-        errno = ENAMETOOLONG;
-        E("snprintf(): %s", fpath);
-        goto end;
-    }
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
 
-    // restore backed up file if exists
-    if (access(bakpath, F_OK) == 0) {
-        if (rename(bakpath, fpath) < 0) {
-            E("rename(): %s => %s", bakpath, fpath);
-            goto end;
-        }
-    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    if (patchelf_get_interpreter(fpath, interpreter, PATH_MAX, FALSE) < 0) {
-        // may be a static binary
-        ret = 1;
-        goto end;
-    }
 
-    // 无论原 interpreter 路径是什么，都强制 patch
-    errno = 0;
-    E("Patching %s (interpreter: %s) ...", fpath, interpreter);
+static struct trace_buf *trace_thread(const char *name)
+{
+    struct trace_buf *tb;
 
-    if (patchelf_set_interpreter(fpath, tmppath, glibc_interp_new, TRUE)) {
-        goto end;
+    if (trace_tb) {
+        return trace_tb;
     }
-    // 新增 rpath patch
-    char tmprpath[PATH_MAX];
-    siz = snprintf(tmprpath, PATH_MAX, "%s/.%s%s.rpath", dname, fname, TMPEXT);
-    if (siz < 0 || siz >= PATH_MAX) {
-        errno = ENAMETOOLONG;
-        E("snprintf tmprpath(): %s", fpath);
-        goto end;
-    }
-    char rpath_dir[PATH_MAX];
-    strncpy(rpath_dir, glibc_interp_new, sizeof(rpath_dir));
-    char *last_slash = strrchr(rpath_dir, '/');
-    if (last_slash) { *last_slash = '\0'; }
-    if (patchelf_set_rpath(tmppath, tmprpath, rpath_dir, TRUE)) {
-        goto end;
+
+    if (!(tb = calloc(1, sizeof(*tb)))) {
+        return NULL;
     }
 
-    if (rename(fpath, bakpath) < 0) {
-        E("rename(): %s => %s", fpath, bakpath);
-        goto end;
+    tb->tid = syscall(SYS_gettid);
+    snprintf(tb->name, sizeof(tb->name), "%s",
+             name ? name : tb->tid == getpid() ? "main" : "thread");
+
+    // buffers outlive their threads until the trace is written
+    pthread_mutex_lock(&trace_lock);
+    tb->next = trace_bufs;
+    trace_bufs = tb;
+    pthread_mutex_unlock(&trace_lock);
+
+    return trace_tb = tb;
+}
+
+
+/*
+ * Span timing: trace_begin() returns 0 when tracing is off, which makes
+ * the matching trace_end() a no-op.
+ */
+static int64_t trace_begin(void)
+{
+    return opt_trace ? monotonic_ns() : 0;
+}
+
+
+static void trace_span(const char *name, int64_t t0, int64_t t1,
+                       const char *arg)
+{
+    struct trace_buf *tb;
+    struct trace_event *ev;
+
+    if (!t0 || !(tb = trace_thread(NULL))) {
+        return;
     }
 
-    if (rename(tmprpath, fpath) < 0) {
-        E("rename(): %s => %s", tmprpath, fpath);
-        goto end;
+    if (array_reserve(&tb->events, &tb->cap_events, tb->n_events,
+                      sizeof(*tb->events)) < 0) {
+        return;
     }
 
-    ret = 0;
+    ev = &tb->events[tb->n_events++];
+    ev->name = name;
+    ev->ts_ns = t0;
+    ev->dur_ns = t1 - t0;
+    ev->arg = arg ? strdup(arg) : NULL;
+}
 
-end:
-    if (fd >= 0) {
-        close(fd);
+
+static void trace_end(const char *name, int64_t t0, const char *arg)
+{
+    if (t0) {
+        trace_span(name, t0, monotonic_ns(), arg);
     }
+}
 
-    return ret;
+
+static void trace_patchelf_span(const char *name, int64_t t0, int64_t t1)
+{
+    trace_span(name, t0, t1, NULL);
 }
 
 
-static inline int patch_file_ftw(const char *fpath, const struct stat *sb,
-                                 int, struct FTW *)
+static void trace_puts_json(FILE *fp, const char *s)
 {
-    patch_file(fpath, sb);
-    return 0;
+    fputc('"', fp);
+
+    for (; *s; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\') {
+            fprintf(fp, "\\%c", ch);
+        } else if (ch < 0x20) {
+            fprintf(fp, "\\u%04x", ch);
+        } else {
+            fputc(ch, fp);
+        }
+    }
+
+    fputc('"', fp);
 }
 
 
-static int check_patched(const char *path)
+// no more events: the trace belongs to the parent, or is being written
+static void trace_disable(void)
 {
-    int ret = -1, fd = -1, siz;
-    char abspath[PATH_MAX], patched[PATH_MAX], path_prev[PATH_MAX] = {0};
-    char dname[PATH_MAX], fname[PATH_MAX];
+    opt_trace = NULL;
+    patchelf_set_span_hook(NULL);
+}
 
-    if (opt_patch_now) {
-        goto end;
-    }
 
-    if (!realpath(path, abspath)) {
-        E("realpath(): %s", path);
-        goto end;
+/*
+ * Write all spans as Chrome trace-event JSON, which chrome://tracing and
+ * Perfetto load directly. Runs once, before exec or at exit.
+ */
+static void trace_write(void)
+{
+    struct trace_buf *tb;
+    const char *path = opt_trace;
+    const char *sep = "";
+    long pid = getpid();
+    FILE *fp;
+    size_t i;
+
+    if (!path) {
+        return;
     }
 
-    if (split_path(path, dname, fname) < 0) {
-        E("split_path()");
-        goto end;
-    }
+    trace_disable();
 
-    siz = snprintf(patched, PATH_MAX, "%s/.%s.patched", dname, fname);
-    if (siz < 0) {
-        E("snprintf(): %s", path);
-        goto end;
-    } else if (siz >= PATH_MAX) {
-        errno = ENAMETOOLONG;
-        E("snprintf(): %s", path);
-        goto end;
+    if (!(fp = fopen(path, "w"))) {
+        E("fopen(): %s", path);
+        return;
     }
 
-    if ((fd = open(patched, O_RDONLY)) < 0) {
-        if (errno != ENOENT) {
-            E("open(): %s", patched);
+    fputs("{\"traceEvents\":[\n", fp);
+
+    pthread_mutex_lock(&trace_lock);
+    for (tb = trace_bufs; tb; tb = tb->next) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,"
+                "\"tid\":%ld,\"args\":{\"name\":", sep, pid, tb->tid);
+        trace_puts_json(fp, tb->name);
+        fputs("}}", fp);
+        sep = ",\n";
+
+        for (i = 0; i < tb->n_events; i++) {
+            struct trace_event *ev = &tb->events[i];
+            int64_t ts = ev->ts_ns - trace_t0;
+
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"patch\",\"ph\":\"X\","
+                    "\"ts\":%lld.%03lld,\"dur\":%lld.%03lld,\"pid\":%ld,"
+                    "\"tid\":%ld", ev->name, (long long) (ts / 1000),
+                    (long long) (ts % 1000), (long long) (ev->dur_ns / 1000),
+                    (long long) (ev->dur_ns % 1000), pid, tb->tid);
+            if (ev->arg) {
+                fputs(",\"args\":{\"path\":", fp);
+                trace_puts_json(fp, ev->arg);
+                fputc('}', fp);
+            }
+            fputc('}', fp);
         }
-        goto end;
     }
+    pthread_mutex_unlock(&trace_lock);
 
-    if (read(fd, path_prev, PATH_MAX) <= 0) {
-        E("read(): %s", patched);
-        goto end;
+    fputs("\n]}\n", fp);
+
+    if (fclose(fp) != 0) {
+        E("fclose(): %s", path);
     }
+}
 
-    if (strncmp(abspath, path_prev, PATH_MAX) != 0) {
-        goto end;
+
+/*
+ * Take --trace=<file> out of argv, so that the CLI never sees it.
+ */
+static void setup_trace(int *argc, char **argv)
+{
+    int i, n;
+
+    for (i = 0, n = 0; i < *argc; i++) {
+        if (i > 0 && !strncmp(argv[i], "--trace=", 8)) {
+            opt_trace = argv[i] + 8;
+            continue;
+        }
+        argv[n++] = argv[i];
     }
 
-    ret = 0;
+    argv[n] = NULL;
+    *argc = n;
 
-end:
-    if (fd >= 0) {
-        close(fd);
+    if (opt_trace && !*opt_trace) {
+        opt_trace = NULL;
     }
 
-    return ret;
+    if (opt_trace) {
+        trace_t0 = monotonic_ns();
+        trace_thread("main");
+        patchelf_set_span_hook(trace_patchelf_span);
+        atexit(trace_write);
+    }
 }
 
 
-static int set_patched(const char *path)
+static int root_sidecar_path(const char *root, const char *ext, char *path)
 {
-    int ret = -1, fd = -1, siz;
-    ssize_t abspath_size;
-    char abspath[PATH_MAX], patched[PATH_MAX];
     char dname[PATH_MAX], fname[PATH_MAX];
+    int siz;
 
-    if (!realpath(path, abspath)) {
-        E("realpath(): %s", path);
-        goto end;
-    }
-
-    abspath_size = strlen(abspath);
-
-    if (split_path(path, dname, fname) < 0) {
+    if (split_path(root, dname, fname) < 0) {
         E("split_path()");
-        goto end;
+        return -1;
     }
 
-    siz = snprintf(patched, PATH_MAX, "%s/.%s.patched", dname, fname);
+    siz = snprintf(path, PATH_MAX, "%s/.%s%s", dname, fname, ext);
     if (siz < 0) {
-        E("snprintf(): %s", path);
-        goto end;
+        E("snprintf(): %s", root);
+        return -1;
     } else if (siz >= PATH_MAX) {
         errno = ENAMETOOLONG;
-        E("snprintf(): %s", path);
-        goto end;
+        E("snprintf(): %s", root);
+        return -1;
     }
 
-    if ((fd = open(patched, O_CREAT | O_TRUNC | O_WRONLY,
-                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-        E("open(): %s", patched);
-        goto end;
-    }
+    return 0;
+}
 
-    if (write(fd, abspath, abspath_size) != abspath_size) {
-        E("write(): %s", patched);
+
+/*
+ * Remove the sidecars of root, which is gone.
+ */
+static void root_sidecars_remove(const char *root)
+{
+    static const char *const exts[] = {
+        MANIFESTEXT, ELFLISTEXT, JOURNALEXT, TXNEXT, LOCKEXT,
+    };
+    char path[PATH_MAX];
+    size_t i;
+
+    for (i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+        if (root_sidecar_path(root, exts[i], path) == 0 &&
+            unlink(path) < 0 && errno != ENOENT) {
+            E("unlink(): %s", path);
+        }
+    }
+}
+
+
+static int journal_buf_put(struct journal_buf *buf, const void *data,
+                           size_t len)
+{
+    char *p;
+    size_t newcap;
+
+    if (buf->len + len > buf->cap) {
+        newcap = buf->cap ? buf->cap : 4096;
+        while (newcap < buf->len + len) {
+            newcap *= 2;
+        }
+        if (!(p = realloc(buf->data, newcap))) {
+            E("realloc()");
+            return -1;
+        }
+        buf->data = p;
+        buf->cap = newcap;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+
+static int journal_buf_op(struct journal_buf *buf, uint32_t kind,
+                          uint64_t offset, const void *data, uint64_t len)
+{
+    struct journal_op op = {0};
+
+    if (!len) {
+        return 0;
+    }
+
+    if (buf->n_ops) {
+        // extend the previous op where the ranges are contiguous
+        memcpy(&op, buf->data + buf->last, sizeof(op));
+        if (op.kind == kind &&
+            (kind == JOURNAL_OP_DATA || op.offset + op.len == offset)) {
+            op.len += len;
+            memcpy(buf->data + buf->last, &op, sizeof(op));
+            return kind == JOURNAL_OP_DATA ?
+                   journal_buf_put(buf, data, len) : 0;
+        }
+    }
+
+    op.kind = kind;
+    op.reserved = 0;
+    op.offset = kind == JOURNAL_OP_COPY ? offset : 0;
+    op.len = len;
+    buf->last = buf->len;
+    buf->n_ops++;
+
+    if (journal_buf_put(buf, &op, sizeof(op)) < 0) {
+        return -1;
+    }
+
+    return kind == JOURNAL_OP_DATA ? journal_buf_put(buf, data, len) : 0;
+}
+
+
+static uint64_t journal_block_hash(const unsigned char *p)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL, w;
+    size_t i;
+
+    for (i = 0; i < JOURNAL_BLOCK; i += sizeof(w)) {
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+    }
+
+    return h;
+}
+
+
+/*
+ * Describe orig in terms of patched: blocks of orig found in patched
+ * (patchelf only shifts whole pages, or appends) become COPY ops, the
+ * rest - mainly the rewritten headers - is stored as DATA.
+ */
+static int journal_delta(const unsigned char *orig, size_t orig_size,
+                         const unsigned char *patched, size_t patched_size,
+                         struct journal_buf *buf)
+{
+    struct {
+        uint64_t hash;
+        uint64_t pos;
+    } *table = NULL;
+    size_t n_blocks = patched_size / JOURNAL_BLOCK, mask, pos, k;
+    int64_t shift = 0;
+    uint64_t h;
+    int ret = -1;
+
+    for (mask = 1; mask < n_blocks * 2; mask <<= 1);
+    mask--;
+
+    if (!(table = calloc(mask + 1, sizeof(*table)))) {
+        E("calloc()");
+        goto end;
+    }
+
+    for (pos = 0; pos < n_blocks; pos++) {
+        h = journal_block_hash(patched + pos * JOURNAL_BLOCK);
+        for (k = h & mask; table[k].pos; k = (k + 1) & mask) {
+            if (table[k].hash == h) {
+                // keep the first of identical blocks (e.g. zero padding)
+                break;
+            }
+        }
+        if (!table[k].pos) {
+            table[k].hash = h;
+            table[k].pos = pos * JOURNAL_BLOCK + 1;
+        }
+    }
+
+    for (pos = 0; pos < orig_size; pos += JOURNAL_BLOCK) {
+        size_t len = orig_size - pos < JOURNAL_BLOCK ?
+                     orig_size - pos : JOURNAL_BLOCK;
+        int64_t src = (int64_t) pos + shift;
+        int found = 0;
+
+        if (src >= 0 && (uint64_t) src + len <= patched_size &&
+            !memcmp(orig + pos, patched + src, len)) {
+            found = 1;
+        } else if (len == JOURNAL_BLOCK) {
+            h = journal_block_hash(orig + pos);
+            for (k = h & mask; table[k].pos; k = (k + 1) & mask) {
+                src = table[k].pos - 1;
+                if (table[k].hash == h &&
+                    !memcmp(orig + pos, patched + src, len)) {
+                    shift = src - (int64_t) pos;
+                    found = 1;
+                    break;
+                }
+            }
+        }
+
+        if (found) {
+            if (journal_buf_op(buf, JOURNAL_OP_COPY, src, NULL, len) < 0) {
+                goto end;
+            }
+        } else if (journal_buf_op(buf, JOURNAL_OP_DATA, 0, orig + pos,
+                                  len) < 0) {
+            goto end;
+        }
+    }
+
+    ret = 0;
+
+end:
+    free(table);
+    return ret;
+}
+
+
+static int journal_entry_cmp(const void *a, const void *b)
+{
+    const struct journal_entry *ea = a, *eb = b;
+    int r = strcmp(ea->relpath, eb->relpath);
+
+    if (r) {
+        return r;
+    }
+
+    return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+
+static const char *journal_relpath(const struct journal *jr,
+                                   const char *fpath)
+{
+    if (strncmp(fpath, jr->root, jr->root_len) != 0) {
+        return NULL;
+    }
+
+    if (fpath[jr->root_len] == '\0') {
+        return "";
+    }
+
+    return fpath[jr->root_len] == '/' ? fpath + jr->root_len + 1 : NULL;
+}
+
+
+static void journal_init(struct journal *jr, const char *root)
+{
+    memset(jr, 0, sizeof(*jr));
+    pthread_mutex_init(&jr->lock, NULL);
+    jr->root = root;
+    jr->root_len = strlen(root);
+    jr->fd = -1;
+}
+
+
+/*
+ * Index the journal of jr->root, creating it if needed and create is set.
+ * Called with jr->lock held, on first use: a run that patches nothing never
+ * opens it, and one that only restores never creates it.
+ */
+static int journal_load(struct journal *jr, int create)
+{
+    struct journal_header hdr;
+    struct journal_record rec;
+    struct journal_entry *ent;
+    char relpath[PATH_MAX];
+    struct stat sb;
+    uint64_t off;
+    size_t i, n;
+
+    if (jr->loaded && !(jr->missing && create)) {
+        return jr->fd >= 0 || jr->missing ? 0 : -1;
+    }
+
+    jr->loaded = 1;
+    jr->missing = 0;
+
+    if (root_sidecar_path(jr->root, JOURNALEXT, jr->path) < 0) {
+        return -1;
+    }
+
+    if ((jr->fd = open(jr->path, (create ? O_CREAT : 0) | O_RDWR | O_APPEND |
+                       O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0) {
+        if (!create && errno == ENOENT) {
+            // nothing to restore
+            errno = 0;
+            jr->missing = 1;
+            return 0;
+        }
+        E("open(): %s", jr->path);
+        return -1;
+    }
+
+    if (fstat(jr->fd, &sb) < 0) {
+        E("fstat(): %s", jr->path);
+        goto fail;
+    }
+
+    if ((size_t) sb.st_size < sizeof(hdr) ||
+        pread(jr->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != JOURNAL_VERSION) {
+        // new, foreign or corrupt: start over
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+        hdr.version = JOURNAL_VERSION;
+        if (ftruncate(jr->fd, 0) < 0 ||
+            write(jr->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+            E("write(): %s", jr->path);
+            goto fail;
+        }
+        jr->size = sizeof(hdr);
+        return 0;
+    }
+
+    for (off = sizeof(hdr); off + sizeof(rec) <= (uint64_t) sb.st_size;
+         off += sizeof(rec) + rec.path_len + rec.data_len) {
+        if (pread(jr->fd, &rec, sizeof(rec), off) != sizeof(rec) ||
+            memcmp(rec.magic, JOURNAL_REC_MAGIC, sizeof(rec.magic)) != 0 ||
+            rec.path_len >= PATH_MAX ||
+            rec.data_len > (uint64_t) sb.st_size ||
+            off + sizeof(rec) + rec.path_len + rec.data_len >
+                (uint64_t) sb.st_size ||
+            pread(jr->fd, relpath, rec.path_len, off + sizeof(rec)) !=
+                (ssize_t) rec.path_len) {
+            break;
+        }
+
+        relpath[rec.path_len] = '\0';
+
+        if (array_reserve(&jr->entries, &jr->cap_entries, jr->n_entries,
+                          sizeof(*jr->entries)) < 0 ||
+            !(jr->entries[jr->n_entries].relpath = strdup(relpath))) {
+            goto fail;
+        }
+
+        jr->entries[jr->n_entries].offset = off;
+        jr->entries[jr->n_entries].dead = 0;
+        jr->n_entries++;
+        jr->n_records++;
+    }
+
+    if (off != (uint64_t) sb.st_size && ftruncate(jr->fd, off) < 0) {
+        // torn append of an interrupted run
+        E("ftruncate(): %s", jr->path);
+        goto fail;
+    }
+
+    jr->size = off;
+
+    // keep the last record of each path
+    qsort(jr->entries, jr->n_entries, sizeof(*jr->entries), journal_entry_cmp);
+
+    for (i = 0, n = 0; i < jr->n_entries; i++) {
+        ent = &jr->entries[i];
+        if (i + 1 < jr->n_entries &&
+            !strcmp(ent->relpath, jr->entries[i + 1].relpath)) {
+            free(ent->relpath);
+            continue;
+        }
+        jr->entries[n++] = *ent;
+    }
+
+    jr->n_entries = n;
+    return 0;
+
+fail:
+    close(jr->fd);
+    jr->fd = -1;
+    return -1;
+}
+
+
+static struct journal_entry *journal_lookup(struct journal *jr,
+                                            const char *relpath)
+{
+    struct journal_entry key = {.relpath = (char *) relpath}, *ent;
+    size_t lo = 0, hi = jr->n_entries;
+
+    // the entries are unique per path, so offsets are not compared
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int r;
+
+        ent = &jr->entries[mid];
+        if (!(r = strcmp(key.relpath, ent->relpath))) {
+            return ent->dead ? NULL : ent;
+        }
+        if (r < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Record how to get the original of fpath back from the patched file
+ * described by patched. mtime_ns is 0 for in-place edits, where the file
+ * is modified after the record was written.
+ */
+static int journal_append(struct journal *jr, const char *fpath,
+                          const struct stat *orig, const struct stat *patched,
+                          int64_t mtime_ns, const struct journal_buf *ops)
+{
+    struct journal_record rec = {0};
+    struct journal_entry *ent;
+    struct iovec iov[3];
+    const char *relpath;
+    size_t total;
+    int ret = -1;
+
+    if (!(relpath = journal_relpath(jr, fpath))) {
+        errno = EINVAL;
+        E("not below %s: %s", jr->root, fpath);
+        return -1;
+    }
+
+    memcpy(rec.magic, JOURNAL_REC_MAGIC, sizeof(rec.magic));
+    rec.path_len = strlen(relpath);
+    rec.n_ops = ops->n_ops;
+    rec.mode = orig->st_mode & 07777;
+    rec.ino = patched->st_ino;
+    rec.size = patched->st_size;
+    rec.mtime_ns = mtime_ns;
+    rec.orig_size = orig->st_size;
+    rec.data_len = ops->len;
+    rec.data_hash = fnv1a64(fnv1a64(0xcbf29ce484222325ULL, relpath,
+                                    rec.path_len), ops->data, ops->len);
+
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = (char *) relpath;
+    iov[1].iov_len = rec.path_len;
+    iov[2].iov_base = ops->data;
+    iov[2].iov_len = ops->len;
+    total = sizeof(rec) + rec.path_len + ops->len;
+
+    pthread_mutex_lock(&jr->lock);
+
+    if (journal_load(jr, 1) < 0) {
+        goto end;
+    }
+
+    if (writev(jr->fd, iov, 3) != (ssize_t) total) {
+        E("writev(): %s", jr->path);
+        if (ftruncate(jr->fd, jr->size) < 0) {
+            E("ftruncate(): %s", jr->path);
+        }
         goto end;
     }
 
+    if ((ent = journal_lookup(jr, relpath))) {
+        // superseded
+        ent->dead = 1;
+    }
+
+    if (array_reserve(&jr->appended, &jr->cap_appended, jr->n_appended,
+                      sizeof(*jr->appended)) == 0) {
+        jr->appended[jr->n_appended++] = jr->size;
+    }
+
+    jr->size += total;
+    jr->n_records++;
     ret = 0;
 
 end:
+    pthread_mutex_unlock(&jr->lock);
+    return ret;
+}
+
+
+/*
+ * Rebuild the original of fpath from the journal, through tmppath.
+ * Returns 1 if it was restored, 0 if the journal has no record for the
+ * current file and -1 on error.
+ */
+static int journal_restore(struct journal *jr, const char *fpath,
+                           const char *tmppath)
+{
+    struct journal_record rec;
+    struct journal_entry *ent;
+    struct journal_op op;
+    struct stat sb;
+    const char *relpath;
+    unsigned char *map = MAP_FAILED;
+    char *data = NULL;
+    uint64_t pos, written = 0;
+    uint32_t i;
+    int ret = -1, fd = -1, tfd = -1;
+
+    if (!jr || !(relpath = journal_relpath(jr, fpath))) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&jr->lock);
+    if (journal_load(jr, 0) < 0) {
+        pthread_mutex_unlock(&jr->lock);
+        return -1;
+    }
+    ent = journal_lookup(jr, relpath);
+    pthread_mutex_unlock(&jr->lock);
+
+    if (!ent) {
+        return 0;
+    }
+
+    if ((fd = open(fpath, O_RDONLY | O_CLOEXEC)) < 0) {
+        E("open(): %s", fpath);
+        goto end;
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        E("fstat(): %s", fpath);
+        goto end;
+    }
+
+    if (pread(jr->fd, &rec, sizeof(rec), ent->offset) != sizeof(rec)) {
+        E("pread(): %s", jr->path);
+        goto end;
+    }
+
+    if (rec.ino != (uint64_t) sb.st_ino || rec.size != (uint64_t) sb.st_size ||
+        (rec.mtime_ns && rec.mtime_ns != sb.st_mtim.tv_sec * 1000000000LL +
+                                         sb.st_mtim.tv_nsec)) {
+        // the file was replaced since it was patched
+        ent->dead = 1;
+        ret = 0;
+        goto end;
+    }
+
+    if (!(data = malloc(rec.data_len ? rec.data_len : 1))) {
+        E("malloc()");
+        goto end;
+    }
+
+    if (pread(jr->fd, data, rec.data_len,
+              ent->offset + sizeof(rec) + rec.path_len) !=
+            (ssize_t) rec.data_len ||
+        fnv1a64(fnv1a64(0xcbf29ce484222325ULL, relpath, rec.path_len),
+                data, rec.data_len) != rec.data_hash) {
+        errno = EINVAL;
+        E("invalid journal record: %s: %s", jr->path, relpath);
+        goto end;
+    }
+
+    if (sb.st_size &&
+        (map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+            MAP_FAILED) {
+        E("mmap(): %s", fpath);
+        goto end;
+    }
+
+    if ((tfd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+                    S_IRUSR | S_IWUSR)) < 0) {
+        E("open(): %s", tmppath);
+        goto end;
+    }
+
+    for (i = 0, pos = 0; i < rec.n_ops; i++) {
+        const void *src;
+
+        if (pos + sizeof(op) > rec.data_len) {
+            goto invalid;
+        }
+
+        memcpy(&op, data + pos, sizeof(op));
+        pos += sizeof(op);
+
+        if (op.kind == JOURNAL_OP_COPY && op.offset <= rec.size &&
+            op.len <= rec.size - op.offset) {
+            src = map + op.offset;
+        } else if (op.kind == JOURNAL_OP_DATA && op.len <= rec.data_len - pos) {
+            src = data + pos;
+            pos += op.len;
+        } else {
+            goto invalid;
+        }
+
+        if (write(tfd, src, op.len) != (ssize_t) op.len) {
+            E("write(): %s", tmppath);
+            goto end;
+        }
+
+        written += op.len;
+    }
+
+    if (written != rec.orig_size) {
+        goto invalid;
+    }
+
+    if (fchmod(tfd, rec.mode) < 0) {
+        E("fchmod(): %s", tmppath);
+        goto end;
+    }
+
+    close(tfd);
+    tfd = -1;
+
+    if (rename(tmppath, fpath) < 0) {
+        E("rename(): %s => %s", tmppath, fpath);
+        goto end;
+    }
+
+    ent->dead = 1;
+    ret = 1;
+    goto end;
+
+invalid:
+    errno = EINVAL;
+    E("invalid journal record: %s: %s", jr->path, relpath);
+
+end:
+    if (tfd >= 0) {
+        close(tfd);
+        unlink(tmppath);
+    }
+
+    if (map != MAP_FAILED) {
+        munmap(map, sb.st_size);
+    }
+
     if (fd >= 0) {
         close(fd);
     }
 
+    free(data);
+    return ret;
+}
+
+
+static int journal_copy_record(struct journal *jr, int fd, uint64_t offset)
+{
+    struct journal_record rec;
+    char buf[65536];
+    uint64_t len;
+    ssize_t n;
+
+    if (pread(jr->fd, &rec, sizeof(rec), offset) != sizeof(rec)) {
+        E("pread(): %s", jr->path);
+        return -1;
+    }
+
+    for (len = sizeof(rec) + rec.path_len + rec.data_len; len; len -= n) {
+        if ((n = pread(jr->fd, buf, len < sizeof(buf) ? len : sizeof(buf),
+                       offset)) <= 0 ||
+            write(fd, buf, n) != n) {
+            E("copy: %s", jr->path);
+            return -1;
+        }
+        offset += n;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Drop superseded and replayed records, then release jr. The journal is
+ * removed once nothing in the tree is patched any more.
+ */
+static int journal_close(struct journal *jr)
+{
+    struct journal_header hdr = {0};
+    char tmppath[PATH_MAX];
+    size_t i, n_live = 0;
+    int ret = -1, fd = -1, siz;
+
+    if (jr->fd < 0) {
+        ret = 0;
+        goto end;
+    }
+
+    for (i = 0; i < jr->n_entries; i++) {
+        n_live += !jr->entries[i].dead;
+    }
+    n_live += jr->n_appended;
+
+    if (n_live == jr->n_records) {
+        ret = 0;
+        goto end;
+    }
+
+    if (!n_live) {
+        if (unlink(jr->path) < 0) {
+            E("unlink(): %s", jr->path);
+            goto end;
+        }
+        ret = 0;
+        goto end;
+    }
+
+    siz = snprintf(tmppath, PATH_MAX, "%s.%ld%s", jr->path, (long) getpid(),
+                   TMPEXT);
+    if (siz < 0) {
+        E("snprintf(): %s", jr->path);
+        goto end;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", jr->path);
+        goto end;
+    }
+
+    if ((fd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR)) < 0) {
+        E("open(): %s", tmppath);
+        goto end;
+    }
+
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.version = JOURNAL_VERSION;
+
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        E("write(): %s", tmppath);
+        goto end;
+    }
+
+    for (i = 0; i < jr->n_entries; i++) {
+        if (!jr->entries[i].dead &&
+            journal_copy_record(jr, fd, jr->entries[i].offset) < 0) {
+            goto end;
+        }
+    }
+
+    for (i = 0; i < jr->n_appended; i++) {
+        if (journal_copy_record(jr, fd, jr->appended[i]) < 0) {
+            goto end;
+        }
+    }
+
+    close(fd);
+    fd = -1;
+
+    if (rename(tmppath, jr->path) < 0) {
+        E("rename(): %s => %s", tmppath, jr->path);
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmppath);
+    }
+
+    if (jr->fd >= 0) {
+        close(jr->fd);
+    }
+
+    for (i = 0; i < jr->n_entries; i++) {
+        free(jr->entries[i].relpath);
+    }
+
+    free(jr->entries);
+    free(jr->appended);
+    pthread_mutex_destroy(&jr->lock);
+    memset(jr, 0, sizeof(*jr));
+    jr->fd = -1;
+
+    return ret;
+}
+
+
+/*
+ * Returns 0 if the original bytes were written back, 1 if the record did
+ * not belong to the current file and was discarded, -1 on error.
+ */
+static int undo_apply(const char *fpath, const char *undopath)
+{
+    struct undo_header hdr;
+    struct undo_range range;
+    char buf[PATH_MAX];
+    struct stat sb;
+    int ret = -1, fd = -1, ufd = -1;
+    uint32_t i;
+
+    if ((ufd = open(undopath, O_RDONLY | O_CLOEXEC)) < 0) {
+        E("open(): %s", undopath);
+        goto end;
+    }
+
+    if (read(ufd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, UNDO_MAGIC, sizeof(hdr.magic)) != 0) {
+        errno = EINVAL;
+        E("invalid undo record: %s", undopath);
+        goto end;
+    }
+
+    if ((fd = open(fpath, O_WRONLY | O_CLOEXEC)) < 0) {
+        E("open(): %s", fpath);
+        goto end;
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        E("fstat(): %s", fpath);
+        goto end;
+    }
+
+    if (sb.st_ino != hdr.ino || (uint64_t) sb.st_size != hdr.size) {
+        // the file was replaced since it was patched
+        ret = unlink(undopath) < 0 ? -1 : 1;
+        goto end;
+    }
+
+    for (i = 0; i < hdr.n_ranges; i++) {
+        if (read(ufd, &range, sizeof(range)) != sizeof(range) ||
+            range.size > sizeof(buf) ||
+            read(ufd, buf, range.size) != (ssize_t) range.size) {
+            errno = EINVAL;
+            E("invalid undo record: %s", undopath);
+            goto end;
+        }
+
+        if (pwrite(fd, buf, range.size, range.offset) != (ssize_t) range.size) {
+            E("pwrite(): %s", fpath);
+            goto end;
+        }
+    }
+
+    close(fd);
+    fd = -1;
+
+    if (unlink(undopath) < 0) {
+        E("unlink(): %s", undopath);
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (ufd >= 0) {
+        close(ufd);
+    }
+
+    return ret;
+}
+
+
+/*
+ * Put back the original of a previously patched file. Returns 1 if
+ * something was restored, 0 if there was no backup and -1 on error.
+ */
+static int restore_backup(const char *fpath, const char *tmppath,
+                          const char *bakpath, const char *undopath,
+                          struct journal *jr)
+{
+    // full copies and undo records of earlier versions come first
+    if (access(bakpath, F_OK) == 0) {
+        if (rename(bakpath, fpath) < 0) {
+            E("rename(): %s => %s", bakpath, fpath);
+            return -1;
+        }
+        return 1;
+    }
+
+    if (access(undopath, F_OK) == 0) {
+        switch (undo_apply(fpath, undopath)) {
+        case 0:
+            return 1;
+        case 1:
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return journal_restore(jr, fpath, tmppath);
+}
+
+
+static int reflink_backup(int fd, const char *bakpath)
+{
+    int bfd;
+
+    if ((bfd = open(bakpath, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC,
+                    S_IRUSR | S_IWUSR)) < 0) {
+        return -1;
+    }
+
+    if (ioctl(bfd, FICLONE, fd) < 0) {
+        close(bfd);
+        unlink(bakpath);
+        return -1;
+    }
+
+    close(bfd);
+    return 0;
+}
+
+
+static int patchelf_edit_cmp(const void *a, const void *b)
+{
+    const struct patchelf_edit *ea = a, *eb = b;
+    return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+
+static int journal_inplace(struct journal *jr, const char *fpath, int fd,
+                           const struct stat *sb, struct patchelf_edit *edits,
+                           size_t n_edits)
+{
+    struct journal_buf ops = {0};
+    char buf[PATH_MAX];
+    uint64_t pos = 0;
+    size_t i;
+    int ret = -1;
+
+    qsort(edits, n_edits, sizeof(*edits), patchelf_edit_cmp);
+
+    for (i = 0; i < n_edits; i++) {
+        if (edits[i].offset < pos || edits[i].size > sizeof(buf)) {
+            errno = EINVAL;
+            E("overlapping edits: %s", fpath);
+            goto end;
+        }
+
+        if (pread(fd, buf, edits[i].size, edits[i].offset) !=
+                (ssize_t) edits[i].size) {
+            E("pread(): %s", fpath);
+            goto end;
+        }
+
+        if (journal_buf_op(&ops, JOURNAL_OP_COPY, pos, NULL,
+                           edits[i].offset - pos) < 0 ||
+            journal_buf_op(&ops, JOURNAL_OP_DATA, 0, buf,
+                           edits[i].size) < 0) {
+            goto end;
+        }
+
+        pos = edits[i].offset + edits[i].size;
+    }
+
+    if (journal_buf_op(&ops, JOURNAL_OP_COPY, pos, NULL,
+                       sb->st_size - pos) < 0) {
+        goto end;
+    }
+
+    ret = journal_append(jr, fpath, sb, sb, 0, &ops);
+
+end:
+    free(ops.data);
+    return ret;
+}
+
+
+/*
+ * Record how to get orig back from the patched file open at tfd.
+ */
+static int journal_rewrite_mem(struct journal *jr, const char *fpath,
+                               const void *orig, const struct stat *sb,
+                               int tfd, const struct stat *tsb)
+{
+    struct journal_buf ops = {0};
+    void *patched = MAP_FAILED;
+    int ret = -1;
+
+    if ((patched = mmap(NULL, tsb->st_size, PROT_READ, MAP_PRIVATE, tfd, 0))
+            == MAP_FAILED) {
+        E("mmap(): %s", fpath);
+        goto end;
+    }
+
+    if (journal_delta(orig, sb->st_size, patched, tsb->st_size, &ops) < 0) {
+        goto end;
+    }
+
+    ret = journal_append(jr, fpath, sb, tsb,
+                         tsb->st_mtim.tv_sec * 1000000000LL +
+                         tsb->st_mtim.tv_nsec, &ops);
+
+end:
+    if (patched != MAP_FAILED) {
+        munmap(patched, tsb->st_size);
+    }
+
+    free(ops.data);
+    return ret;
+}
+
+
+static int journal_rewrite(struct journal *jr, const char *fpath,
+                           const struct stat *sb, const char *tmppath,
+                           const struct stat *tsb)
+{
+    void *orig = MAP_FAILED;
+    int ret = -1, fd = -1, tfd = -1;
+
+    if ((fd = open(fpath, O_RDONLY | O_CLOEXEC)) < 0) {
+        E("open(): %s", fpath);
+        goto end;
+    }
+
+    if ((tfd = open(tmppath, O_RDONLY | O_CLOEXEC)) < 0) {
+        E("open(): %s", tmppath);
+        goto end;
+    }
+
+    if ((orig = mmap(NULL, sb->st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+            MAP_FAILED) {
+        E("mmap(): %s", fpath);
+        goto end;
+    }
+
+    ret = journal_rewrite_mem(jr, fpath, orig, sb, tfd, tsb);
+
+end:
+    if (orig != MAP_FAILED) {
+        munmap(orig, sb->st_size);
+    }
+
+    if (tfd >= 0) {
+        close(tfd);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+
+static int patch_paths(const char *fpath, char *tmppath, char *bakpath,
+                       char *undopath)
+{
+    char dname[PATH_MAX], fname[PATH_MAX];
+    int siz;
+
+    if (split_path(fpath, dname, fname) < 0) {
+        E("split_path()");
+        return -1;
+    }
+
+    siz = snprintf(tmppath, PATH_MAX, "%s/.%s%s", dname, fname, TMPEXT);
+    if (siz < 0) {
+        E("snprintf(): %s", fpath);
+        return -1;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", fpath);
+        return -1;
+    }
+
+    siz = snprintf(bakpath, PATH_MAX, "%s/.%s%s", dname, fname, BAKEXT);
+    if (siz < 0) {
+        E("snprintf(): %s", fpath);
+        return -1;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", fpath);
+        return -1;
+    }
+
+    siz = snprintf(undopath, PATH_MAX, "%s/.%s%s", dname, fname, UNDOEXT);
+    if (siz < 0) {
+        E("snprintf(): %s", fpath);
+        return -1;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", fpath);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void txn_init(struct txn *txn, const char *root, struct journal *jr)
+{
+    memset(txn, 0, sizeof(*txn));
+    pthread_mutex_init(&txn->lock, NULL);
+    txn->root = root;
+    txn->jr = jr;
+    txn->lock_fd = -1;
+}
+
+
+static void txn_free(struct txn *txn)
+{
+    if (txn->lock_fd >= 0) {
+        close(txn->lock_fd);
+    }
+    free(txn->ops.data);
+    free(txn->done);
+    pthread_mutex_destroy(&txn->lock);
+    memset(txn, 0, sizeof(*txn));
+}
+
+
+// called with txn->lock held
+static int txn_put(struct txn *txn, uint32_t kind, const char *src,
+                   const char *dst, const struct stat *sb,
+                   const struct patchelf_edit *edits, size_t n_edits)
+{
+    struct txn_record rec = {0};
+    struct txn_edit edit = {0};
+    size_t len = txn->ops.len, i;
+
+    rec.kind = kind;
+    rec.src_len = strlen(src) + 1;
+    rec.dst_len = strlen(dst) + 1;
+    rec.n_edits = n_edits;
+    rec.ino = sb ? (uint64_t) sb->st_ino : 0;
+    rec.size = sb ? (uint64_t) sb->st_size : 0;
+
+    if (journal_buf_put(&txn->ops, &rec, sizeof(rec)) < 0 ||
+        journal_buf_put(&txn->ops, src, rec.src_len) < 0 ||
+        journal_buf_put(&txn->ops, dst, rec.dst_len) < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < n_edits; i++) {
+        edit.offset = edits[i].offset;
+        edit.size = edits[i].size;
+        if (journal_buf_put(&txn->ops, &edit, sizeof(edit)) < 0 ||
+            journal_buf_put(&txn->ops, edits[i].data, edits[i].size) < 0) {
+            goto fail;
+        }
+    }
+
+    txn->n_ops++;
+    return 0;
+
+fail:
+    E("malloc()");
+    txn->ops.len = len;
+    return -1;
+}
+
+
+/*
+ * Stage the rename of tmppath over fpath, after moving fpath to bakpath
+ * if given.
+ */
+static int txn_stage_rename(struct txn *txn, const char *fpath,
+                            const char *tmppath, const char *bakpath)
+{
+    size_t len, n_ops;
+    int ret = -1;
+
+    pthread_mutex_lock(&txn->lock);
+    len = txn->ops.len;
+    n_ops = txn->n_ops;
+
+    if (bakpath && txn_put(txn, TXN_OP_BACKUP, fpath, bakpath, NULL, NULL,
+                           0) < 0) {
+        goto end;
+    }
+
+    if (txn_put(txn, TXN_OP_RENAME, tmppath, fpath, NULL, NULL, 0) < 0) {
+        // not the backup without its rename
+        txn->ops.len = len;
+        txn->n_ops = n_ops;
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    pthread_mutex_unlock(&txn->lock);
+    return ret;
+}
+
+
+static int txn_stage_edits(struct txn *txn, const char *fpath,
+                           const struct stat *sb,
+                           const struct patchelf_edit *edits, size_t n_edits)
+{
+    int ret;
+
+    pthread_mutex_lock(&txn->lock);
+    ret = txn_put(txn, TXN_OP_EDIT, "", fpath, sb, edits, n_edits);
+    pthread_mutex_unlock(&txn->lock);
+
+    return ret;
+}
+
+
+/*
+ * Parse the op at *pos of the len bytes of ops. Returns 1 and advances
+ * *pos, 0 at the end and -1 if the record is invalid.
+ */
+static int txn_op_next(const char *ops, size_t len, size_t *pos,
+                       struct txn_op *op)
+{
+    struct txn_record rec;
+    struct txn_edit edit;
+    size_t p = *pos;
+    uint32_t i;
+
+    if (p == len) {
+        return 0;
+    }
+
+    if (len - p < sizeof(rec)) {
+        return -1;
+    }
+    memcpy(&rec, ops + p, sizeof(rec));
+    p += sizeof(rec);
+
+    if (rec.kind > TXN_OP_EDIT || !rec.src_len || !rec.dst_len ||
+        rec.src_len > PATH_MAX || rec.dst_len > PATH_MAX ||
+        len - p < (size_t) rec.src_len + rec.dst_len ||
+        ops[p + rec.src_len - 1] != '\0' ||
+        ops[p + rec.src_len + rec.dst_len - 1] != '\0') {
+        return -1;
+    }
+
+    op->kind = rec.kind;
+    op->src = ops + p;
+    op->dst = ops + p + rec.src_len;
+    op->n_edits = rec.n_edits;
+    op->ino = rec.ino;
+    op->size = rec.size;
+    p += rec.src_len + rec.dst_len;
+    op->edits = ops + p;
+
+    for (i = 0; i < rec.n_edits; i++) {
+        if (len - p < sizeof(edit)) {
+            return -1;
+        }
+        memcpy(&edit, ops + p, sizeof(edit));
+        p += sizeof(edit);
+        if (edit.size > PATH_MAX || len - p < edit.size) {
+            return -1;
+        }
+        p += edit.size;
+    }
+
+    *pos = p;
+    return 1;
+}
+
+
+static int txn_write_edits(const struct txn_op *op, int fd)
+{
+    struct txn_edit edit;
+    const char *p = op->edits;
+    uint32_t i;
+
+    for (i = 0; i < op->n_edits; i++) {
+        memcpy(&edit, p, sizeof(edit));
+        p += sizeof(edit);
+        if (pwrite(fd, p, edit.size, edit.offset) != (ssize_t) edit.size) {
+            E("pwrite(): %s", op->dst);
+            return -1;
+        }
+        p += edit.size;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Put op in effect. When recovering, an op found done, or whose file
+ * changed since, is skipped. Returns 1 if applied, 0 if skipped, -1 on
+ * error.
+ */
+static int txn_apply(const struct txn_op *op, int recovering)
+{
+    struct stat sb;
+    int fd, ret;
+
+    switch (op->kind) {
+    case TXN_OP_BACKUP:
+        // the original may have been replaced by the patched file since
+        if (access(op->dst, F_OK) == 0 ||
+            (recovering && access(op->src, F_OK) < 0)) {
+            return 0;
+        }
+        if (rename(op->src, op->dst) < 0) {
+            E("rename(): %s => %s", op->src, op->dst);
+            return -1;
+        }
+        return 1;
+
+    case TXN_OP_RENAME:
+        if (recovering && access(op->src, F_OK) < 0) {
+            return 0;
+        }
+        if (rename(op->src, op->dst) < 0) {
+            E("rename(): %s => %s", op->src, op->dst);
+            return -1;
+        }
+        return 1;
+
+    default:
+        if ((fd = open(op->dst, O_WRONLY | O_CLOEXEC)) < 0) {
+            if (recovering && errno == ENOENT) {
+                return 0;
+            }
+            E("open(): %s", op->dst);
+            return -1;
+        }
+        if (fstat(fd, &sb) < 0) {
+            E("fstat(): %s", op->dst);
+            ret = -1;
+        } else if ((uint64_t) sb.st_ino != op->ino ||
+                   (uint64_t) sb.st_size != op->size) {
+            // replaced after the edits were planned
+            if (!recovering) {
+                errno = ESTALE;
+                E("changed while patching: %s", op->dst);
+            }
+            ret = recovering ? 0 : -1;
+        } else {
+            ret = txn_write_edits(op, fd) < 0 ? -1 : 1;
+        }
+        close(fd);
+        return ret;
+    }
+}
+
+
+// the original back in place of a failed op, and its staged file gone
+static void txn_undo(struct txn *txn, const struct txn_op *op,
+                     const char *bakpath)
+{
+    char tmppath[PATH_MAX], bak[PATH_MAX], undopath[PATH_MAX];
+
+    if (op->kind == TXN_OP_RENAME) {
+        if (unlink(op->src) < 0 && errno != ENOENT) {
+            E("unlink(): %s", op->src);
+        }
+        if (bakpath && rename(bakpath, op->dst) < 0) {
+            E("rename(): %s => %s", bakpath, op->dst);
+        }
+    } else if (op->kind == TXN_OP_EDIT &&
+               patch_paths(op->dst, tmppath, bak, undopath) == 0) {
+        // some ranges may be written
+        restore_backup(op->dst, tmppath, bak, undopath, txn->jr);
+    }
+}
+
+
+/*
+ * Put everything staged in txn in place: intent, syncfs(), commit record,
+ * then the renames and edits, and the intent removed. A crash leaves the
+ * intent to txn_recover(). Ops that fail leave their file as it was. The
+ * files patched are in txn->done. Returns -1 if nothing was applied.
+ */
+static int txn_commit(struct txn *txn)
+{
+    struct txn_header hdr = {0};
+    struct txn_commit cr = {0};
+    struct txn_op op, bak = {0};
+    struct iovec iov[2];
+    char path[PATH_MAX];
+    const char *failed = NULL;
+    size_t pos = 0;
+    int ret = -1, fd = -1, applied = 0;
+    int64_t tr;
+
+    if (!txn->n_ops) {
+        return 0;
+    }
+
+    if (root_sidecar_path(txn->root, TXNEXT, path) < 0) {
+        goto rollback;
+    }
+
+    memcpy(hdr.magic, TXN_MAGIC, sizeof(hdr.magic));
+    hdr.version = TXN_VERSION;
+    hdr.n_ops = txn->n_ops;
+    hdr.ops_size = txn->ops.len;
+    hdr.ops_hash = fnv1a64(0xcbf29ce484222325ULL, txn->ops.data,
+                           txn->ops.len);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = txn->ops.data;
+    iov[1].iov_len = txn->ops.len;
+
+    if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR)) < 0) {
+        E("open(): %s", path);
+        goto rollback;
+    }
+
+    if (writev(fd, iov, 2) != (ssize_t) (sizeof(hdr) + txn->ops.len)) {
+        E("writev(): %s", path);
+        goto end;
+    }
+
+    // staged files, undo journal and intent at once, not fsync() each
+    tr = trace_begin();
+    if (syncfs(fd) < 0) {
+        E("syncfs(): %s", path);
+        goto end;
+    }
+    trace_end("txn_syncfs", tr, txn->root);
+
+    // from here on, the next run rolls forward
+    memcpy(cr.magic, TXN_COMMIT_MAGIC, sizeof(cr.magic));
+    cr.ops_hash = hdr.ops_hash;
+    if (write(fd, &cr, sizeof(cr)) != sizeof(cr)) {
+        E("write(): %s", path);
+        goto end;
+    }
+
+    applied = 1;
+    tr = trace_begin();
+
+    while (txn_op_next(txn->ops.data, txn->ops.len, &pos, &op) > 0) {
+        if (op.kind == TXN_OP_RENAME && failed && !strcmp(failed, op.dst)) {
+            // its backup failed: the original stays
+            txn_undo(txn, &op, NULL);
+            txn->n_failed++;
+            continue;
+        }
+
+        if (txn_apply(&op, 0) < 0) {
+            if (op.kind == TXN_OP_BACKUP) {
+                failed = op.src;
+            } else {
+                txn_undo(txn, &op, bak.src && !strcmp(bak.src, op.dst) ?
+                                   bak.dst : NULL);
+                txn->n_failed++;
+            }
+            continue;
+        }
+
+        if (op.kind == TXN_OP_BACKUP) {
+            bak = op;
+            continue;
+        }
+
+        if (array_reserve(&txn->done, &txn->cap_done, txn->n_done,
+                          sizeof(*txn->done)) == 0 &&
+            lstat(op.dst, &txn->done[txn->n_done].sb) == 0) {
+            txn->done[txn->n_done++].path = op.dst;
+        }
+    }
+
+    trace_end("txn_apply", tr, txn->root);
+    ret = 0;
+
+end:
+    close(fd);
+    if (unlink(path) < 0) {
+        E("unlink(): %s", path);
+    }
+
+rollback:
+    if (!applied) {
+        // the originals were never touched
+        pos = 0;
+        while (txn_op_next(txn->ops.data, txn->ops.len, &pos, &op) > 0) {
+            if (op.kind == TXN_OP_RENAME) {
+                txn_undo(txn, &op, NULL);
+            }
+        }
+    }
+
+    return ret;
+}
+
+
+/*
+ * Keep other processes from patching txn->root until txn_free(): their
+ * intent would look like a crash to txn_recover(), and their staged files
+ * collide with ours. The lock is taken on a sidecar opened for writing,
+ * which NFS needs for an exclusive flock(). A run that holds it for more
+ * than 30 seconds fails this one. Where flock() is not supported, runs are
+ * not serialized, as before.
+ */
+static int txn_lock(struct txn *txn)
+{
+    struct timespec ts = {0, TXN_LOCK_NSEC};
+    char path[PATH_MAX];
+    int i, rc;
+
+    if (root_sidecar_path(txn->root, LOCKEXT, path) < 0) {
+        return -1;
+    }
+
+    if ((txn->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC,
+                             S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        W("open(): %s: %s", path, strerror(errno));
+        return 0;
+    }
+
+    for (i = 0; (rc = flock(txn->lock_fd, LOCK_EX | LOCK_NB)) < 0 &&
+                (errno == EWOULDBLOCK || errno == EINTR); i++) {
+        if (i == TXN_LOCK_TRIES) {
+            errno = ETIMEDOUT;
+            E("flock(): %s", path);
+            return -1;
+        } else if (!i) {
+            I("%s: waiting for another run", txn->root);
+        }
+        nanosleep(&ts, NULL);
+    }
+
+    if (rc < 0) {
+        W("flock(): %s: %s", path, strerror(errno));
+        close(txn->lock_fd);
+        txn->lock_fd = -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Lock txn->root, then finish the commit of a run that was interrupted
+ * below it: forward if its commit record is on disk, else back, removing
+ * the staged files. Edits are never undone here: they are only written
+ * once the undo journal is durable, so a torn one is restored by the next
+ * patch_file().
+ */
+static int txn_recover(struct txn *txn)
+{
+    struct txn_header hdr;
+    struct txn_commit cr;
+    struct txn_op op;
+    struct stat sb;
+    const char *root = txn->root;
+    char path[PATH_MAX], *ops = NULL;
+    size_t pos = 0, n_ops = 0;
+    int ret = -1, fd = -1, forward;
+
+    if (txn_lock(txn) < 0 || root_sidecar_path(root, TXNEXT, path) < 0) {
+        return -1;
+    }
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno == ENOENT) {
+            errno = 0;
+            return 0;
+        }
+        E("open(): %s", path);
+        return -1;
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        E("fstat(): %s", path);
+        goto end;
+    }
+
+    if ((size_t) sb.st_size < sizeof(hdr) ||
+        pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, TXN_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != TXN_VERSION || hdr.ops_size > TXN_MAX_SIZE ||
+        sizeof(hdr) + hdr.ops_size > (uint64_t) sb.st_size ||
+        !(ops = malloc(hdr.ops_size ? hdr.ops_size : 1)) ||
+        pread(fd, ops, hdr.ops_size, sizeof(hdr)) != (ssize_t) hdr.ops_size ||
+        fnv1a64(0xcbf29ce484222325ULL, ops, hdr.ops_size) != hdr.ops_hash) {
+        // torn before its syncfs() returned: nothing was touched
+        W("%s: discarding an incomplete intent", path);
+        goto done;
+    }
+
+    forward = pread(fd, &cr, sizeof(cr), sizeof(hdr) + hdr.ops_size) ==
+                  sizeof(cr) &&
+              memcmp(cr.magic, TXN_COMMIT_MAGIC, sizeof(cr.magic)) == 0 &&
+              cr.ops_hash == hdr.ops_hash;
+
+    while (txn_op_next(ops, hdr.ops_size, &pos, &op) > 0) {
+        if (forward) {
+            n_ops += txn_apply(&op, 1) > 0;
+        } else if (op.kind == TXN_OP_BACKUP) {
+            // moved away, but its patched file never took its place
+            if (access(op.src, F_OK) < 0 && access(op.dst, F_OK) == 0) {
+                if (rename(op.dst, op.src) < 0) {
+                    E("rename(): %s => %s", op.dst, op.src);
+                } else {
+                    n_ops++;
+                }
+            }
+        } else if (op.kind == TXN_OP_RENAME) {
+            if (unlink(op.src) == 0) {
+                n_ops++;
+            } else if (errno != ENOENT) {
+                E("unlink(): %s", op.src);
+            }
+        }
+    }
+
+    I("%s: rolled %s %zu operation(s) of an interrupted run", root,
+      forward ? "forward" : "back", n_ops);
+
+done:
+    if (unlink(path) < 0) {
+        E("unlink(): %s", path);
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    close(fd);
+    free(ops);
+    return ret;
+}
+
+
+/*
+ * Overwrite the interpreter and DT_RUNPATH where they are, once txn is
+ * committed. Returns 0 on success, 1 if the file has to be rewritten
+ * instead and -1 on error.
+ */
+static int patch_inplace(const char *fpath, const struct stat *sb,
+                         const struct patchelf_probe *probe,
+                         const char *tmppath, const char *bakpath,
+                         const char *undopath, struct journal *jr,
+                         struct txn *txn, size_t *n_written)
+{
+    struct patchelf_edit edits[PATCHELF_MAX_EDITS];
+    size_t n_edits, i;
+    int ret = 1, fd = -1, backup = 0;
+
+    *n_written = 0;
+
+    if (!opt_inplace || sb->st_nlink != 1) {
+        // hard links must keep their own contents
+        goto end;
+    }
+
+    if (patchelf_plan_inplace(probe, glibc_interp_new, gnudir_path, edits,
+                              &n_edits) != 0) {
+        goto end;
+    }
+
+    if ((fd = open(fpath, O_RDWR | O_CLOEXEC)) < 0) {
+        if (errno != ETXTBSY && errno != EACCES) {
+            E("open(): %s", fpath);
+        }
+        // busy or read-only: a new file is renamed into place instead
+        errno = 0;
+        goto end;
+    }
+
+    if (jr && journal_inplace(jr, fpath, fd, sb, edits, n_edits) == 0) {
+        backup = 1;
+    } else if (reflink_backup(fd, bakpath) == 0) {
+        backup = 1;
+    } else {
+        goto end;
+    }
+
+    ret = -1;
+
+    // written by txn_commit()
+    if (txn_stage_edits(txn, fpath, sb, edits, n_edits) < 0) {
+        goto end;
+    }
+
+    for (i = 0; i < n_edits; i++) {
+        *n_written += edits[i].size;
+    }
+
+    ret = 0;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (ret < 0 && backup) {
+        restore_backup(fpath, tmppath, bakpath, undopath, jr);
+    }
+
+    return ret;
+}
+
+
+// x * 10000 + y * 100 + z => "x.y.z"
+static const char *version_str(uint32_t v, char *buf, size_t n)
+{
+    if (v % 100) {
+        snprintf(buf, n, "%u.%u.%u", v / 10000, v / 100 % 100, v % 100);
+    } else {
+        snprintf(buf, n, "%u.%u", v / 10000, v / 100 % 100);
+    }
+    return buf;
+}
+
+
+static void host_lib_versions(const char *soname,
+                              struct patchelf_versions *def)
+{
+    static const char *const dirs[] = {
+        LIBDIR, "/usr" LIBDIR, "/lib/" MULTIARCH, "/usr/lib/" MULTIARCH,
+    };
+    struct patchelf_probe probe;
+    char path[PATH_MAX];
+    int fd;
+
+    memset(def, 0, sizeof(*def));
+
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dirs[i], soname);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+            continue;
+        }
+        if (patchelf_probe_fd(fd, &probe) != 0 ||
+            patchelf_defined_versions(fd, &probe, def) < 0) {
+            memset(def, 0, sizeof(*def));
+        }
+        close(fd);
+        if (def->has_versions) {
+            D("Host %s: %s", soname, path);
+            return;
+        }
+    }
+}
+
+
+static void host_versions_load(void)
+{
+    struct patchelf_versions v;
+    char b1[32], b2[32], b3[32], b4[32];
+
+    // unknown libraries stay at 0, so everything needing them is patched
+    host_lib_versions("libc.so.6", &v);
+    host_versions.glibc = v.glibc;
+    host_lib_versions("libstdc++.so.6", &v);
+    host_versions.glibcxx = v.glibcxx;
+    host_versions.cxxabi = v.cxxabi;
+    host_lib_versions("libgcc_s.so.1", &v);
+    host_versions.gcc = v.gcc;
+
+    D("Host versions: GLIBC %s, GLIBCXX %s, CXXABI %s, GCC %s",
+      version_str(host_versions.glibc, b1, sizeof(b1)),
+      version_str(host_versions.glibcxx, b2, sizeof(b2)),
+      version_str(host_versions.cxxabi, b3, sizeof(b3)),
+      version_str(host_versions.gcc, b4, sizeof(b4)));
+}
+
+
+/*
+ * Whether the host libraries lack one of the versions in req.
+ */
+static int needs_bundled_versions(const char *fpath,
+                                  const struct patchelf_versions *req)
+{
+    char b1[32], b2[32], b3[32], b4[32];
+
+    pthread_once(&host_versions_once, host_versions_load);
+
+    if (!req->has_versions || req->glibc_other ||
+        req->glibc > host_versions.glibc ||
+        req->glibcxx > host_versions.glibcxx ||
+        req->cxxabi > host_versions.cxxabi || req->gcc > host_versions.gcc) {
+        return 1;
+    }
+
+    D("Compatible %s (needs GLIBC %s, GLIBCXX %s, CXXABI %s, GCC %s)", fpath,
+      version_str(req->glibc, b1, sizeof(b1)),
+      version_str(req->glibcxx, b2, sizeof(b2)),
+      version_str(req->cxxabi, b3, sizeof(b3)),
+      version_str(req->gcc, b4, sizeof(b4)));
+    return 0;
+}
+
+
+/*
+ * Find a DT_NEEDED name of fpath in its run path, as the loader would:
+ * what is found there ships with fpath rather than with the host.
+ * Returns an open fd, or -1 if the host libraries provide it.
+ */
+static int open_needed(const char *fpath, const struct patchelf_probe *probe,
+                       const char *name, char *path)
+{
+    char origin[PATH_MAX], *p;
+    const char *dir = probe->runpath, *end, *rest;
+    size_t len;
+    int fd, siz;
+
+    if (probe->runpath_tag != DT_RUNPATH && probe->runpath_tag != DT_RPATH) {
+        return -1;
+    }
+
+    snprintf(origin, PATH_MAX, "%s", fpath);
+    if ((p = strrchr(origin, '/'))) {
+        *p = '\0';
+    }
+
+    for (; *dir; dir = *end ? end + 1 : end) {
+        end = dir + strcspn(dir, ":");
+        len = end - dir;
+        if (len >= 7 && !strncmp(dir, "$ORIGIN", 7)) {
+            rest = dir + 7;
+        } else if (len >= 9 && !strncmp(dir, "${ORIGIN}", 9)) {
+            rest = dir + 9;
+        } else {
+            rest = NULL;
+        }
+
+        if (rest) {
+            siz = snprintf(path, PATH_MAX, "%s%.*s/%s", origin,
+                           (int) (end - rest), rest, name);
+        } else {
+            siz = snprintf(path, PATH_MAX, "%.*s/%s", (int) len, dir, name);
+        }
+        if (siz < 0 || siz >= PATH_MAX || !len) {
+            continue;
+        }
+
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+ * Whether a library fpath loads from its run path needs a version the
+ * host lacks, such as a node addon's dependency built with the server's
+ * toolchain. Followed NEEDED_DEPTH libraries deep.
+ */
+static int needs_bundled_needed(const char *fpath, int fd,
+                                const struct patchelf_probe *probe, int depth)
+{
+    struct patchelf_probe lprobe;
+    struct patchelf_versions req;
+    char name[NAME_MAX + 1], path[PATH_MAX];
+    uint32_t i;
+    int lfd, rc, ret = 0;
+
+    for (i = 0; i < probe->n_needed && !ret; i++) {
+        if ((rc = patchelf_needed(fd, probe, i, name, sizeof(name))) != 0) {
+            if (rc < 0) {
+                W("malformed dynamic section: %s", fpath);
+                ret = 1;
+            }
+            break;
+        }
+
+        if (strchr(name, '/') ||
+            (lfd = open_needed(fpath, probe, name, path)) < 0) {
+            continue;
+        }
+
+        if (patchelf_probe_fd(lfd, &lprobe) != 0 ||
+            patchelf_required_versions(lfd, &lprobe, &req) < 0) {
+            W("malformed library: %s", path);
+            ret = 1;
+        } else if (needs_bundled_versions(path, &req)) {
+            D("%s needs %s", fpath, path);
+            ret = 1;
+        } else if (depth + 1 < NEEDED_DEPTH) {
+            ret = needs_bundled_needed(path, lfd, &lprobe, depth + 1);
+        }
+
+        close(lfd);
+    }
+
+    return ret;
+}
+
+
+/*
+ * Whether the host libraries cannot run fd as is, or one of the libraries
+ * it loads from its run path. Files without version requirements, needing
+ * private glibc versions, or that cannot be read are patched as before.
+ */
+static int needs_bundled_glibc(const char *fpath, int fd,
+                               const struct patchelf_probe *probe)
+{
+    struct patchelf_versions req;
+
+    if (opt_patch_all) {
+        return 1;
+    }
+
+    if (patchelf_required_versions(fd, probe, &req) < 0) {
+        W("malformed version table: %s", fpath);
+        return 1;
+    }
+
+    return needs_bundled_versions(fpath, &req) ||
+           needs_bundled_needed(fpath, fd, probe, 0);
+}
+
+
+static int store_gnu_hash_ent(const char *fpath, const struct stat *sb,
+                              int typeflag, struct FTW *ftwbuf)
+{
+    char target[PATH_MAX];
+    ssize_t len;
+    int64_t mtime_ns = sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec;
+
+    (void) ftwbuf;
+
+    // the same release unpacks to the same names, sizes and mtimes
+    store_gnu_hash = fnv1a64(store_gnu_hash, fpath + store_copy_base,
+                             strlen(fpath + store_copy_base) + 1);
+    store_gnu_hash = fnv1a64(store_gnu_hash, &typeflag, sizeof(typeflag));
+
+    if (typeflag == FTW_F) {
+        store_gnu_hash = fnv1a64(store_gnu_hash, &sb->st_size,
+                                 sizeof(sb->st_size));
+        store_gnu_hash = fnv1a64(store_gnu_hash, &mtime_ns, sizeof(mtime_ns));
+    } else if (typeflag == FTW_SL) {
+        if ((len = readlink(fpath, target, sizeof(target))) < 0) {
+            E("readlink(): %s", fpath);
+            return -1;
+        }
+        store_gnu_hash = fnv1a64(store_gnu_hash, target, len);
+    }
+
+    return 0;
+}
+
+
+static int copy_fd(int in_fd, int out_fd, const char *path)
+{
+    char buf[65536];
+    ssize_t n;
+
+    for (;;) {
+        n = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0);
+        if (n == 0) {
+            return 0;
+        } else if (n < 0) {
+            break;
+        }
+    }
+
+    // not supported across these file systems: copy by hand
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+        errno != EOPNOTSUPP) {
+        E("copy_file_range(): %s", path);
+        return -1;
+    }
+
+    while ((n = read(in_fd, buf, sizeof(buf))) > 0) {
+        if (write(out_fd, buf, n) != n) {
+            E("write(): %s", path);
+            return -1;
+        }
+    }
+
+    if (n < 0) {
+        E("read(): %s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int store_copy_ent(const char *fpath, const struct stat *sb,
+                          int typeflag, struct FTW *ftwbuf)
+{
+    char dst[PATH_MAX], target[PATH_MAX];
+    int ret = -1, in_fd = -1, out_fd = -1, siz;
+    ssize_t len;
+
+    (void) ftwbuf;
+
+    siz = snprintf(dst, PATH_MAX, "%s%s", store_copy_dst,
+                   fpath + store_copy_base);
+    if (siz < 0) {
+        E("snprintf(): %s", fpath);
+        goto end;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", fpath);
+        goto end;
+    }
+
+    switch (typeflag) {
+    case FTW_D:
+        if (mkdir(dst, S_IRWXU) < 0 && errno != EEXIST) {
+            E("mkdir(): %s", dst);
+            goto end;
+        }
+        // made read-only for everyone once filled, see store_init()
+        break;
+    case FTW_F:
+        if ((in_fd = open(fpath, O_RDONLY | O_CLOEXEC)) < 0) {
+            E("open(): %s", fpath);
+            goto end;
+        }
+        if ((out_fd = open(dst, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC,
+                           S_IRUSR | S_IWUSR)) < 0) {
+            E("open(): %s", dst);
+            goto end;
+        }
+        if (copy_fd(in_fd, out_fd, dst) < 0) {
+            goto end;
+        }
+        if (fchmod(out_fd, sb->st_mode & 0755) < 0) {
+            E("fchmod(): %s", dst);
+            goto end;
+        }
+        break;
+    case FTW_SL:
+        if ((len = readlink(fpath, target, sizeof(target) - 1)) < 0) {
+            E("readlink(): %s", fpath);
+            goto end;
+        }
+        target[len] = '\0';
+        if (symlink(target, dst) < 0) {
+            E("symlink(): %s", dst);
+            goto end;
+        }
+        break;
+    default:
+        // unreadable entries are left out
+        break;
+    }
+
+    ret = 0;
+
+end:
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+
+    return ret;
+}
+
+
+static int store_seal_ent(const char *fpath, const struct stat *sb,
+                          int typeflag, struct FTW *ftwbuf)
+{
+    (void) ftwbuf;
+
+    (void) sb;
+
+    if (typeflag == FTW_DP && chmod(fpath, 0555) < 0) {
+        E("chmod(): %s", fpath);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int store_unseal_ent(const char *fpath, const struct stat *sb,
+                            int typeflag, struct FTW *ftwbuf)
+{
+    (void) sb;
+    (void) ftwbuf;
+
+    if (typeflag == FTW_D) {
+        chmod(fpath, S_IRWXU);
+    }
+    return 0;
+}
+
+
+static int store_remove_ent(const char *fpath, const struct stat *sb,
+                            int typeflag, struct FTW *ftwbuf)
+{
+    (void) sb;
+    (void) typeflag;
+    (void) ftwbuf;
+
+    remove(fpath);
+    return 0;
+}
+
+
+static void store_remove(const char *path)
+{
+    nftw(path, store_unseal_ent, 16, FTW_PHYS);
+    nftw(path, store_remove_ent, 16, FTW_PHYS | FTW_DEPTH);
+}
+
+
+/*
+ * Whether the store can be trusted: only its owner (root or us) and, if
+ * group-writable, the members of its group can have put objects there.
+ */
+static int store_trusted(const char *path, const struct stat *sb)
+{
+    if (!S_ISDIR(sb->st_mode) || (sb->st_mode & S_IWOTH) ||
+        (sb->st_uid != 0 && sb->st_uid != getuid())) {
+        W("%s: not trusted (must be owned by root or you, and not "
+          "world-writable), not used", path);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Find or make the copy of the bundled glibc inside the store, which all
+ * stored objects point at, so that they are identical for every user.
+ */
+static void store_init(void)
+{
+    struct stat sb;
+    char tmpdir[PATH_MAX];
+    int siz, objmode;
+
+    if (lstat(opt_store, &sb) < 0) {
+        E("lstat(): %s", opt_store);
+        return;
+    }
+
+    if (!store_trusted(opt_store, &sb)) {
+        return;
+    }
+
+    objmode = sb.st_mode & S_IWGRP ? 02775 : 0755;
+
+    store_gnu_hash = 0xcbf29ce484222325ULL;
+    store_copy_base = strlen(gnudir_path);
+    if (nftw(gnudir_path, store_gnu_hash_ent, 16, FTW_PHYS) != 0) {
+        E("nftw(): %s", gnudir_path);
+        return;
+    }
+
+    siz = snprintf(store_rpath, PATH_MAX, "%s/gnu-%016llx", opt_store,
+                   (unsigned long long) store_gnu_hash);
+    if (siz < 0) {
+        E("snprintf(): %s", opt_store);
+        return;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", opt_store);
+        return;
+    }
+
+    siz = snprintf(store_interp, PATH_MAX, "%s/%s", store_rpath, INTERP);
+    if (siz < 0) {
+        E("snprintf(): %s", store_rpath);
+        return;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", store_rpath);
+        return;
+    }
+
+    if (lstat(store_rpath, &sb) < 0) {
+        // first user of this release: copy, seal and publish atomically
+        siz = snprintf(tmpdir, PATH_MAX, "%s/.gnu-%016llx.%d" TMPEXT,
+                       opt_store, (unsigned long long) store_gnu_hash,
+                       (int) getpid());
+        if (siz < 0 || siz >= PATH_MAX) {
+            errno = ENAMETOOLONG;
+            E("snprintf(): %s", opt_store);
+            return;
+        }
+
+        memcpy(store_copy_dst, tmpdir, siz + 1);
+        if (nftw(gnudir_path, store_copy_ent, 16, FTW_PHYS) != 0 ||
+            nftw(tmpdir, store_seal_ent, 16, FTW_PHYS | FTW_DEPTH) != 0) {
+            // a read-only store is fine, it just has nothing for us
+            if (errno != EACCES) {
+                E("cannot copy %s to %s", gnudir_path, store_rpath);
+            }
+            store_remove(tmpdir);
+            return;
+        }
+
+        if (rename(tmpdir, store_rpath) == 0) {
+            I("Store: created %s", store_rpath);
+        } else if (errno == EEXIST || errno == ENOTEMPTY) {
+            // another user was faster
+            store_remove(tmpdir);
+        } else {
+            E("rename(): %s => %s", tmpdir, store_rpath);
+            store_remove(tmpdir);
+            return;
+        }
+    } else if (!S_ISDIR(sb.st_mode)) {
+        errno = ENOTDIR;
+        E("store: %s", store_rpath);
+        return;
+    }
+
+    siz = snprintf(tmpdir, PATH_MAX, "%s/" STORE_OBJECTS, opt_store);
+    if (siz < 0 || siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", opt_store);
+        return;
+    }
+
+    if (mkdir(tmpdir, objmode) == 0) {
+        chmod(tmpdir, objmode);
+    }
+
+    store_ok = 1;
+}
+
+
+static int store_active(void)
+{
+    if (!opt_store) {
+        return 0;
+    }
+
+    pthread_once(&store_once, store_init);
+    return store_ok;
+}
+
+
+/*
+ * Name the object for the file open at fd: its SHA-256 and the glibc copy
+ * it is patched against.
+ */
+static int store_object_path(const char *fpath, int fd, char *objpath)
+{
+    struct sha256_ctx ctx;
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    unsigned char *buf;
+    off_t off = 0;
+    ssize_t n;
+    int siz;
+
+    if (!(buf = malloc(STORE_HASH_BUFSIZE))) {
+        E("malloc()");
+        return -1;
+    }
+
+    sha256_init(&ctx);
+    while ((n = pread(fd, buf, STORE_HASH_BUFSIZE, off)) > 0) {
+        sha256_update(&ctx, buf, n);
+        off += n;
+    }
+    free(buf);
+
+    if (n < 0) {
+        E("pread(): %s", fpath);
+        return -1;
+    }
+
+    sha256_final(&ctx, digest);
+    for (size_t i = 0; i < sizeof(digest); i++) {
+        snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+
+    siz = snprintf(objpath, PATH_MAX, "%s/" STORE_OBJECTS "/%.2s/%s-%016llx",
+                   opt_store, hex, hex + 2,
+                   (unsigned long long) store_gnu_hash);
+    if (siz < 0) {
+        E("snprintf(): %s", opt_store);
+        return -1;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", opt_store);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Put the stored object at tmppath, preferably as a hard link so that one
+ * copy is shared on disk and in the page cache, else as a reflink or a
+ * copy. Returns 1 if done, 0 if there is no such object and -1 on error.
+ */
+static int store_fetch(const char *objpath, const char *tmppath,
+                       const char **how)
+{
+    struct stat sb;
+    int ret = -1, in_fd = -1, out_fd = -1;
+
+    if (lstat(objpath, &sb) < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        E("lstat(): %s", objpath);
+        return -1;
+    }
+
+    if (!S_ISREG(sb.st_mode) || (sb.st_mode & (S_IWGRP | S_IWOTH))) {
+        W("store: ignoring %s", objpath);
+        return 0;
+    }
+
+    unlink(tmppath);
+
+    *how = "linked";
+    if (link(objpath, tmppath) == 0) {
+        return 1;
+    }
+
+    // fs.protected_hardlinks forbids linking files of other users
+    if (errno != EPERM && errno != EXDEV && errno != EMLINK) {
+        E("link(): %s => %s", objpath, tmppath);
+        return -1;
+    }
+
+    if ((in_fd = open(objpath, O_RDONLY | O_CLOEXEC)) < 0) {
+        E("open(): %s", objpath);
+        goto end;
+    }
+
+    if ((out_fd = open(tmppath, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC,
+                       sb.st_mode & 0755)) < 0) {
+        E("open(): %s", tmppath);
+        goto end;
+    }
+
+    *how = "reflinked";
+    if (ioctl(out_fd, FICLONE, in_fd) < 0) {
+        *how = "copied";
+        if (copy_fd(in_fd, out_fd, tmppath) < 0) {
+            goto end;
+        }
+    }
+
+    if (fchmod(out_fd, sb.st_mode & 0755) < 0) {
+        E("fchmod(): %s", tmppath);
+        goto end;
+    }
+
+    ret = 1;
+
+end:
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+
+    if (ret < 0) {
+        unlink(tmppath);
+    }
+
+    return ret;
+}
+
+
+/*
+ * Share a freshly patched file. Failures only cost the sharing.
+ */
+static void store_publish(const char *tmppath, const char *objpath,
+                          const struct stat *sb)
+{
+    char dname[PATH_MAX], fname[PATH_MAX];
+    struct stat ssb;
+
+    if (split_path(objpath, dname, fname) < 0) {
+        return;
+    }
+
+    if (mkdir(dname, 0755) == 0 && stat(opt_store, &ssb) == 0 &&
+        (ssb.st_mode & S_IWGRP)) {
+        chmod(dname, 02775);
+    }
+
+    // shared objects must not be writable by anyone else
+    if (chmod(tmppath, sb->st_mode & 0755) < 0) {
+        E("chmod(): %s", tmppath);
+        return;
+    }
+
+    if (link(tmppath, objpath) < 0) {
+        if (errno != EEXIST && errno != EACCES && errno != EROFS) {
+            E("link(): %s => %s", tmppath, objpath);
+        }
+        return;
+    }
+
+    D("Stored %s", objpath);
+}
+
+
+static int is_patch_sidecar(const char *fpath)
+{
+    return str_ends_with(fpath, BAKEXT) || str_ends_with(fpath, TMPEXT) ||
+           str_ends_with(fpath, UNDOEXT);
+}
+
+
+/*
+ * Returns the class of fpath. Patched files are PATCH_STAGED: they take
+ * effect when txn is committed.
+ */
+static int patch_file(const char *fpath, const struct stat *sb,
+                      struct journal *jr, struct txn *txn)
+{
+    struct patchelf_probe probe;
+    struct stat rsb, tsb;
+    char interpreter[PATH_MAX], tmppath[PATH_MAX], bakpath[PATH_MAX];
+    char undopath[PATH_MAX], objpath[PATH_MAX];
+    const char *how = NULL, *new_interp = glibc_interp_new;
+    const char *new_rpath = gnudir_path;
+    size_t n_written;
+    int ret = PATCH_FAILED, fd = -1, use_store, backup;
+    int64_t tr_file = trace_begin(), tr;
+
+    if (is_patch_sidecar(fpath)) {
+        // backed up file or temp file
+        ret = PATCH_NOT_ELF;
+        goto end;
+    }
+
+    if (!S_ISREG(sb->st_mode) || sb->st_size <= 4) {
+        // cannot be a regular ELF file
+        ret = PATCH_NOT_ELF;
+        goto end;
+    }
+
+    tr = trace_begin();
+    if ((fd = open(fpath, O_RDONLY | O_CLOEXEC)) < 0) {
+        E("open(): %s", fpath);
+        goto end;
+    }
+
+    switch (patchelf_probe_fd(fd, &probe)) {
+    case 0:
+        break;
+    case 1:
+        // not an ELF file
+        trace_end("probe", tr, NULL);
+        ret = PATCH_NOT_ELF;
+        goto end;
+    default:
+        E("patchelf_probe(): %s", fpath);
+        goto end;
+    }
+    trace_end("probe", tr, NULL);
+
+    if (!probe.has_interp) {
+        // static binary or shared object
+        ret = PATCH_NO_INTERP;
+        goto end;
+    }
+
+    use_store = store_active();
+    if (probe.runpath_tag == DT_RUNPATH &&
+        ((!strcmp(probe.interpreter, glibc_interp_new) &&
+          !strcmp(probe.runpath, gnudir_path)) ||
+         (use_store && !strcmp(probe.interpreter, store_interp) &&
+          !strcmp(probe.runpath, store_rpath)))) {
+        // already points at the bundled loader
+        ret = PATCH_DONE;
+        goto end;
+    }
+
+    if (patch_paths(fpath, tmppath, bakpath, undopath) < 0) {
+        goto end;
+    }
+
+    // restore backed up file if exists
+    tr = trace_begin();
+    switch (restore_backup(fpath, tmppath, bakpath, undopath, jr)) {
+    case 0:
+        break;
+    case 1:
+        close(fd);
+        if ((fd = open(fpath, O_RDONLY | O_CLOEXEC)) < 0 ||
+            patchelf_probe_fd(fd, &probe) != 0 || !probe.has_interp) {
+            E("patchelf_probe(): %s", fpath);
+            goto end;
+        }
+        if (fstat(fd, &rsb) < 0) {
+            E("fstat(): %s", fpath);
+            goto end;
+        }
+        sb = &rsb;
+        break;
+    default:
+        goto end;
+    }
+    trace_end("restore_backup", tr, NULL);
+
+    tr = trace_begin();
+    if (!needs_bundled_glibc(fpath, fd, &probe)) {
+        // the host glibc is new enough, leave it alone
+        trace_end("versions", tr, NULL);
+        ret = PATCH_COMPATIBLE;
+        goto end;
+    }
+    trace_end("versions", tr, NULL);
+
+    // files with other links are shared with someone: never stored
+    if (use_store && sb->st_nlink == 1) {
+        tr = trace_begin();
+        if (store_object_path(fpath, fd, objpath) < 0) {
+            use_store = 0;
+        } else {
+            switch (store_fetch(objpath, tmppath, &how)) {
+            case 1:
+                trace_end("store_fetch", tr, NULL);
+                snprintf(interpreter, PATH_MAX, "%s", probe.interpreter);
+                goto install;
+            case 0:
+                break;
+            default:
+                use_store = 0;
+                break;
+            }
+        }
+        trace_end("store_fetch", tr, NULL);
+    } else {
+        use_store = 0;
+    }
+
+    if (use_store) {
+        new_interp = store_interp;
+        new_rpath = store_rpath;
+        goto rewrite;
+    }
+
+    tr = trace_begin();
+    switch (patch_inplace(fpath, sb, &probe, tmppath, bakpath, undopath, jr,
+                          txn, &n_written)) {
+    case 0:
+        trace_end("patch_inplace", tr, NULL);
+        I("Patched %s in place (interpreter: %s, %zu of %lld bytes written)",
+          fpath, probe.interpreter, n_written, (long long) sb->st_size);
+        ret = PATCH_STAGED;
+        goto end;
+    case 1:
+        trace_end("patch_inplace", tr, NULL);
+        break;
+    default:
+        goto end;
+    }
+
+rewrite:
+    tr = trace_begin();
+    switch (patchelf_set_interpreter_rpath(fpath, tmppath, new_interp,
+                                           new_rpath, interpreter, PATH_MAX,
+                                           1)) {
+    case 0:
+        break;
+    case 1:
+        // may be a static binary
+        ret = PATCH_NO_INTERP;
+        goto end;
+    default:
+        goto end;
+    }
+
+    trace_end("patchelf", tr, NULL);
+
+    if (use_store) {
+        store_publish(tmppath, objpath, sb);
+    }
+
+install:
+    if (stat(tmppath, &tsb) < 0) {
+        E("stat(): %s", tmppath);
+        goto end;
+    }
+
+    if (how) {
+        I("Patched %s (interpreter: %s, %s from %s)", fpath, interpreter, how,
+          objpath);
+    } else {
+        I("Patched %s (interpreter: %s, %lld of %lld bytes written)", fpath,
+          interpreter, (long long) tsb.st_size, (long long) sb->st_size);
+    }
+
+    tr = trace_begin();
+    // no journal: keep the whole original
+    backup = !jr || journal_rewrite(jr, fpath, sb, tmppath, &tsb) < 0;
+    trace_end("journal", tr, NULL);
+
+    if (txn_stage_rename(txn, fpath, tmppath, backup ? bakpath : NULL) < 0) {
+        unlink(tmppath);
+        goto end;
+    }
+
+    ret = PATCH_STAGED;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+    trace_end("patch_file", tr_file, fpath);
+    return ret;
+}
+
+
+/*
+ * Put back the original of fpath. Returns 1 if it was restored, 0 if it
+ * was not patched and -1 on error.
+ */
+static int unpatch_file(const char *fpath, struct journal *jr)
+{
+    char tmppath[PATH_MAX], bakpath[PATH_MAX], undopath[PATH_MAX];
+    int ret;
+
+    if (is_patch_sidecar(fpath)) {
+        return 0;
+    }
+
+    if (patch_paths(fpath, tmppath, bakpath, undopath) < 0) {
+        return -1;
+    }
+
+    if ((ret = restore_backup(fpath, tmppath, bakpath, undopath, jr)) > 0) {
+        I("Restored %s", fpath);
+    }
+
+    return ret;
+}
+
+
+static uint64_t manifest_config_hash(void)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint32_t version = MANIFEST_VERSION;
+
+    // entries are only valid for the loader they were patched against
+    h = fnv1a64(h, &version, sizeof(version));
+    h = fnv1a64(h, glibc_interp_new, strlen(glibc_interp_new) + 1);
+    h = fnv1a64(h, gnudir_path, strlen(gnudir_path) + 1);
+    if (store_active()) {
+        h = fnv1a64(h, store_rpath, strlen(store_rpath) + 1);
+    }
+
+    // and, for skipped files, the host libraries they were checked against
+    h = fnv1a64(h, &opt_patch_all, sizeof(opt_patch_all));
+    if (!opt_patch_all) {
+        pthread_once(&host_versions_once, host_versions_load);
+        h = fnv1a64(h, &host_versions, sizeof(host_versions));
+    }
+    return h;
+}
+
+
+static int manifest_path(const char *root, char *path)
+{
+    return root_sidecar_path(root, MANIFESTEXT, path);
+}
+
+
+static void manifest_entry_set(struct manifest_entry *ent,
+                               const struct stat *sb, int klass)
+{
+    memset(ent, 0, sizeof(*ent));
+    ent->dev = sb->st_dev;
+    ent->ino = sb->st_ino;
+    ent->size = sb->st_size;
+    ent->mtime_ns = sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec;
+    ent->ctime_ns = sb->st_ctim.tv_sec * 1000000000LL + sb->st_ctim.tv_nsec;
+    ent->klass = klass;
+}
+
+
+static int manifest_entry_cmp(const void *a, const void *b)
+{
+    const struct manifest_entry *ea = a, *eb = b;
+
+    if (ea->dev != eb->dev) {
+        return ea->dev < eb->dev ? -1 : 1;
+    }
+
+    if (ea->ino != eb->ino) {
+        return ea->ino < eb->ino ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+static void manifest_unload(struct manifest *mf)
+{
+    if (mf->map) {
+        munmap(mf->map, mf->size);
+    }
+
+    memset(mf, 0, sizeof(*mf));
+}
+
+
+static int manifest_load(const char *root, struct manifest *mf)
+{
+    const struct manifest_header *hdr;
+    char path[PATH_MAX];
+    struct stat sb;
+    int ret = -1, fd = -1;
+
+    memset(mf, 0, sizeof(*mf));
+
+    if (manifest_path(root, path) < 0) {
+        goto end;
+    }
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno != ENOENT) {
+            E("open(): %s", path);
+        }
+        errno = 0;
+        ret = 0;
+        goto end;
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        E("fstat(): %s", path);
+        goto end;
+    }
+
+    if ((size_t) sb.st_size < sizeof(*hdr)) {
+        // empty or truncated: treat as absent
+        ret = 0;
+        goto end;
+    }
+
+    if ((mf->map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+            == MAP_FAILED) {
+        mf->map = NULL;
+        E("mmap(): %s", path);
+        goto end;
+    }
+
+    mf->size = sb.st_size;
+    hdr = mf->map;
+
+    if (memcmp(hdr->magic, MANIFEST_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != MANIFEST_VERSION ||
+        hdr->config_hash != manifest_config_hash() ||
+        hdr->n_entries > (mf->size - sizeof(*hdr)) /
+                         sizeof(struct manifest_entry)) {
+        // foreign, stale or corrupt: everything is probed again
+        manifest_unload(mf);
+        ret = 0;
+        goto end;
+    }
+
+    mf->entries = (const struct manifest_entry *) (hdr + 1);
+    mf->n_entries = hdr->n_entries;
+    ret = 0;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+
+static const struct manifest_entry *manifest_lookup(const struct manifest *mf,
+                                                    const struct stat *sb)
+{
+    struct manifest_entry key;
+    const struct manifest_entry *ent;
+
+    if (!mf->n_entries) {
+        return NULL;
+    }
+
+    manifest_entry_set(&key, sb, 0);
+    ent = bsearch(&key, mf->entries, mf->n_entries, sizeof(key),
+                  manifest_entry_cmp);
+
+    // a failure is retried, whatever an older run saved
+    if (!ent || ent->size != key.size || ent->mtime_ns != key.mtime_ns ||
+        ent->ctime_ns != key.ctime_ns || ent->klass == PATCH_FAILED) {
+        return NULL;
+    }
+
+    return ent;
+}
+
+
+static int manifest_save(const char *root, struct manifest_entry *entries,
+                         size_t n_entries)
+{
+    struct manifest_header hdr = {0};
+    char path[PATH_MAX], tmppath[PATH_MAX];
+    int ret = -1, fd = -1, siz;
+    size_t len, i, n;
+
+    if (manifest_path(root, path) < 0) {
+        goto end;
+    }
+
+    // failures are not cached: the next run tries them again
+    for (i = n = 0; i < n_entries; i++) {
+        if (entries[i].klass != PATCH_FAILED) {
+            entries[n++] = entries[i];
+        }
+    }
+    n_entries = n;
+
+    siz = snprintf(tmppath, PATH_MAX, "%s.%ld%s", path, (long) getpid(),
+                   TMPEXT);
+    if (siz < 0) {
+        E("snprintf(): %s", path);
+        goto end;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", path);
+        goto end;
+    }
+
+    qsort(entries, n_entries, sizeof(*entries), manifest_entry_cmp);
+
+    memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+    hdr.version = MANIFEST_VERSION;
+    hdr.n_entries = n_entries;
+    hdr.config_hash = manifest_config_hash();
+
+    if ((fd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        E("open(): %s", tmppath);
+        goto end;
+    }
+
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        E("write(): %s", tmppath);
+        goto end;
+    }
+
+    len = n_entries * sizeof(*entries);
+    if (len && write(fd, entries, len) != (ssize_t) len) {
+        E("write(): %s", tmppath);
+        goto end;
+    }
+
+    close(fd);
+    fd = -1;
+
+    if (rename(tmppath, path) < 0) {
+        E("rename(): %s => %s", tmppath, path);
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (ret < 0) {
+        unlink(tmppath);
+    }
+
+    return ret;
+}
+
+
+static void elflist_unload(struct elflist *el)
+{
+    if (el->map) {
+        munmap(el->map, el->size);
+    }
+
+    memset(el, 0, sizeof(*el));
+}
+
+
+/*
+ * Map the list shipped next to root. Returns 0 with el->n_entries == 0 if
+ * there is none, in which case the tree is walked.
+ */
+static int elflist_load(const char *root, struct elflist *el)
+{
+    const struct elflist_header *hdr;
+    const char *relpath;
+    char path[PATH_MAX];
+    struct stat sb;
+    size_t i, strings_off;
+    int ret = -1, fd = -1;
+
+    memset(el, 0, sizeof(*el));
+
+    if (root_sidecar_path(root, ELFLISTEXT, path) < 0) {
+        goto end;
+    }
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno != ENOENT) {
+            E("open(): %s", path);
+        }
+        errno = 0;
+        ret = 0;
+        goto end;
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        E("fstat(): %s", path);
+        goto end;
+    }
+
+    if ((size_t) sb.st_size < sizeof(*hdr)) {
+        W("%s: truncated, walking %s", path, root);
+        ret = 0;
+        goto end;
+    }
+
+    if ((el->map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+            == MAP_FAILED) {
+        el->map = NULL;
+        E("mmap(): %s", path);
+        goto end;
+    }
+
+    el->size = sb.st_size;
+    hdr = el->map;
+    strings_off = sizeof(*hdr) + (size_t) hdr->n_entries *
+                                 sizeof(struct elflist_entry);
+
+    if (memcmp(hdr->magic, ELFLIST_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != ELFLIST_VERSION ||
+        hdr->n_entries > (el->size - sizeof(*hdr)) /
+                         sizeof(struct elflist_entry) ||
+        hdr->strings_size != el->size - strings_off ||
+        (hdr->strings_size && ((const char *) el->map)[el->size - 1])) {
+        W("%s: not a valid list, walking %s", path, root);
+        elflist_unload(el);
+        ret = 0;
+        goto end;
+    }
+
+    el->entries = (const struct elflist_entry *) (hdr + 1);
+    el->strings = (const char *) el->map + strings_off;
+
+    for (i = 0; i < hdr->n_entries; i++) {
+        // only files below root
+        if (el->entries[i].path_offset >= hdr->strings_size ||
+            *(relpath = el->strings + el->entries[i].path_offset) == '/' ||
+            !strcmp(relpath, "..") || !strncmp(relpath, "../", 3) ||
+            strstr(relpath, "/../") || str_ends_with(relpath, "/..")) {
+            W("%s: bad entry %zu, walking %s", path, i, root);
+            elflist_unload(el);
+            ret = 0;
+            goto end;
+        }
+    }
+
+    el->n_entries = hdr->n_entries;
+    ret = 0;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+
+/*
+ * Compare fpath with the file that was listed, leaving out what patching
+ * changes. Only done by --patch-now, for every listed file: it reads the
+ * whole file, which a launch cannot afford, and trusts the list instead.
+ */
+static void elflist_verify(const char *fpath, const struct stat *sb,
+                           const struct elflist_entry *listed)
+{
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    int fd;
+
+    if ((uint64_t) sb->st_size != listed->size) {
+        // rewritten by an earlier run: nothing left to compare
+        D("%s: %lld bytes, listed with %llu, not verified", fpath,
+          (long long) sb->st_size, (unsigned long long) listed->size);
+        return;
+    }
+
+    if ((fd = open(fpath, O_RDONLY | O_CLOEXEC)) < 0) {
+        E("open(): %s", fpath);
+        return;
+    }
+
+    if (elflist_digest(fd, listed, digest) < 0) {
+        E("read(): %s", fpath);
+    } else if (memcmp(digest, listed->sha256, sizeof(digest)) != 0) {
+        W("%s differs from the file that was shipped", fpath);
+    }
+
+    close(fd);
+}
+
+
+static struct patch_task *patch_task_new(const char *dirpath, const char *name,
+                                         int is_dir)
+{
+    struct patch_task *task;
+    size_t dlen = strlen(dirpath), nlen = name ? strlen(name) : 0;
+
+    if (dlen + nlen + 2 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("%s/%s", dirpath, name ? name : "");
+        return NULL;
+    }
+
+    if (!(task = malloc(sizeof(*task) + dlen + nlen + 2))) {
+        E("malloc()");
+        return NULL;
+    }
+
+    task->is_dir = is_dir;
+    task->n_names = 0;
+    task->listed = NULL;
+    task->next = NULL;
+    memcpy(task->path, dirpath, dlen);
+    if (name) {
+        task->path[dlen] = '/';
+        memcpy(task->path + dlen + 1, name, nlen + 1);
+    } else {
+        task->path[dlen] = '\0';
+    }
+
+    return task;
+}
+
+
+static int patch_deque_push(struct patch_deque *dq, struct patch_task *task)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom - dq->top < PATCH_DEQUE_SIZE) {
+        dq->tasks[dq->bottom++ % PATCH_DEQUE_SIZE] = task;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return ret;
+}
+
+
+static struct patch_task *patch_deque_pop(struct patch_deque *dq)
+{
+    struct patch_task *task = NULL;
+
+    // owner end: depth-first, keeps the working set of directories small
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom != dq->top) {
+        task = dq->tasks[--dq->bottom % PATCH_DEQUE_SIZE];
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return task;
+}
+
+
+static struct patch_task *patch_deque_steal(struct patch_deque *dq)
+{
+    struct patch_task *task = NULL;
+
+    // thief end: oldest entries, which are the closest to the root
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom != dq->top) {
+        task = dq->tasks[dq->top++ % PATCH_DEQUE_SIZE];
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return task;
+}
+
+
+static void patch_worker_record(struct patch_worker *self,
+                                const struct stat *sb, int klass)
+{
+    if (array_reserve(&self->entries, &self->cap_entries, self->n_entries,
+                      sizeof(*self->entries)) == 0) {
+        manifest_entry_set(&self->entries[self->n_entries++], sb, klass);
+    }
+}
+
+
+// keeps what was logged for fpath since logpos, to be reported in order
+static void patch_worker_report(struct patch_worker *self, const char *fpath,
+                                size_t logpos)
+{
+    fflush(self->logcap);
+    if (self->loglen != logpos &&
+        array_reserve(&self->results, &self->cap_results, self->n_results,
+                      sizeof(*self->results)) == 0 &&
+        (self->results[self->n_results].path = strdup(fpath))) {
+        self->results[self->n_results].logoff = logpos;
+        self->results[self->n_results].loglen = self->loglen - logpos;
+        self->results[self->n_results].worker = self;
+        self->n_results++;
+    }
+}
+
+
+// where the next message of the worker will start in self->logbuf
+static size_t patch_worker_logpos(struct patch_worker *self)
+{
+    int err = errno;
+
+    fflush(self->logcap);
+    errno = err;
+    return self->loglen;
+}
+
+
+/*
+ * E() outside of patch_worker_patch(): what a worker logs is captured, and
+ * only written out through patch_worker_report().
+ */
+#define PATCH_WORKER_E(self, fpath, ...) \
+    do { \
+        size_t logpos_ = patch_worker_logpos(self); \
+        E(__VA_ARGS__); \
+        patch_worker_report((self), (fpath), logpos_); \
+    } while (0)
+
+
+// fpath is not in the manifest: patch it
+static void patch_worker_patch(struct patch_worker *self, const char *fpath,
+                               struct stat *sb)
+{
+    size_t logpos = patch_worker_logpos(self);
+    int klass;
+
+    if ((klass = patch_file(fpath, sb, self->pool->journal,
+                            self->pool->txn)) < 0) {
+        atomic_fetch_add(&self->pool->n_errors, 1);
+    } else if ((klass == PATCH_DONE || klass == PATCH_COMPATIBLE) &&
+               lstat(fpath, sb) < 0) {
+        E("lstat(): %s", fpath);
+        klass = PATCH_FAILED;
+    }
+
+    patch_worker_report(self, fpath, logpos);
+    if (klass != PATCH_STAGED) {
+        // else recorded once committed
+        patch_worker_record(self, sb, klass);
+    }
+}
+
+
+static void patch_worker_file(struct patch_worker *self, const char *fpath,
+                              const struct elflist_entry *listed)
+{
+    const struct manifest_entry *ent;
+    struct stat sb;
+    size_t logpos;
+
+    if (is_patch_sidecar(fpath)) {
+        // may already be renamed away by the task of its file
+        return;
+    }
+
+    if (lstat(fpath, &sb) < 0) {
+        PATCH_WORKER_E(self, fpath, "lstat(): %s", fpath);
+        atomic_fetch_add(&self->pool->n_errors, 1);
+        return;
+    }
+
+    if (self->pool->unpatch) {
+        logpos = patch_worker_logpos(self);
+        if (unpatch_file(fpath, self->pool->journal) < 0) {
+            atomic_fetch_add(&self->pool->n_errors, 1);
+        }
+        patch_worker_report(self, fpath, logpos);
+        return;
+    }
+
+    if (listed && opt_patch_now) {
+        // before the manifest: it vouches for what was patched, not for
+        // what was shipped
+        logpos = patch_worker_logpos(self);
+        elflist_verify(fpath, &sb, listed);
+        patch_worker_report(self, fpath, logpos);
+    }
+
+    if ((ent = manifest_lookup(self->pool->manifest, &sb))) {
+        // unchanged since the last run
+        patch_worker_record(self, &sb, ent->klass);
+        return;
+    }
+
+    patch_worker_patch(self, fpath, &sb);
+}
+
+
+/*
+ * The files of a directory, PATCH_BATCH at a time: one lstat() each, then
+ * the first bytes of those the manifest does not know, are submitted at
+ * once (src/batchio.h). Only ELF files go on to patch_file().
+ */
+static void patch_worker_batch(struct patch_worker *self,
+                               const struct patch_task *task)
+{
+    struct batchio_req reqs[PATCH_BATCH], *heads[PATCH_BATCH];
+    const struct manifest_entry *ent;
+    const char *name;
+    size_t dlen = strlen(task->path), len = 0, n = 0, n_heads = 0, i;
+    char *paths, *p;
+    int64_t tr;
+    int siz;
+
+    name = task->path + dlen + 1;
+    for (i = 0; i < task->n_names; i++) {
+        len += dlen + strlen(name) + 2;
+        name += strlen(name) + 1;
+    }
+
+    if (!(paths = malloc(len))) {
+        PATCH_WORKER_E(self, task->path, "malloc()");
+        atomic_fetch_add(&self->pool->n_errors, task->n_names);
+        return;
+    }
+
+    p = paths;
+    name = task->path + dlen + 1;
+    for (i = 0; i < task->n_names; i++, name += strlen(name) + 1) {
+        siz = snprintf(p, PATH_MAX, "%s/%s", task->path, name);
+        if (siz < 0) {
+            PATCH_WORKER_E(self, task->path, "snprintf(): %s", name);
+            atomic_fetch_add(&self->pool->n_errors, 1);
+            continue;
+        } else if (siz >= PATH_MAX) {
+            errno = ENAMETOOLONG;
+            PATCH_WORKER_E(self, task->path, "snprintf(): %s", name);
+            atomic_fetch_add(&self->pool->n_errors, 1);
+            continue;
+        }
+        reqs[n].path = p;
+        p += siz + 1;
+        if (!is_patch_sidecar(reqs[n].path)) {
+            n++;
+        }
+    }
+
+    if (!self->has_io) {
+        // on first use, so that idle workers do not set up a ring
+        batchio_init(&self->io, opt_io_uring);
+        self->has_io = 1;
+    }
+
+    tr = trace_begin();
+    batchio_stat(&self->io, reqs, n);
+    trace_end("stat_batch", tr, task->path);
+
+    for (i = 0; i < n; i++) {
+        if (reqs[i].err) {
+            errno = reqs[i].err;
+            PATCH_WORKER_E(self, reqs[i].path, "lstat(): %s", reqs[i].path);
+            atomic_fetch_add(&self->pool->n_errors, 1);
+        } else if ((ent = manifest_lookup(self->pool->manifest,
+                                          &reqs[i].sb))) {
+            // unchanged since the last run
+            patch_worker_record(self, &reqs[i].sb, ent->klass);
+        } else if (!S_ISREG(reqs[i].sb.st_mode) || reqs[i].sb.st_size <= 4) {
+            // cannot be a regular ELF file
+            patch_worker_record(self, &reqs[i].sb, PATCH_NOT_ELF);
+        } else {
+            heads[n_heads++] = &reqs[i];
+        }
+    }
+
+    if (n_heads) {
+        tr = trace_begin();
+        batchio_head(&self->io, heads, n_heads);
+        trace_end("head_batch", tr, task->path);
+    }
+
+    for (i = 0; i < n_heads; i++) {
+        // what patchelf_probe_fd() turns away; errors are left to it
+        if (!heads[i]->err && (heads[i]->head_len < EI_NIDENT ||
+                               memcmp(heads[i]->head, ELFMAG, SELFMAG))) {
+            patch_worker_record(self, &heads[i]->sb, PATCH_NOT_ELF);
+        } else {
+            patch_worker_patch(self, heads[i]->path, &heads[i]->sb);
+        }
+    }
+
+    free(paths);
+}
+
+
+static void patch_worker_task(struct patch_worker *self,
+                              struct patch_task *task);
+
+
+static void patch_worker_push(struct patch_worker *self,
+                              struct patch_task *task)
+{
+    struct patch_pool *pool = self->pool;
+
+    atomic_fetch_add(&pool->pending, 1);
+
+    if (patch_deque_push(&self->deque, task) < 0) {
+        if (task->is_dir && self->inline_depth >= PATCH_INLINE_DEPTH) {
+            // as many directories open as we allow: run it later
+            task->next = self->overflow;
+            self->overflow = task;
+            return;
+        }
+        // deque is full: keep memory bounded by running the task inline
+        self->inline_depth += task->is_dir;
+        patch_worker_task(self, task);
+        self->inline_depth -= task->is_dir;
+        return;
+    }
+
+    if (atomic_load(&pool->n_idle) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+
+static void patch_worker_submit(struct patch_worker *self, const char *dirpath,
+                                const char *name, int is_dir,
+                                const struct elflist_entry *listed)
+{
+    struct patch_pool *pool = self->pool;
+    struct patch_task *task;
+    size_t logpos = patch_worker_logpos(self);
+
+    if (!(task = patch_task_new(dirpath, name, is_dir))) {
+        patch_worker_report(self, dirpath, logpos);
+        atomic_fetch_add(&pool->n_errors, 1);
+        return;
+    }
+
+    task->listed = listed;
+    patch_worker_push(self, task);
+}
+
+
+// the names_len bytes of names hold n_names NUL-terminated names
+static void patch_worker_submit_batch(struct patch_worker *self,
+                                      const char *dirpath, const char *names,
+                                      size_t names_len, size_t n_names)
+{
+    struct patch_task *task;
+    size_t dlen = strlen(dirpath);
+
+    if (!(task = malloc(sizeof(*task) + dlen + 1 + names_len))) {
+        PATCH_WORKER_E(self, dirpath, "malloc()");
+        atomic_fetch_add(&self->pool->n_errors, n_names);
+        return;
+    }
+
+    task->is_dir = 0;
+    task->n_names = n_names;
+    task->listed = NULL;
+    task->next = NULL;
+    memcpy(task->path, dirpath, dlen + 1);
+    memcpy(task->path + dlen + 1, names, names_len);
+    patch_worker_push(self, task);
+}
+
+
+static void patch_worker_dir(struct patch_worker *self, const char *dirpath)
+{
+    char names[PATCH_BATCH * (NAME_MAX + 1)];
+    size_t names_len = 0, n_names = 0, len;
+    DIR *dir;
+    struct dirent *ent;
+    int64_t tr = trace_begin();
+
+    if (!(dir = opendir(dirpath))) {
+        PATCH_WORKER_E(self, dirpath, "opendir(): %s", dirpath);
+        atomic_fetch_add(&self->pool->n_errors, 1);
+        return;
+    }
+
+    while ((ent = readdir(dir))) {
+        struct stat sb;
+        int is_dir;
+
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+
+        if (ent->d_type == DT_UNKNOWN) {
+            if (fstatat(dirfd(dir), ent->d_name, &sb,
+                        AT_SYMLINK_NOFOLLOW) < 0) {
+                continue;
+            }
+            is_dir = S_ISDIR(sb.st_mode);
+            if (!is_dir && !S_ISREG(sb.st_mode)) {
+                continue;
+            }
+        } else if (ent->d_type == DT_DIR) {
+            is_dir = 1;
+        } else if (ent->d_type == DT_REG) {
+            is_dir = 0;
+        } else {
+            // symlinks and special files are never followed (FTW_PHYS)
+            continue;
+        }
+
+        if (is_dir || self->pool->unpatch) {
+            patch_worker_submit(self, dirpath, ent->d_name, is_dir, NULL);
+            continue;
+        }
+
+        len = strlen(ent->d_name) + 1;
+        memcpy(names + names_len, ent->d_name, len);
+        names_len += len;
+        if (++n_names == PATCH_BATCH) {
+            patch_worker_submit_batch(self, dirpath, names, names_len,
+                                      n_names);
+            names_len = n_names = 0;
+        }
+    }
+
+    if (n_names) {
+        patch_worker_submit_batch(self, dirpath, names, names_len, n_names);
+    }
+
+    closedir(dir);
+    trace_end("readdir", tr, dirpath);
+}
+
+
+static void patch_worker_task(struct patch_worker *self,
+                              struct patch_task *task)
+{
+    if (task->is_dir) {
+        patch_worker_dir(self, task->path);
+    } else if (task->n_names) {
+        patch_worker_batch(self, task);
+    } else {
+        patch_worker_file(self, task->path, task->listed);
+    }
+
+    free(task);
+
+    if (atomic_fetch_sub(&self->pool->pending, 1) == 1) {
+        pthread_mutex_lock(&self->pool->lock);
+        pthread_cond_broadcast(&self->pool->cond);
+        pthread_mutex_unlock(&self->pool->lock);
+    }
+}
+
+
+static struct patch_task *patch_worker_steal(struct patch_worker *self)
+{
+    struct patch_pool *pool = self->pool;
+    struct patch_task *task;
+    int i;
+
+    for (i = 1; i < pool->n_workers; i++) {
+        int victim = (self->index + i) % pool->n_workers;
+        if ((task = patch_deque_steal(&pool->workers[victim].deque))) {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void *patch_worker_run(void *arg)
+{
+    struct patch_worker *self = arg;
+    struct patch_pool *pool = self->pool;
+    struct patch_task *task;
+    struct timespec ts;
+
+    log_capture(self->logcap);
+
+    if (opt_trace) {
+        char name[32];
+        snprintf(name, sizeof(name), "patch-worker %d", self->index);
+        trace_thread(name);
+    }
+
+    for (;;) {
+        if ((task = patch_deque_pop(&self->deque))) {
+            patch_worker_task(self, task);
+            continue;
+        } else if ((task = self->overflow)) {
+            self->overflow = task->next;
+            patch_worker_task(self, task);
+            continue;
+        } else if ((task = patch_worker_steal(self))) {
+            patch_worker_task(self, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (atomic_load(&pool->pending) == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        // bounded wait: a push may race with going idle
+        clock_gettime(CLOCK_REALTIME, &ts);
+        if ((ts.tv_nsec += PATCH_IDLE_NSEC) >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        atomic_fetch_add(&pool->n_idle, 1);
+        pthread_cond_timedwait(&pool->cond, &pool->lock, &ts);
+        atomic_fetch_sub(&pool->n_idle, 1);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    log_capture(NULL);
+    return NULL;
+}
+
+
+static int patch_result_cmp(const void *a, const void *b)
+{
+    const struct patch_result *ra = a, *rb = b;
+    return strcmp(ra->path, rb->path);
+}
+
+
+static int patch_tree(const char *dirpath, int unpatch)
+{
+    struct patch_pool pool = {0};
+    struct journal journal;
+    struct txn txn;
+    int64_t tr;
+    struct patch_result *results = NULL;
+    struct manifest_entry *entries = NULL;
+    struct manifest manifest = {0};
+    struct elflist elflist = {0};
+    struct stat sb;
+    size_t n_results = 0, n_entries = 0, i;
+    int ret = -1, n_started = 1, n;
+
+    if (stat(dirpath, &sb) < 0) {
+        E("stat(): %s", dirpath);
+        return ret;
+    }
+
+    journal_init(&journal, dirpath);
+    txn_init(&txn, dirpath, &journal);
+
+    tr = trace_begin();
+    if (txn_recover(&txn) < 0) {
+        goto end;
+    }
+    trace_end("txn_recover", tr, dirpath);
+
+    tr = trace_begin();
+    if (!opt_patch_now && !unpatch && manifest_load(dirpath, &manifest) < 0) {
+        goto end;
+    }
+    trace_end("manifest_load", tr, dirpath);
+
+    tr = trace_begin();
+    if (!unpatch && elflist_load(dirpath, &elflist) < 0) {
+        goto end;
+    }
+    trace_end("elflist_load", tr, dirpath);
+
+    pool.n_workers = opt_jobs;
+    pool.manifest = &manifest;
+    pool.journal = &journal;
+    pool.txn = &txn;
+    pool.unpatch = unpatch;
+    atomic_init(&pool.pending, 0);
+    atomic_init(&pool.n_idle, 0);
+    atomic_init(&pool.n_errors, 0);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    if (!(pool.workers = calloc(pool.n_workers, sizeof(*pool.workers)))) {
+        E("calloc()");
+        goto end;
+    }
+
+    for (n = 0; n < pool.n_workers; n++) {
+        struct patch_worker *w = &pool.workers[n];
+        w->pool = &pool;
+        w->index = n;
+        pthread_mutex_init(&w->deque.lock, NULL);
+        if (!(w->logcap = open_memstream(&w->logbuf, &w->loglen))) {
+            E("open_memstream()");
+            pool.n_workers = n;
+            goto end;
+        }
+    }
+
+    // held until every listed file is submitted, so no worker quits early
+    atomic_fetch_add(&pool.pending, 1);
+
+    for (; n_started < pool.n_workers; n_started++) {
+        if ((errno = pthread_create(&pool.workers[n_started].thread, NULL,
+                                    patch_worker_run,
+                                    &pool.workers[n_started])) != 0) {
+            E("pthread_create()");
+            break;
+        }
+    }
+
+    if (elflist.n_entries) {
+        // shipped with the tree: no walk, no probes of scripts
+        D("%s: %zu listed files", dirpath, elflist.n_entries);
+        for (i = 0; i < elflist.n_entries; i++) {
+            patch_worker_submit(&pool.workers[0], dirpath,
+                                elflist.strings +
+                                elflist.entries[i].path_offset,
+                                0, &elflist.entries[i]);
+        }
+    } else {
+        // the root is scanned by the calling thread; workers steal from it
+        patch_worker_submit(&pool.workers[0], dirpath, NULL, 1, NULL);
+    }
+
+    if (atomic_fetch_sub(&pool.pending, 1) == 1) {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    patch_worker_run(&pool.workers[0]);
+
+    for (n = 1; n < n_started; n++) {
+        pthread_join(pool.workers[n].thread, NULL);
+    }
+
+    // report in path order, independent of scheduling
+    for (n = 0; n < pool.n_workers; n++) {
+        fflush(pool.workers[n].logcap);
+        n_results += pool.workers[n].n_results;
+    }
+
+    if (n_results && (results = malloc(n_results * sizeof(*results)))) {
+        n_results = 0;
+        for (n = 0; n < pool.n_workers; n++) {
+            memcpy(results + n_results, pool.workers[n].results,
+                   pool.workers[n].n_results * sizeof(*results));
+            n_results += pool.workers[n].n_results;
+        }
+        qsort(results, n_results, sizeof(*results), patch_result_cmp);
+        for (i = 0; i < n_results; i++) {
+            log_submit(results[i].worker->logbuf + results[i].logoff,
+                       results[i].loglen);
+        }
+    }
+
+    tr = trace_begin();
+    if (txn_commit(&txn) < 0) {
+        atomic_fetch_add(&pool.n_errors, 1);
+    }
+    atomic_fetch_add(&pool.n_errors, txn.n_failed);
+    trace_end("txn_commit", tr, dirpath);
+
+    if ((n = atomic_load(&pool.n_errors)) > 0) {
+        W("%s: %d error(s) while patching", dirpath, n);
+    }
+
+    tr = trace_begin();
+    if (journal_close(&journal) < 0) {
+        goto end;
+    }
+    trace_end("journal_close", tr, dirpath);
+
+    if (unpatch) {
+        // every file has to be probed again on the next run
+        char path[PATH_MAX];
+        if (manifest_path(dirpath, path) < 0 ||
+            (unlink(path) < 0 && errno != ENOENT)) {
+            E("unlink(): %s", dirpath);
+            goto end;
+        }
+        errno = 0;
+        ret = 0;
+        goto end;
+    }
+
+    n_entries = txn.n_done;
+    for (n = 0; n < pool.n_workers; n++) {
+        n_entries += pool.workers[n].n_entries;
+    }
+
+    if (!(entries = malloc((n_entries ? n_entries : 1) * sizeof(*entries)))) {
+        E("malloc()");
+        goto end;
+    }
+
+    n_entries = 0;
+    for (n = 0; n < pool.n_workers; n++) {
+        memcpy(entries + n_entries, pool.workers[n].entries,
+               pool.workers[n].n_entries * sizeof(*entries));
+        n_entries += pool.workers[n].n_entries;
+    }
+
+    for (i = 0; i < txn.n_done; i++) {
+        manifest_entry_set(&entries[n_entries++], &txn.done[i].sb, PATCH_DONE);
+    }
+
+    manifest_unload(&manifest);
+
+    tr = trace_begin();
+    if (manifest_save(dirpath, entries, n_entries) < 0) {
+        goto end;
+    }
+    trace_end("manifest_save", tr, dirpath);
+
+    ret = 0;
+
+end:
+    free(results);
+    free(entries);
+    manifest_unload(&manifest);
+    elflist_unload(&elflist);
+    journal_close(&journal);
+    txn_free(&txn);
+
+    for (n = 0; pool.workers && n < pool.n_workers; n++) {
+        struct patch_worker *w = &pool.workers[n];
+        for (i = 0; i < w->n_results; i++) {
+            free(w->results[i].path);
+        }
+        free(w->results);
+        free(w->entries);
+        if (w->has_io) {
+            batchio_free(&w->io);
+        }
+        if (w->logcap) {
+            fclose(w->logcap);
+        }
+        free(w->logbuf);
+        pthread_mutex_destroy(&w->deque.lock);
+    }
+
+    free(pool.workers);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+
+    return ret;
+}
+
+
+static void setup_opts(void)
+{
+    const char *env = getenv("VSCODE_PATCH_JOBS");
+    char *endp;
+    long n = 0;
+
+    if (env && *env) {
+        errno = 0;
+        n = strtol(env, &endp, 10);
+        if (errno || *endp || n < 1) {
+            W("invalid VSCODE_PATCH_JOBS=%s", env);
+            n = 0;
+        }
+    }
+
+    if (n <= 0 && (n = sysconf(_SC_NPROCESSORS_ONLN)) > PATCH_JOBS_DEFAULT) {
+        n = PATCH_JOBS_DEFAULT;
+    }
+
+    opt_jobs = n < 1 ? 1 : n > PATCH_JOBS_MAX ? PATCH_JOBS_MAX : n;
+
+    if ((env = getenv("VSCODE_PATCH_INPLACE")) && !strcmp(env, "0")) {
+        opt_inplace = 0;
+    }
+
+    if ((env = getenv("VSCODE_PATCH_ALL")) && !strcmp(env, "1")) {
+        opt_patch_all = 1;
+    }
+
+    if ((env = getenv("VSCODE_PATCH_FAST_START")) && !strcmp(env, "0")) {
+        opt_fast_start = 0;
+    }
+
+    if ((env = getenv("VSCODE_PATCH_DAEMON")) && !strcmp(env, "1")) {
+        opt_daemon = 1;
+    }
+
+    if ((env = getenv("VSCODE_PATCH_STORE")) && *env == '/') {
+        opt_store = env;
+    }
+
+    if ((env = getenv("VSCODE_PATCH_IO_URING")) && !strcmp(env, "0")) {
+        opt_io_uring = 0;
+    }
+
+    if ((env = getenv("VSCODE_PATCH_WATCH_DIRS")) && *env) {
+        errno = 0;
+        n = strtol(env, &endp, 10);
+        if (errno || *endp || n < 0) {
+            W("invalid VSCODE_PATCH_WATCH_DIRS=%s", env);
+        } else {
+            opt_watch_dirs = n;
+        }
+    }
+
+    if ((env = getenv("VSCODE_PATCH_FANOTIFY")) && !strcmp(env, "1")) {
+        opt_fanotify = 1;
+    }
+}
+
+
+static int check_patched(const char *path)
+{
+    int ret = -1, fd = -1, siz;
+    char abspath[PATH_MAX], patched[PATH_MAX], path_prev[PATH_MAX] = {0};
+    char dname[PATH_MAX], fname[PATH_MAX];
+
+    if (opt_patch_now) {
+        goto end;
+    }
+
+    if (!realpath(path, abspath)) {
+        E("realpath(): %s", path);
+        goto end;
+    }
+
+    if (split_path(path, dname, fname) < 0) {
+        E("split_path()");
+        goto end;
+    }
+
+    siz = snprintf(patched, PATH_MAX, "%s/.%s.patched", dname, fname);
+    if (siz < 0) {
+        E("snprintf(): %s", path);
+        goto end;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", path);
+        goto end;
+    }
+
+    if ((fd = open(patched, O_RDONLY)) < 0) {
+        if (errno != ENOENT) {
+            E("open(): %s", patched);
+        }
+        goto end;
+    }
+
+    if (read(fd, path_prev, PATH_MAX) <= 0) {
+        E("read(): %s", patched);
+        goto end;
+    }
+
+    if (strncmp(abspath, path_prev, PATH_MAX) != 0) {
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+
+static int set_patched(const char *path)
+{
+    int ret = -1, fd = -1, siz;
+    ssize_t abspath_size;
+    char abspath[PATH_MAX], patched[PATH_MAX];
+    char dname[PATH_MAX], fname[PATH_MAX];
+
+    if (!realpath(path, abspath)) {
+        E("realpath(): %s", path);
+        goto end;
+    }
+
+    abspath_size = strlen(abspath);
+
+    if (split_path(path, dname, fname) < 0) {
+        E("split_path()");
+        goto end;
+    }
+
+    siz = snprintf(patched, PATH_MAX, "%s/.%s.patched", dname, fname);
+    if (siz < 0) {
+        E("snprintf(): %s", path);
+        goto end;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", path);
+        goto end;
+    }
+
+    if ((fd = open(patched, O_CREAT | O_TRUNC | O_WRONLY,
+                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        E("open(): %s", patched);
+        goto end;
+    }
+
+    if (write(fd, abspath, abspath_size) != abspath_size) {
+        E("write(): %s", patched);
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+
+// what a launch patches, and against what
+static uint64_t launch_config_hash(uint64_t h)
+{
+    h = fnv1a64(h, glibc_interp_new, strlen(glibc_interp_new) + 1);
+    h = fnv1a64(h, realcli_path, strlen(realcli_path) + 1);
+    h = fnv1a64(h, serverdir_path, strlen(serverdir_path) + 1);
+    h = fnv1a64(h, extdir_path, strlen(extdir_path) + 1);
+    h = fnv1a64(h, &opt_patch_all, sizeof(opt_patch_all));
+    if (opt_store) {
+        h = fnv1a64(h, opt_store, strlen(opt_store) + 1);
+    }
+    return h;
+}
+
+
+static uint64_t stamp_config_hash(void)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint32_t version = STAMP_VERSION;
+    struct stat sb;
+    int64_t id[4];
+
+    h = fnv1a64(h, &version, sizeof(version));
+    h = launch_config_hash(h);
+
+    // an update replaces the CLI or the server root under the same names
+    memset(id, 0, sizeof(id));
+    if (stat(realcli_path, &sb) == 0) {
+        id[0] = sb.st_dev;
+        id[1] = sb.st_ino;
+        id[2] = sb.st_size;
+        id[3] = sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+    }
+    h = fnv1a64(h, id, sizeof(id));
+
+    memset(id, 0, sizeof(id));
+    if (stat(serverdir_path, &sb) == 0) {
+        id[0] = sb.st_dev;
+        id[1] = sb.st_ino;
+    }
+    h = fnv1a64(h, id, sizeof(id));
+
+    return h;
+}
+
+
+/*
+ * Describe the current generation: configuration and extensions.json.
+ * Taken before patching, so changes made meanwhile invalidate the stamp.
+ */
+static void stamp_init(struct stamp *st)
+{
+    struct stat sb;
+
+    memset(st, 0, sizeof(*st));
+    memcpy(st->magic, STAMP_MAGIC, sizeof(st->magic));
+    st->version = STAMP_VERSION;
+    st->config_hash = stamp_config_hash();
+
+    // a missing extensions.json is a generation as well
+    if (stat(extjson_path, &sb) == 0) {
+        st->extjson_dev = sb.st_dev;
+        st->extjson_ino = sb.st_ino;
+        st->extjson_size = sb.st_size;
+        st->extjson_mtime_ns = sb.st_mtim.tv_sec * 1000000000LL +
+                               sb.st_mtim.tv_nsec;
+    }
+}
+
+
+/*
+ * Returns 0 if the stamp on disk matches the current generation.
+ */
+static int stamp_check(void)
+{
+    struct stamp saved, cur;
+    int ret = -1, fd = -1;
+    int64_t tr = trace_begin();
+
+    if ((fd = open(stamp_path, O_RDONLY | O_CLOEXEC)) < 0) {
+        goto end;
+    }
+
+    if (read(fd, &saved, sizeof(saved)) != sizeof(saved)) {
+        goto end;
+    }
+
+    stamp_init(&cur);
+    if (memcmp(&saved, &cur, sizeof(cur)) != 0) {
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    trace_end("stamp_check", tr, NULL);
+    return ret;
+}
+
+
+static int stamp_save(const struct stamp *st)
+{
+    int ret = -1, fd = -1, siz, created = 0;
+    char tmppath[PATH_MAX];
+
+    siz = snprintf(tmppath, PATH_MAX, "%s" TMPEXT, stamp_path);
+    if (siz < 0) {
+        E("snprintf(): %s", stamp_path);
+        goto end;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", stamp_path);
+        goto end;
+    }
+
+    if ((fd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR)) < 0) {
+        E("open(): %s", tmppath);
+        goto end;
+    }
+    created = 1;
+
+    if (write(fd, st, sizeof(*st)) != sizeof(*st)) {
+        E("write(): %s", tmppath);
+        goto end;
+    }
+
+    if (close(fd) < 0) {
+        fd = -1;
+        E("close(): %s", tmppath);
+        goto end;
+    }
+    fd = -1;
+
+    if (rename(tmppath, stamp_path) < 0) {
+        E("rename(): %s => %s", tmppath, stamp_path);
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (ret < 0 && created) {
+        unlink(tmppath);
+    }
+
+    return ret;
+}
+
+
+static void stamp_clear(void)
+{
+    if (unlink(stamp_path) < 0 && errno != ENOENT) {
+        E("unlink(): %s", stamp_path);
+    }
+}
+
+
+static int patch_dir(const char *dirpath)
+{
+    int ret = -1;
+    int64_t tr = trace_begin();
+
+    if (patch_tree(dirpath, 0) < 0) {
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    trace_end("patch_dir", tr, dirpath);
+    return ret;
+}
+
+
+static int patch_cli(char *cli_path)
+{
+    struct journal journal;
+    struct txn txn;
+    struct stat sb;
+    int ret = -1;
+    int64_t tr_cli = trace_begin(), tr = trace_begin();
+
+    journal_init(&journal, cli_path);
+    txn_init(&txn, cli_path, &journal);
+
+    if (check_patched(cli_path) == 0) {
+        trace_end("check_patched", tr, cli_path);
+        ret = 0;
+        goto end;
+    }
+
+    trace_end("check_patched", tr, cli_path);
+
+    if (txn_recover(&txn) < 0) {
+        goto end;
+    }
+
+    if (stat(cli_path, &sb) < 0) {
+        E("stat(): %s", cli_path);
+        goto end;
+    }
+
+    if (patch_file(cli_path, &sb, &journal, &txn) < 0 ||
+        txn_commit(&txn) < 0 || txn.n_failed) {
+        goto end;
+    }
+
+    if (journal_close(&journal) < 0) {
+        goto end;
+    }
+
+    if (set_patched(cli_path) < 0) {
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    journal_close(&journal);
+    txn_free(&txn);
+    trace_end("patch_cli", tr_cli, cli_path);
+    return ret;
+}
+
+
+static int unpatch_cli(char *cli_path)
+{
+    struct journal journal;
+    char dname[PATH_MAX], fname[PATH_MAX], patched[PATH_MAX];
+    int ret = -1, siz;
+
+    journal_init(&journal, cli_path);
+
+    if (unpatch_file(cli_path, &journal) < 0) {
+        goto end;
+    }
+
+    if (journal_close(&journal) < 0) {
+        goto end;
+    }
+
+    if (split_path(cli_path, dname, fname) < 0) {
+        E("split_path()");
+        goto end;
+    }
+
+    siz = snprintf(patched, PATH_MAX, "%s/.%s.patched", dname, fname);
+    if (siz < 0) {
+        E("snprintf(): %s", cli_path);
+        goto end;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", cli_path);
+        goto end;
+    }
+
+    if (unlink(patched) < 0 && errno != ENOENT) {
+        E("unlink(): %s", patched);
+        goto end;
+    }
+
+    errno = 0;
+    ret = 0;
+
+end:
+    journal_close(&journal);
+    return ret;
+}
+
+
+static int unpatch_extensions(void)
+{
+    DIR *dir;
+    struct dirent *ent;
+    struct stat sb;
+    char path[PATH_MAX];
+    int ret = 0, siz;
+
+    if (!(dir = opendir(extdir_path))) {
+        if (errno != ENOENT) {
+            E("opendir(): %s", extdir_path);
+            return -1;
+        }
+        errno = 0;
+        return 0;
+    }
+
+    while ((ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+
+        siz = snprintf(path, PATH_MAX, "%s/%s", extdir_path, ent->d_name);
+        if (siz < 0 || siz >= PATH_MAX) {
+            errno = siz < 0 ? errno : ENAMETOOLONG;
+            E("snprintf(): %s", ent->d_name);
+            ret = -1;
+            continue;
+        }
+
+        if (lstat(path, &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+            continue;
+        }
+
+        if (patch_tree(path, 1) < 0) {
+            ret = -1;
+        }
+    }
+
+    closedir(dir);
+
+    if (unlink(extstate_path) < 0 && errno != ENOENT) {
+        E("unlink(): %s", extstate_path);
+        ret = -1;
+    }
+
+    errno = 0;
+    return ret;
+}
+
+
+static int ext_state_cmp(const void *a, const void *b)
+{
+    const struct ext_state *ea = a, *eb = b;
+    return strcmp(ea->path, eb->path);
+}
+
+
+static void ext_state_free(struct ext_state *states, size_t n_states)
+{
+    size_t i;
+
+    for (i = 0; i < n_states; i++) {
+        free(states[i].path);
+        free(states[i].version);
+    }
+
+    free(states);
+}
+
+
+static int ext_fingerprint(const char *dirpath, uint64_t *fingerprint)
+{
+    struct stat sb;
+    uint64_t h = manifest_config_hash();
+    int64_t ts[2];
+
+    if (stat(dirpath, &sb) < 0) {
+        return -1;
+    }
+
+    // installs and updates replace the directory or touch its top level
+    ts[0] = sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+    ts[1] = sb.st_ctim.tv_sec * 1000000000LL + sb.st_ctim.tv_nsec;
+    h = fnv1a64(h, &sb.st_dev, sizeof(sb.st_dev));
+    h = fnv1a64(h, &sb.st_ino, sizeof(sb.st_ino));
+    h = fnv1a64(h, ts, sizeof(ts));
+
+    *fingerprint = h;
+    return 0;
+}
+
+
+static int ext_state_load(struct ext_state **states, size_t *n_states)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t linecap = 0, cap = 0;
+    ssize_t len;
+
+    *states = NULL;
+    *n_states = 0;
+
+    if (opt_patch_now) {
+        return 0;
+    }
+
+    if (!(fp = fopen(extstate_path, "re"))) {
+        if (errno != ENOENT) {
+            E("fopen(): %s", extstate_path);
+        }
+        errno = 0;
+        return 0;
+    }
+
+    while ((len = getline(&line, &linecap, fp)) > 0) {
+        char *version, *path;
+        unsigned long long fingerprint;
+
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        if (!(version = strchr(line, '\t')) ||
+            !(path = strchr(version + 1, '\t'))) {
+            continue;
+        }
+
+        *version++ = '\0';
+        *path++ = '\0';
+
+        if (sscanf(line, "%llx", &fingerprint) != 1) {
+            continue;
+        }
+
+        if (array_reserve(states, &cap, *n_states, sizeof(**states)) < 0) {
+            break;
+        }
+
+        (*states)[*n_states].fingerprint = fingerprint;
+        (*states)[*n_states].version = strdup(version);
+        (*states)[*n_states].path = strdup(path);
+        if (!(*states)[*n_states].version || !(*states)[*n_states].path) {
+            free((*states)[*n_states].version);
+            free((*states)[*n_states].path);
+            break;
+        }
+        (*n_states)++;
+    }
+
+    free(line);
+    fclose(fp);
+
+    qsort(*states, *n_states, sizeof(**states), ext_state_cmp);
+    return 0;
+}
+
+
+static int ext_state_save(const struct ext_state *states, size_t n_states)
+{
+    char tmppath[PATH_MAX];
+    FILE *fp = NULL;
+    int ret = -1, siz;
+    size_t i;
+
+    siz = snprintf(tmppath, PATH_MAX, "%s.%ld%s", extstate_path,
+                   (long) getpid(), TMPEXT);
+    if (siz < 0) {
+        E("snprintf(): %s", extstate_path);
+        goto end;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", extstate_path);
+        goto end;
+    }
+
+    if (!(fp = fopen(tmppath, "we"))) {
+        E("fopen(): %s", tmppath);
+        goto end;
+    }
+
+    for (i = 0; i < n_states; i++) {
+        if (strpbrk(states[i].path, "\t\n") ||
+            strpbrk(states[i].version, "\t\n")) {
+            // not representable: always rescanned
+            continue;
+        }
+        // files may yet be added unseen: the next pass walks them all
+        fprintf(fp, "%016llx\t%s\t%s\n",
+                ext_unwatched ? 0ULL
+                              : (unsigned long long) states[i].fingerprint,
+                states[i].version, states[i].path);
+    }
+
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        E("fclose(): %s", tmppath);
+        goto end;
+    }
+    fp = NULL;
+
+    if (rename(tmppath, extstate_path) < 0) {
+        E("rename(): %s => %s", tmppath, extstate_path);
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    if (fp) {
+        fclose(fp);
+    }
+
+    if (ret < 0) {
+        unlink(tmppath);
+    }
+
+    return ret;
+}
+
+
+struct ext_pass {
+    struct ext_state *prev, *next;
+    size_t n_prev, n_next, cap_next, n_patched;
+};
+
+
+static int patch_extension(const struct extjson_entry *entry, void *arg)
+{
+    struct ext_pass *pass = arg;
+    struct ext_state key, *old, *cur;
+
+    if (array_reserve(&pass->next, &pass->cap_next, pass->n_next,
+                      sizeof(*pass->next)) < 0) {
+        return -2;
+    }
+
+    cur = &pass->next[pass->n_next];
+    if (!(cur->path = strdup(entry->path))) {
+        E("strdup()");
+        return -2;
+    }
+    if (!(cur->version = strdup(entry->version))) {
+        E("strdup()");
+        free(cur->path);
+        return -2;
+    }
+    pass->n_next++;
+
+    key.path = cur->path;
+    old = pass->n_prev ? bsearch(&key, pass->prev, pass->n_prev,
+                                 sizeof(*pass->prev), ext_state_cmp) : NULL;
+
+    if (!ext_unwatched &&
+        ext_fingerprint(cur->path, &cur->fingerprint) == 0 && old &&
+        old->fingerprint == cur->fingerprint &&
+        !strcmp(old->version, cur->version)) {
+        // unchanged since the last pass
+        return 0;
+    }
+
+    pass->n_patched++;
+
+    // fingerprinted again, as patching may have touched the directory
+    if (patch_dir(cur->path) < 0 ||
+        ext_fingerprint(cur->path, &cur->fingerprint) < 0) {
+        // retried on the next pass
+        free(cur->path);
+        free(cur->version);
+        pass->n_next--;
+    }
+
+    return 0;
+}
+
+
+static int patch_extensions(char *extjson_path)
+{
+    int ret = -1, fd = -1, rc;
+    struct stat sb;
+    char *json_buff = NULL;
+    struct ext_pass pass = { 0 };
+    size_t j, n_removed = 0, err_off = 0;
+    int64_t tr_ext = trace_begin(), tr;
+
+    if (stat(extdir_path, &sb) < 0 &&
+            mkdir(extdir_path, S_IRWXU | S_IRWXG | S_IRWXO) < 0) {
+        E("mkdir(): %s", extdir_path);
+        goto end;
+    }
+
+    if ((fd = open(extjson_path, O_CREAT | O_RDONLY,
+                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        E("open(): %s", extjson_path);
+        goto end;
+    }
+
+    if (fstat(fd, &sb) == -1) {
+        E("fstat(): %s", extjson_path);
+        goto end;
+    }
+
+    if (!sb.st_size) {
+        // skip empty file
+        ret = 0;
+        goto end;
+    }
+
+    if ((json_buff = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+            == MAP_FAILED) {
+        json_buff = NULL;
+        E("mmap(): %s", extjson_path);
+        goto end;
+    }
+
+    // read sequentially, once
+    madvise(json_buff, sb.st_size, MADV_SEQUENTIAL);
+
+    tr = trace_begin();
+    if (ext_state_load(&pass.prev, &pass.n_prev) < 0) {
+        goto end;
+    }
+    trace_end("ext_state_load", tr, NULL);
+
+    tr = trace_begin();
+    rc = extjson_parse(json_buff, sb.st_size, patch_extension, &pass,
+                       &err_off);
+    trace_end("extensions_json", tr, extjson_path);
+    if (rc == -1) {
+        E("%s: invalid JSON at offset %zu", extjson_path, err_off);
+        goto end;
+    } else if (rc < 0) {
+        goto end;
+    }
+
+    qsort(pass.next, pass.n_next, sizeof(*pass.next), ext_state_cmp);
+
+    for (j = 0; j < pass.n_prev; j++) {
+        if (!pass.n_next || !bsearch(&pass.prev[j], pass.next, pass.n_next,
+                                     sizeof(*pass.next), ext_state_cmp)) {
+            n_removed++;
+            // an update lists the new directory and removes the old one
+            if (lstat(pass.prev[j].path, &(struct stat){0}) < 0 &&
+                errno == ENOENT) {
+                root_sidecars_remove(pass.prev[j].path);
+            }
+        }
+    }
+
+    if (pass.n_patched || n_removed) {
+        I("Extensions: %zu listed, %zu patched, %zu removed", pass.n_next,
+          pass.n_patched, n_removed);
+    }
+
+    tr = trace_begin();
+    if (ext_state_save(pass.next, pass.n_next) < 0) {
+        goto end;
+    }
+    trace_end("ext_state_save", tr, NULL);
+
+    ret = 0;
+
+end:
+    trace_end("patch_extensions", tr_ext, NULL);
+    ext_state_free(pass.prev, pass.n_prev);
+    ext_state_free(pass.next, pass.n_next);
+
+    if (json_buff) {
+        munmap(json_buff, sb.st_size);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+
+static int create_skip_check_file(void)
+{
+    static const char *path = "/tmp/vscode-skip-server-requirements-check";
+    int ret = -1, fd = -1;
+
+    if ((fd = open(path, O_CREAT | O_RDONLY,
+                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        E("open(): %s", path);
+        goto end;
+    }
+
+    ret = 0;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+
+/*
+ * The extension directory fpath is below, in root. VS Code unpacks into a
+ * hidden directory and renames it when done: those are left to the pass
+ * that follows the change of extensions.json.
+ */
+static int watch_ext_root(const char *fpath, char *root)
+{
+    size_t len = strlen(extdir_path);
+    const char *slash;
+
+    if (strncmp(fpath, extdir_path, len) != 0 || fpath[len] != '/' ||
+        fpath[len + 1] == '.' || !(slash = strchr(fpath + len + 1, '/'))) {
+        return -1;
+    }
+
+    memcpy(root, fpath, slash - fpath);
+    root[slash - fpath] = '\0';
+    return 0;
+}
+
+
+static void watch_event(const char *path, int what, void *arg)
+{
+    struct watch_pending *wp = arg;
+    struct watch_item *item;
+    char root[PATH_MAX];
+
+    if (what == TREEWATCH_LOST) {
+        wp->lost = 1;
+        return;
+    } else if (what == TREEWATCH_ROOT) {
+        wp->rewatch = 1;
+        return;
+    } else if (!strcmp(path, extjson_path)) {
+        wp->changed = 1;
+        return;
+    }
+
+    if (wp->lost || watch_ext_root(path, root) < 0 ||
+        is_patch_sidecar(path)) {
+        return;
+    }
+
+    if (wp->n == WATCH_PENDING_MAX) {
+        // more than is worth tracking one by one
+        wp->lost = 1;
+        return;
+    }
+
+    if (array_reserve(&wp->items, &wp->cap, wp->n, sizeof(*wp->items)) < 0) {
+        wp->lost = 1;
+        return;
+    }
+
+    item = &wp->items[wp->n];
+    if (!(item->path = strdup(path))) {
+        E("strdup()");
+        wp->lost = 1;
+        return;
+    }
+    item->what = what;
+    wp->n++;
+}
+
+
+static void watch_pending_clear(struct watch_pending *wp)
+{
+    for (size_t i = 0; i < wp->n; i++) {
+        free(wp->items[i].path);
+    }
+
+    wp->n = 0;
+    wp->first_ns = 0;
+}
+
+
+static int watch_item_cmp(const void *a, const void *b)
+{
+    const struct watch_item *x = a, *y = b;
+    int ret = strcmp(x->path, y->path);
+
+    // a directory first: it covers the same path as a file
+    return ret ? ret : y->what - x->what;
+}
+
+
+static int watch_settle_arm(struct watch_pending *wp, int timer_fd)
+{
+    struct itimerspec its = {0};
+    int64_t now = monotonic_ns(), deadline;
+
+    if (!wp->first_ns) {
+        wp->first_ns = now;
+    }
+
+    // a steady stream of files is still patched every so often
+    deadline = now + WATCH_SETTLE_NS;
+    if (deadline > wp->first_ns + WATCH_SETTLE_CAP_NS) {
+        deadline = wp->first_ns + WATCH_SETTLE_CAP_NS;
+    }
+
+    its.it_value.tv_sec = deadline / 1000000000LL;
+    its.it_value.tv_nsec = deadline % 1000000000LL;
+
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        E("timerfd_settime()");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// patch every file below dirpath, which was moved in whole
+static int watch_scan(const char *dirpath, struct journal *jr,
+                      struct txn *txn, int depth)
+{
+    char path[PATH_MAX];
+    struct dirent *ent;
+    struct stat sb;
+    DIR *dir;
+    int ret = 0, siz;
+
+    if (!(dir = opendir(dirpath))) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    while ((ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+
+        siz = snprintf(path, PATH_MAX, "%s/%s", dirpath, ent->d_name);
+        if (siz < 0 || siz >= PATH_MAX) {
+            errno = siz < 0 ? errno : ENAMETOOLONG;
+            E("snprintf(): %s", ent->d_name);
+            ret = -1;
+            continue;
+        }
+
+        if (lstat(path, &sb) < 0) {
+            continue;
+        }
+
+        if (S_ISDIR(sb.st_mode)) {
+            if (depth < TREEWATCH_DEPTH &&
+                watch_scan(path, jr, txn, depth + 1) < 0) {
+                ret = -1;
+            }
+        } else if (patch_file(path, &sb, jr, txn) == PATCH_FAILED) {
+            ret = -1;
+        }
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+
+static int watch_is_own(const struct watch_pending *wp,
+                        const struct stat *sb)
+{
+    for (size_t i = 0; i < wp->n_own; i++) {
+        if (wp->own[i].st_ino == sb->st_ino &&
+            wp->own[i].st_dev == sb->st_dev &&
+            wp->own[i].st_size == sb->st_size &&
+            wp->own[i].st_mtim.tv_sec == sb->st_mtim.tv_sec &&
+            wp->own[i].st_mtim.tv_nsec == sb->st_mtim.tv_nsec) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Patch items, the new files and directories of the extension root, in
+ * one transaction.
+ */
+static int watch_patch_ext(struct watch_pending *wp, const char *root,
+                           const struct watch_item *items, size_t n)
+{
+    struct journal journal;
+    struct txn txn;
+    struct stat sb;
+    const char *scanned = NULL;
+    size_t i, n_scanned = 0;
+    int ret = 0;
+
+    journal_init(&journal, root);
+    txn_init(&txn, root, &journal);
+
+    // a pass over this extension may have been interrupted
+    if (txn_recover(&txn) < 0) {
+        ret = -1;
+        goto end;
+    }
+
+    for (i = 0; i < n; i++) {
+        // sorted: what a scanned directory holds follows it
+        if ((i && !strcmp(items[i].path, items[i - 1].path)) ||
+            (scanned && !strncmp(items[i].path, scanned, n_scanned) &&
+             items[i].path[n_scanned] == '/')) {
+            continue;
+        }
+
+        if (items[i].what == TREEWATCH_DIR) {
+            scanned = items[i].path;
+            n_scanned = strlen(scanned);
+            if (watch_scan(items[i].path, &journal, &txn, 0) < 0) {
+                ret = -1;
+            }
+        } else if (lstat(items[i].path, &sb) == 0 && !watch_is_own(wp, &sb) &&
+                   patch_file(items[i].path, &sb, &journal, &txn) ==
+                       PATCH_FAILED) {
+            ret = -1;
+        }
+    }
+
+    if (txn_commit(&txn) < 0 || txn.n_failed || journal_close(&journal) < 0) {
+        ret = -1;
+    }
+
+    for (i = 0; i < txn.n_done; i++) {
+        if (array_reserve(&wp->own_next, &wp->cap_own_next, wp->n_own_next,
+                          sizeof(*wp->own_next)) < 0) {
+            break;
+        }
+        wp->own_next[wp->n_own_next++] = txn.done[i].sb;
+    }
+
+end:
+    journal_close(&journal);
+    txn_free(&txn);
+    return ret;
+}
+
+
+/*
+ * Patch what appeared inside installed extensions since the last call.
+ * Renames of patched files show up again, and are found patched.
+ */
+static void watch_patch(struct watch_pending *wp)
+{
+    char root[PATH_MAX], next[PATH_MAX];
+    size_t i, j;
+    int64_t tr = trace_begin();
+
+    // the paths of an extension sort together
+    qsort(wp->items, wp->n, sizeof(*wp->items), watch_item_cmp);
+
+    for (i = 0; i < wp->n; i = j) {
+        watch_ext_root(wp->items[i].path, root);
+        for (j = i + 1; j < wp->n; j++) {
+            if (watch_ext_root(wp->items[j].path, next) < 0 ||
+                strcmp(next, root) != 0) {
+                break;
+            }
+        }
+
+        D("%s: %zu new path(s)", root, j - i);
+        if (watch_patch_ext(wp, root, wp->items + i, j - i) < 0) {
+            W("%s: error(s) while patching new files", root);
+        }
+    }
+
+    // what was put in place by the last call shows up no more
+    free(wp->own);
+    wp->own = wp->own_next;
+    wp->n_own = wp->n_own_next;
+    wp->cap_own = wp->cap_own_next;
+    wp->own_next = NULL;
+    wp->n_own_next = wp->cap_own_next = 0;
+
+    trace_end("watch_patch", tr, NULL);
+    watch_pending_clear(wp);
+}
+
+
+static int debounce_arm(struct debounce *db, int timer_fd)
+{
+    struct itimerspec its = {0};
+    int64_t now = monotonic_ns(), deadline;
+
+    if (!db->first_ns) {
+        db->first_ns = now;
+        db->window_ns = DEBOUNCE_MIN_NS;
+    } else if ((db->window_ns *= 2) > DEBOUNCE_MAX_NS) {
+        // still busy: wait longer for the writer to settle
+        db->window_ns = DEBOUNCE_MAX_NS;
+    }
+
+    deadline = now + db->window_ns;
+    if (deadline > db->first_ns + DEBOUNCE_CAP_NS) {
+        deadline = db->first_ns + DEBOUNCE_CAP_NS;
+    }
+
+    its.it_value.tv_sec = deadline / 1000000000LL;
+    its.it_value.tv_nsec = deadline % 1000000000LL;
+
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        E("timerfd_settime()");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Verify and patch the CLI, the server directory and the extensions, and
+ * stamp the generation if all of them succeeded.
+ */
+static int patch_all(void)
+{
+    struct stamp st;
+
+    stamp_init(&st);
+
+    if (patch_cli(realcli_path) < 0 || patch_dir(serverdir_path) < 0 ||
+        patch_extensions(extjson_path) < 0) {
+        stamp_clear();
+        return -1;
+    }
+
+    stamp_save(&st);
+    return 0;
+}
+
+
+static int daemon_peer_ok(int fd, pid_t *pid)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        E("getsockopt(): SO_PEERCRED");
+        return 0;
+    }
+
+    if (pid) {
+        *pid = cred.pid;
+    }
+
+    // abstract sockets have no file permissions
+    return cred.uid == getuid();
+}
+
+
+/*
+ * The start time of process pid, in clock ticks since boot. Returns -1 if
+ * it exited, also if it is a zombie.
+ */
+static int proc_start_time(pid_t pid, unsigned long long *start)
+{
+    char path[64], buf[1024], *p;
+    ssize_t len;
+    int fd, i;
+
+    snprintf(path, sizeof(path), "/proc/%ld/stat", (long) pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+
+    // the command name may hold anything: the state follows its last ')'
+    if (!(p = strrchr(buf, ')')) || p[1] != ' ' || p[2] == 'Z' ||
+        p[2] == 'X') {
+        return -1;
+    }
+
+    // the start time is field 22, the state field 3
+    for (i = 2; i < 22 && p; i++) {
+        p = strchr(p + 1, ' ');
+    }
+
+    if (!p || sscanf(p + 1, "%llu", start) != 1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Forget the clients whose process exited. kill() is the cheap test, the
+ * start time catches a pid that was reused.
+ */
+static void daemon_reap(struct daemon_clients *clients)
+{
+    struct daemon_peer *peer;
+    unsigned long long start;
+    size_t i = 0;
+
+    clients->reaped = monotonic_ns();
+
+    while (i < clients->n_peers) {
+        peer = &clients->peers[i];
+        if ((kill(peer->pid, 0) < 0 && errno == ESRCH) ||
+            proc_start_time(peer->pid, &start) < 0 ||
+            start != peer->start) {
+            D("daemon: client %ld exited (%zu)", (long) peer->pid,
+              clients->n_peers - 1);
+            *peer = clients->peers[--clients->n_peers];
+            continue;
+        }
+        i++;
+    }
+}
+
+
+static void daemon_follow(struct daemon_clients *clients, pid_t pid)
+{
+    unsigned long long start;
+    size_t i;
+
+    for (i = 0; i < clients->n_peers; i++) {
+        if (clients->peers[i].pid == pid) {
+            return;
+        }
+    }
+
+    // gone already: nothing to wait for
+    if (proc_start_time(pid, &start) < 0 ||
+        array_reserve(&clients->peers, &clients->cap_peers,
+                      clients->n_peers, sizeof(*clients->peers)) < 0) {
+        return;
+    }
+
+    clients->peers[clients->n_peers].pid = pid;
+    clients->peers[clients->n_peers].start = start;
+    clients->n_peers++;
+}
+
+
+static int daemon_accept(struct daemon_clients *clients, int epoll_fd,
+                         int listen_fd)
+{
+    struct epoll_event ev = {0};
+    pid_t pid;
+    int fd;
+
+    if ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+        if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED) {
+            return 0;
+        }
+        E("accept4()");
+        return -1;
+    }
+
+    if (!daemon_peer_ok(fd, &pid)) {
+        W("daemon: rejected a client of another user");
+        close(fd);
+        return 0;
+    }
+
+    daemon_follow(clients, pid);
+
+    if (array_reserve(&clients->fds, &clients->cap, clients->n,
+                      sizeof(*clients->fds)) < 0) {
+        close(fd);
+        return 0;
+    }
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        E("epoll_ctl()");
+        close(fd);
+        return 0;
+    }
+
+    clients->fds[clients->n++] = fd;
+    D("daemon: client connected (%zu)", clients->n);
+    return 0;
+}
+
+
+static void daemon_drop(struct daemon_clients *clients, int epoll_fd, int fd)
+{
+    for (size_t i = 0; i < clients->n; i++) {
+        if (clients->fds[i] == fd) {
+            clients->fds[i] = clients->fds[--clients->n];
+            break;
+        }
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    D("daemon: client disconnected (%zu)", clients->n);
+}
+
+
+/*
+ * Serve one request of client fd. Patching is done once per change:
+ * concurrent launches wait for the same run and then find the stamp
+ * current.
+ */
+static void daemon_request(struct daemon_clients *clients, int epoll_fd,
+                           int fd)
+{
+    char req, rep;
+    ssize_t n;
+
+    if ((n = recv(fd, &req, 1, MSG_DONTWAIT)) < 0 &&
+        (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    if (n <= 0 || req != DAEMON_REQ_PATCH) {
+        daemon_drop(clients, epoll_fd, fd);
+        return;
+    }
+
+    if (!clients->verified || stamp_check() != 0) {
+        clients->verified = patch_all() == 0;
+    }
+
+    rep = clients->verified ? DAEMON_REP_OK : DAEMON_REP_FAIL;
+    if (send(fd, &rep, 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+        errno != EPIPE && errno != ECONNRESET) {
+        E("send()");
+    }
+}
+
+
+/*
+ * Watch extensions.json and re-patch extensions after it changed, and
+ * patch the executables that extensions download into their directories
+ * as they appear, until pipe_fd is closed by the parent or, for the
+ * daemon (listen_fd >= 0), the last client disconnected.
+ */
+static int monitor_loop(int pipe_fd, int listen_fd)
+{
+    struct epoll_event epoll_ev = {0};
+    struct debounce db = {0};
+    struct daemon_clients clients = {0};
+    struct watch_pending wp = {0};
+    struct treewatch tw = { .fd = -1, .root_fd = -1 };
+    int ret = -1, epoll_fd = -1, timer_fd = -1, settle_fd = -1, rescan = 0;
+    size_t n_skipped = 0;
+
+    // flush threads do not survive fork()
+    log_start();
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        E("epoll_create1()");
+        goto end;
+    }
+
+    // VS Code replaces extensions.json by rename(): the directory is watched
+    switch (treewatch_init(&tw, extdir_path, opt_watch_dirs,
+                           opt_fanotify && opt_watch_dirs)) {
+    case 1:
+        D("%s: watched with fanotify", extdir_path);
+        break;
+    case 0:
+        D("%s: %zu directories watched with inotify", extdir_path,
+          tw.n_dirs);
+        break;
+    default:
+        E("treewatch_init(): %s", extdir_path);
+        goto end;
+    }
+
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                   TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+        (settle_fd = timerfd_create(CLOCK_MONOTONIC,
+                                    TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        E("timerfd_create()");
+        goto end;
+    }
+
+    epoll_ev.events = EPOLLIN | EPOLLHUP | EPOLLERR;
+    epoll_ev.data.fd = tw.fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tw.fd, &epoll_ev) == -1) {
+        E("epoll_ctl()");
+        goto end;
+    }
+
+    epoll_ev.events = EPOLLIN;
+    epoll_ev.data.fd = timer_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &epoll_ev) == -1) {
+        E("epoll_ctl()");
+        goto end;
+    }
+
+    epoll_ev.data.fd = settle_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, settle_fd, &epoll_ev) == -1) {
+        E("epoll_ctl()");
+        goto end;
+    }
+
+    epoll_ev.events = EPOLLHUP | EPOLLERR;
+    epoll_ev.data.fd = pipe_fd;
+    if (pipe_fd >= 0 &&
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipe_fd, &epoll_ev) == -1) {
+        E("epoll_ctl()");
+        goto end;
+    }
+
+    epoll_ev.events = EPOLLIN;
+    epoll_ev.data.fd = listen_fd;
+    if (listen_fd >= 0 &&
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &epoll_ev) == -1) {
+        E("epoll_ctl()");
+        goto end;
+    }
+
+    for (;;) {
+        struct epoll_event events[16];
+        int i, nfds;
+
+        // an extension's fingerprint misses files added below its top level
+        if (ext_unwatched != (tw.n_skipped > 0)) {
+            ext_unwatched = tw.n_skipped > 0;
+            if (ext_unwatched && unlink(extstate_path) < 0 &&
+                errno != ENOENT) {
+                E("unlink(): %s", extstate_path);
+            }
+        }
+
+        // VSCODE_PATCH_WATCH_DIRS=0 skips them on purpose
+        if (opt_watch_dirs && tw.n_skipped && !n_skipped) {
+            W("%s: %zu directories are not watched (VSCODE_PATCH_WATCH_DIRS "
+              "or fs.inotify.max_user_watches)", extdir_path, tw.n_skipped);
+            n_skipped = tw.n_skipped;
+        }
+
+        // a client lasts as long as its process, not its connection
+        if (listen_fd >= 0 &&
+            monotonic_ns() - clients.reaped >= DAEMON_CHECK_MS * 1000000LL) {
+            daemon_reap(&clients);
+        }
+
+        // the daemon lingers briefly without clients
+        if ((nfds = epoll_wait(epoll_fd, events, 16,
+                               listen_fd < 0 ? -1 :
+                               clients.n || clients.n_peers
+                                   ? DAEMON_CHECK_MS : DAEMON_LINGER_MS))
+                < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            E("epoll_wait()");
+            goto end;
+        }
+
+        if (nfds == 0) {
+            if (clients.n || clients.n_peers) {
+                continue;
+            }
+            // pick up a client that connected just now
+            if (daemon_accept(&clients, epoll_fd, listen_fd) < 0 ||
+                (!clients.n && !clients.n_peers)) {
+                I("daemon: no clients left, exiting");
+                ret = 0;
+                goto end;
+            }
+            continue;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            if (pipe_fd >= 0 && events[i].data.fd == pipe_fd) {
+                // parent exits
+                ret = 0;
+                goto end;
+            }
+
+            if (listen_fd >= 0 && events[i].data.fd == listen_fd) {
+                if (daemon_accept(&clients, epoll_fd, listen_fd) < 0) {
+                    goto end;
+                }
+                continue;
+            }
+
+            if (events[i].data.fd != tw.fd &&
+                events[i].data.fd != timer_fd &&
+                events[i].data.fd != settle_fd) {
+                // a client asks for patching or went away
+                daemon_request(&clients, epoll_fd, events[i].data.fd);
+                continue;
+            }
+
+            if (events[i].events & EPOLLHUP || events[i].events & EPOLLERR) {
+                E("epoll()");
+                goto end;
+            }
+
+            if (events[i].data.fd == timer_fd) {
+                uint64_t expirations;
+                struct stamp st;
+
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+                    continue;
+                }
+
+                if (rescan) {
+                    // the extensions directory itself may have been replaced
+                    if (stat(extdir_path, &(struct stat){0}) < 0) {
+                        mkdir(extdir_path, S_IRWXU | S_IRWXG | S_IRWXO);
+                    }
+                    if (treewatch_rescan(&tw) < 0) {
+                        E("treewatch_rescan(): %s", extdir_path);
+                        goto end;
+                    }
+                    n_skipped = 0;
+                    rescan = 0;
+                }
+
+                memset(&db, 0, sizeof(db));
+                stamp_init(&st);
+                if (patch_extensions(extjson_path) == 0) {
+                    stamp_save(&st);
+                } else {
+                    stamp_clear();
+                    clients.verified = 0;
+                }
+                continue;
+            }
+
+            if (events[i].data.fd == settle_fd) {
+                uint64_t expirations;
+
+                if (read(settle_fd, &expirations, sizeof(expirations)) < 0) {
+                    continue;
+                }
+                watch_patch(&wp);
+                continue;
+            }
+
+            if (events[i].data.fd == tw.fd) {
+                if (treewatch_read(&tw, watch_event, &wp) < 0) {
+                    E("read(): %s", extdir_path);
+                    goto end;
+                }
+
+                if (wp.lost && !wp.rewatch && !rescan) {
+                    // anything may have changed: patch every extension
+                    W("%s: events were lost, patching again", extdir_path);
+                    if (unlink(extstate_path) < 0 && errno != ENOENT) {
+                        E("unlink(): %s", extstate_path);
+                    }
+                }
+
+                if (wp.lost || wp.rewatch) {
+                    // once the burst is over, with the pass
+                    watch_pending_clear(&wp);
+                    rescan = 1;
+                    wp.changed = 1;
+                }
+
+                if (wp.changed && debounce_arm(&db, timer_fd) < 0) {
+                    goto end;
+                }
+
+                if (wp.n && watch_settle_arm(&wp, settle_fd) < 0) {
+                    goto end;
+                }
+
+                wp.changed = wp.lost = wp.rewatch = 0;
+            }
+        }
+    }
+
+end:
+    treewatch_free(&tw);
+    watch_pending_clear(&wp);
+    free(wp.items);
+    free(wp.own);
+
+    if (timer_fd >= 0) {
+        close(timer_fd);
+    }
+
+    if (settle_fd >= 0) {
+        close(settle_fd);
+    }
+
+    if (pipe_fd >= 0) {
+        close(pipe_fd);
+    }
+
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+
+    if (listen_fd >= 0) {
+        close(listen_fd);
+    }
+
+    for (size_t i = 0; i < clients.n; i++) {
+        close(clients.fds[i]);
+    }
+    free(clients.fds);
+    free(clients.peers);
+
     return ret;
 }
 
 
-static int patch_dir(const char *dirpath)
+static socklen_t daemon_addr(struct sockaddr_un *addr)
 {
-    int ret = -1;
+    uint64_t h;
+    int siz;
 
-    if (check_patched(dirpath) == 0) {
-        ret = 0;
-        goto end;
-    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
 
-    if (nftw(dirpath, patch_file_ftw, 20, FTW_PHYS) < 0) {
-        E("nftw(): %s", dirpath);
-        goto end;
+    // abstract name: one daemon per user, installation and configuration,
+    // as a daemon patches every launch that connects the way it was started
+    h = fnv1a64(0xcbf29ce484222325ULL, gnudir_path, strlen(gnudir_path) + 1);
+    h = launch_config_hash(h);
+    siz = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                   "vscode-patchd-%u-%016llx", (unsigned) getuid(),
+                   (unsigned long long) h);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + siz;
+}
+
+
+static int daemon_connect(void)
+{
+    struct sockaddr_un addr;
+    socklen_t len = daemon_addr(&addr);
+    int fd;
+
+    // not inherited: the daemon follows this process, not the connection
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        E("socket()");
+        return -1;
     }
 
-    if (set_patched(dirpath) < 0) {
-        goto end;
+    if (connect(fd, (struct sockaddr *) &addr, len) < 0) {
+        close(fd);
+        return -1;
     }
 
-    ret = 0;
+    if (!daemon_peer_ok(fd, NULL)) {
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
 
-end:
-    return ret;
+    return fd;
 }
 
 
-static int patch_cli(char *cli_path)
+/*
+ * Bind the daemon socket and fork the daemon, detached from the session
+ * and from our stdio. Returns 0 if a daemon is (being) started, also by
+ * someone else, and -1 on error.
+ */
+static int daemon_spawn(void)
 {
-    struct stat sb;
-    int ret = -1;
+    struct sockaddr_un addr;
+    socklen_t len = daemon_addr(&addr);
+    int listen_fd, devnull;
+    pid_t child;
 
-    if (check_patched(cli_path) == 0) {
-        ret = 0;
-        goto end;
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+                                         SOCK_CLOEXEC, 0)) < 0) {
+        E("socket()");
+        return -1;
     }
 
-    if (stat(cli_path, &sb) < 0) {
-        E("stat(): %s", cli_path);
-        goto end;
+    if (bind(listen_fd, (struct sockaddr *) &addr, len) < 0) {
+        close(listen_fd);
+        if (errno == EADDRINUSE) {
+            // another launch won the race
+            return 0;
+        }
+        E("bind()");
+        return -1;
     }
 
-    if (patch_file(cli_path, &sb) < 0) {
-        goto end;
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        E("listen()");
+        close(listen_fd);
+        return -1;
     }
 
-    if (set_patched(cli_path) < 0) {
-        goto end;
+    child = fork();
+    if (child < 0) {
+        E("fork()");
+        close(listen_fd);
+        return -1;
+    } else if (child == 0) {
+        // double fork, so that the CLI we exec to has no child to reap
+        if ((child = fork()) != 0) {
+            _exit(child < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+
+        trace_disable();
+        setsid();
+        if (chdir("/") < 0) {
+            E("chdir(): /");
+        }
+        if ((devnull = open("/dev/null", O_RDWR)) >= 0) {
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            if (devnull > STDERR_FILENO) {
+                close(devnull);
+            }
+        }
+
+        if (setup_logfp()) {
+            _exit(EXIT_FAILURE);
+        }
+
+        I("daemon: started");
+        exit(monitor_loop(-1, listen_fd) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
     }
 
-    ret = 0;
+    close(listen_fd);
+    waitpid(child, NULL, 0);
+    return 0;
+}
 
-end:
-    return ret;
+
+/*
+ * Connect to the per-user daemon, starting it if needed. With `wait`, ask
+ * it to patch and wait for the result. Returns the connection, closed as
+ * the CLI is exec'd, or -1 to patch in this process instead.
+ */
+static int daemon_attach(int wait)
+{
+    struct timespec ts = {0, DAEMON_CONNECT_NSEC};
+    char req = DAEMON_REQ_PATCH, rep;
+    int fd = -1, i;
+    int64_t tr = trace_begin();
+
+    for (i = 0; i < DAEMON_CONNECT_TRIES; i++) {
+        if ((fd = daemon_connect()) < 0) {
+            if (errno != ECONNREFUSED) {
+                W("daemon: cannot connect: %s", strerror(errno));
+                break;
+            }
+            if (daemon_spawn() < 0) {
+                break;
+            }
+            if ((fd = daemon_connect()) < 0) {
+                nanosleep(&ts, NULL);
+                continue;
+            }
+        }
+
+        if (send(fd, &req, 1, MSG_NOSIGNAL) != 1) {
+            // the daemon exited meanwhile
+            close(fd);
+            fd = -1;
+            continue;
+        }
+
+        if (!wait) {
+            break;
+        }
+
+        if (recv(fd, &rep, 1, 0) != 1) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+
+        if (rep != DAEMON_REP_OK) {
+            W("daemon: patching failed, see the log");
+            close(fd);
+            fd = -1;
+        }
+        break;
+    }
+
+    trace_end("daemon_attach", tr, NULL);
+    return fd;
 }
 
 
-static int patch_extensions(char *extjson_path)
+static void install_record(struct install_state *st, const char *dst,
+                           int klass)
 {
-    int ret = -1, fd = -1, n_ext, i;
     struct stat sb;
-    char *json_buff = NULL;
-    struct fjson_object *parsed_json = NULL;
 
-    if (stat(extdir_path, &sb) < 0 &&
-            mkdir(extdir_path, S_IRWXU | S_IRWXG | S_IRWXO) < 0) {
-        E("mkdir(): %s", extdir_path);
-        goto end;
+    if (!journal_relpath(&st->srv_journal, dst)) {
+        return;
     }
 
-    if ((fd = open(extjson_path, O_CREAT | O_RDONLY,
-                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-        E("open(): %s", extjson_path);
-        goto end;
+    if (lstat(dst, &sb) < 0) {
+        E("lstat(): %s", dst);
+        return;
     }
 
-    if (fstat(fd, &sb) == -1) {
-        E("fstat(): %s", extjson_path);
-        goto end;
+    if (array_reserve(&st->entries, &st->cap_entries, st->n_entries,
+                      sizeof(*st->entries)) == 0) {
+        manifest_entry_set(&st->entries[st->n_entries++], &sb, klass);
     }
+}
 
-    if (!sb.st_size) {
-        // skip empty file
-        ret = 0;
-        goto end;
+
+/*
+ * Write an ELF member, which is in memory, to fd: patched the way
+ * patch_file() would patch it on disk, or as it is. Failing to patch it
+ * is not fatal; its class is then PATCH_FAILED, as it is for what is left
+ * to the store.
+ */
+static int install_elf(struct install *in, const struct tar_member *m,
+                       const char *dst, int fd, const char *tmppath,
+                       const unsigned char *data, void *arg)
+{
+    struct install_state *st = arg;
+    struct journal *jr = journal_relpath(&st->srv_journal, dst)
+                             ? &st->srv_journal : &st->cli_journal;
+    int *klass = &st->klass;
+    struct patchelf_probe probe;
+    struct patchelf_versions req;
+    struct patchelf_edit edits[PATCHELF_MAX_EDITS];
+    struct stat sb, tsb;
+    char interpreter[PATH_MAX];
+    size_t n_edits, i;
+
+    *klass = PATCH_FAILED;
+
+    // the original, as the journal sees it
+    memset(&sb, 0, sizeof(sb));
+    sb.st_mode = S_IFREG | m->mode;
+    sb.st_size = m->size;
+
+    switch (patchelf_probe_mem(data, m->size, &probe)) {
+    case 0:
+        break;
+    case 1:
+        *klass = PATCH_NOT_ELF;
+        goto unchanged;
+    default:
+        E("patchelf_probe(): %s", dst);
+        st->n_errors++;
+        goto unchanged;
     }
 
-    if ((json_buff = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
-            == MAP_FAILED) {
-        E("mmap(): %s", extjson_path);
-        goto end;
+    if (!probe.has_interp) {
+        *klass = PATCH_NO_INTERP;
+        goto unchanged;
     }
 
-    if (!(parsed_json = fjson_tokener_parse(json_buff))) {
-        E("fjson_tokener_parse(): invalid JSON");
-        goto end;
+    if (opt_store) {
+        // the store copy is named after the bundled glibc, which is still
+        // being extracted: left, unrecorded, to install_now()
+        *klass = PATCH_FAILED;
+        goto unchanged;
     }
 
-    n_ext = fjson_object_array_length(parsed_json);
+    if (probe.runpath_tag == DT_RUNPATH &&
+        !strcmp(probe.interpreter, glibc_interp_new) &&
+        !strcmp(probe.runpath, gnudir_path)) {
+        *klass = PATCH_DONE;
+        goto unchanged;
+    }
 
-    for (i = 0; i < n_ext; i++) {
-        const char *dirpath;
-        struct fjson_object *extension, *location, *path;
+    if (!opt_patch_all) {
+        if (patchelf_required_versions_mem(data, m->size, &probe, &req) < 0) {
+            W("malformed version table: %s", dst);
+        } else if (!needs_bundled_versions(dst, &req)) {
+            *klass = PATCH_COMPATIBLE;
+            goto unchanged;
+        }
+    }
 
-        if (!(extension = fjson_object_array_get_idx(parsed_json, i))) {
-            continue;
+    if (opt_inplace &&
+        patchelf_plan_inplace(&probe, glibc_interp_new, gnudir_path, edits,
+                              &n_edits) == 0) {
+        // edited after writing, as patch_inplace() does on disk
+        if (write(fd, data, m->size) != (ssize_t) m->size) {
+            E("write(): %s", tmppath);
+            return -1;
         }
 
-        if (!fjson_object_object_get_ex(extension, "location", &location)) {
-            continue;
+        if (fstat(fd, &tsb) < 0) {
+            E("fstat(): %s", tmppath);
+            return -1;
         }
 
-        if (!fjson_object_object_get_ex(location, "path", &path)) {
-            continue;
+        sb.st_ino = tsb.st_ino;
+        if (journal_inplace(jr, dst, fd, &sb, edits, n_edits) < 0) {
+            return -1;
         }
 
-        if (!(dirpath = fjson_object_get_string(path))) {
-            continue;
+        for (i = 0; i < n_edits; i++) {
+            if (pwrite(fd, edits[i].data, edits[i].size, edits[i].offset) !=
+                    (ssize_t) edits[i].size) {
+                E("pwrite(): %s", tmppath);
+                return -1;
+            }
         }
-        patch_dir(dirpath);
-    }
 
-    ret = 0;
+        if (install_attrs(in, m, fd, tmppath, &tsb) < 0) {
+            return -1;
+        }
 
-end:
-    if (parsed_json) {
-        fjson_object_put(parsed_json);
-    }
+        I("Patched %s in place (interpreter: %s)", dst, probe.interpreter);
+    } else {
+        switch (patchelf_set_interpreter_rpath_mem(data, m->size, fd,
+                                                   glibc_interp_new,
+                                                   gnudir_path, interpreter,
+                                                   PATH_MAX, 1)) {
+        case 0:
+            break;
+        case 1:
+            *klass = PATCH_NO_INTERP;
+            goto unchanged;
+        default:
+            // installed unpatched, patch_all() tries again
+            st->n_errors++;
+            if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+                E("ftruncate(): %s", tmppath);
+                return -1;
+            }
+            goto unchanged;
+        }
 
-    if (json_buff) {
-        munmap(json_buff, sb.st_size);
+        if (install_attrs(in, m, fd, tmppath, &tsb) < 0 ||
+            journal_rewrite_mem(jr, dst, data, &sb, fd, &tsb) < 0) {
+            return -1;
+        }
+
+        I("Patched %s (interpreter: %s, %lld of %lld bytes written)", dst,
+          interpreter, (long long) tsb.st_size, (long long) m->size);
     }
 
-    if (fd >= 0) {
-        close(fd);
+    st->n_patched++;
+    *klass = PATCH_DONE;
+    return 0;
+
+unchanged:
+    if (write(fd, data, m->size) != (ssize_t) m->size) {
+        E("write(): %s", tmppath);
+        return -1;
     }
 
-    return ret;
+    return install_attrs(in, m, fd, tmppath, &tsb);
 }
 
 
-static int create_skip_check_file(void)
+// what patch_all() would look at: the server directory and the CLI
+static int install_patched(const char *dst, void *arg)
 {
-    static const char *path = "/tmp/vscode-skip-server-requirements-check";
-    int ret = -1, fd = -1;
+    struct install_state *st = arg;
 
-    if ((fd = open(path, O_CREAT | O_RDONLY,
-                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-        E("open(): %s", path);
-        goto end;
-    }
+    st->klass = PATCH_NOT_ELF;
+    return journal_relpath(&st->srv_journal, dst) != NULL ||
+           !strcmp(dst, realcli_path);
+}
 
-    ret = 0;
 
-end:
-    if (fd >= 0) {
-        close(fd);
-    }
+static int install_tmppath(const char *dst, char *tmppath, void *arg)
+{
+    char bakpath[PATH_MAX], undopath[PATH_MAX];
 
-    return ret;
+    (void) arg;
+    return patch_paths(dst, tmppath, bakpath, undopath);
 }
 
 
-static int monitor_loop(int pipe_fd)
+static void install_installed(const char *dst, int type, void *arg)
 {
-    struct epoll_event epoll_ev = {0};
-    int ret = -1, epoll_fd = -1, inotify_fd = -1, inotify_wd = -1;
-
-    if ((epoll_fd = epoll_create1(0)) < 0) {
-        E("epoll_create1()");
-        goto end;
+    struct install_state *st = arg;
+    char tmppath[PATH_MAX], bakpath[PATH_MAX], undopath[PATH_MAX];
+    int cli;
+
+    if (type == '1') {
+        // not recorded: it shares the inode, and so the entry, of its
+        // target
+        return;
+    } else if (type == '2') {
+        // symlinks are never patched
+        install_record(st, dst, PATCH_NOT_ELF);
+        return;
     }
 
-    if ((inotify_fd = inotify_init()) < 0) {
-        E("inotify_init()");
-        goto end;
+    cli = !strcmp(dst, realcli_path);
+    if (!cli && !journal_relpath(&st->srv_journal, dst)) {
+        return;
     }
 
-    if ((inotify_wd = inotify_add_watch(inotify_fd, extjson_path,
-                                        IN_CLOSE_WRITE)) < 0) {
-        E("inotify_add_watch()");
-        goto end;
+    // left over from patching the file this one replaces
+    if (patch_paths(dst, tmppath, bakpath, undopath) == 0) {
+        unlink(bakpath);
+        unlink(undopath);
+        errno = 0;
     }
 
-    epoll_ev.events = EPOLLIN | EPOLLHUP | EPOLLERR;
-    epoll_ev.data.fd = inotify_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &epoll_ev) == -1) {
-        E("epoll_ctl()");
-        goto end;
+    if (cli) {
+        st->has_cli = 1;
+        st->cli_klass = st->klass;
+    } else if (st->klass != PATCH_FAILED) {
+        install_record(st, dst, st->klass);
     }
+}
 
-    epoll_ev.events = EPOLLHUP | EPOLLERR;
-    epoll_ev.data.fd = pipe_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipe_fd, &epoll_ev) == -1) {
-        E("epoll_ctl()");
-        goto end;
-    }
 
-    for (;;) {
-        struct epoll_event events[2];
-        char buf[INOBUFLEN];
-        int i, nfds;
+static const struct install_ops install_hooks = {
+    .patched = install_patched,
+    .tmppath = install_tmppath,
+    .elf = install_elf,
+    .installed = install_installed,
+};
 
-        if ((nfds = epoll_wait(epoll_fd, events, 2, -1)) < 0) {
-            E("epoll_wait()");
-            goto end;
-        }
 
-        for (i = 0; i < nfds; i++) {
-            if (events[i].data.fd == pipe_fd && events[0].events & EPOLLHUP) {
-                // parent exits
-                ret = 0;
-                goto end;
-            }
+/*
+ * Install a release tarball: the ELF files below the server directory
+ * and the CLI are patched as they are extracted. The journals, the
+ * manifest of the server directory and the .patched file of the CLI are
+ * written at the end, as if patch_all() had run.
+ */
+static int install_release(const char *tarball)
+{
+    struct install in;
+    struct install_state st;
+    char root[PATH_MAX], fname[PATH_MAX];
+    int ret = -1;
+    int64_t tr_install = trace_begin(), tr;
 
-            if (events[0].events & EPOLLHUP || events[0].events & EPOLLERR) {
-                E("epoll()");
-                goto end;
-            }
+    memset(&st, 0, sizeof(st));
+    st.cli_klass = PATCH_FAILED;
+    journal_init(&st.srv_journal, serverdir_path);
+    journal_init(&st.cli_journal, realcli_path);
 
-            if (events[i].data.fd == inotify_fd &&
-                events[0].events & EPOLLIN) {
-                read(inotify_fd, buf, INOBUFLEN);
-                sleep(5);
-                patch_extensions(extjson_path);
-            }
-        }
+    if (split_path(gnudir_path, root, fname) < 0) {
+        E("split_path()");
+        goto end;
     }
 
-end:
-    if (inotify_wd >= 0 && inotify_fd >= 0) {
-        inotify_rm_watch(inotify_fd, inotify_wd);
+    if (install_tarball(&in, tarball, root, &install_hooks, &st) < 0) {
+        goto end;
     }
 
-    if (inotify_fd >= 0) {
-        close(inotify_fd);
+    if (!st.has_cli) {
+        errno = ENOENT;
+        E("%s: no %s in the archive", tarball, realcli_path);
+        goto end;
     }
 
-    if (pipe_fd >= 0) {
-        close(pipe_fd);
+    if (st.n_errors) {
+        W("%s: %zu error(s) while patching", tarball, st.n_errors);
     }
 
-    if (epoll_fd >= 0) {
-        close(epoll_fd);
+    tr = trace_begin();
+    if (journal_close(&st.srv_journal) < 0 ||
+        journal_close(&st.cli_journal) < 0) {
+        goto end;
     }
+    trace_end("journal_close", tr, tarball);
+
+    tr = trace_begin();
+    if (manifest_save(serverdir_path, st.entries, st.n_entries) < 0) {
+        goto end;
+    }
+    trace_end("manifest_save", tr, serverdir_path);
+
+    if (st.cli_klass != PATCH_FAILED && set_patched(realcli_path) < 0) {
+        goto end;
+    }
+
+    I("Installed %zu files (%llu bytes), %zu patched", in.n_files,
+      (unsigned long long) in.n_bytes, st.n_patched);
+    ret = 0;
 
+end:
+    journal_close(&st.srv_journal);
+    journal_close(&st.cli_journal);
+    free(st.entries);
+    trace_end("install", tr_install, tarball);
     return ret;
 }
 
 
-static int patch_now(void)
+/*
+ * Check that the patched CLI starts.
+ */
+static int check_cli(void)
 {
     pid_t child;
     int status, exitcode;
     char *argv[] = {realcli_path, "--version", 0};
 
-    if (patch_cli(realcli_path) < 0) {
-        return EXIT_FAILURE;
-    }
-
-    if (patch_dir(serverdir_path) < 0) {
-        return EXIT_FAILURE;
-    }
-
-    if (patch_extensions(extjson_path) < 0) {
-        return EXIT_FAILURE;
-    }
-
     if (create_skip_check_file() < 0) {
         return EXIT_FAILURE;
     }
@@ -766,14 +6837,12 @@ static int patch_now(void)
         E("fork()");
         return EXIT_FAILURE;
     } else if (child == 0) {
+        trace_disable();
         // 自动注入 LD_LIBRARY_PATH
-        char rpath_dir[PATH_MAX];
-        strncpy(rpath_dir, glibc_interp_new, sizeof(rpath_dir));
-        char *last_slash = strrchr(rpath_dir, '/');
-        if (last_slash) { *last_slash = '\0'; }
-        setenv("LD_LIBRARY_PATH", rpath_dir, 1);
+        setenv("LD_LIBRARY_PATH", gnudir_path, 1);
         execv(realcli_path, argv);
         E("execv(): %s", realcli_path);
+        log_flush();
         _exit(EXIT_FAILURE);
     }
 
@@ -796,69 +6865,170 @@ static int patch_now(void)
         E("Failure: cli waitpid() status %d", status);
     }
 
-    errno = 0;
-    E("Success");
+    I("Success");
     return EXIT_SUCCESS;
 }
 
 
+static int patch_now(void)
+{
+    if (patch_all() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    return check_cli();
+}
+
+
+static int install_now(const char *tarball)
+{
+    struct stamp st;
+
+    stamp_init(&st);
+
+    // extensions are not part of the archive: patched as usual, and with a
+    // store so is the server, against the glibc just installed
+    if (install_release(tarball) < 0 ||
+        (opt_store && (patch_cli(realcli_path) < 0 ||
+                       patch_dir(serverdir_path) < 0)) ||
+        patch_extensions(extjson_path) < 0) {
+        stamp_clear();
+        return EXIT_FAILURE;
+    }
+
+    stamp_save(&st);
+    return check_cli();
+}
+
+
+static int unpatch_now(void)
+{
+    int ret = EXIT_SUCCESS;
+
+    stamp_clear();
+
+    if (unpatch_cli(realcli_path) < 0) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (patch_tree(serverdir_path, 1) < 0) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (unpatch_extensions() < 0) {
+        ret = EXIT_FAILURE;
+    }
+
+    return ret;
+}
+
+
 int main(int argc, char **argv)
 {
-    int i;
+    int i, fast, daemon_fd = -1;
     int pipefd[2];
     pid_t child;
+    int64_t tr_main, tr;
+
+    log_setup();
+    setup_trace(&argc, argv);
+    tr_main = trace_begin();
 
+    tr = trace_begin();
     if (setup_paths()) {
         return EXIT_FAILURE;
     }
+    trace_end("setup_paths", tr, NULL);
+
+    setup_opts();
 
     if (argc == 2 && strcmp(argv[1], "--patch-now") == 0) {
         opt_patch_now = 1;
         return patch_now();
     }
 
-    if (setup_logfp()) {
-        return EXIT_FAILURE;
+    if (argc == 3 && strcmp(argv[1], "--install") == 0) {
+        opt_patch_now = 1;
+        return install_now(argv[2]);
     }
 
-    for (i = 0; i < argc; i++) {
-        errno = 0;
-        E("ARG[%d] = %s", i, argv[i]);
+    if (argc == 2 && strcmp(argv[1], "--unpatch") == 0) {
+        opt_patch_now = 1;
+        return unpatch_now();
     }
 
-    if (patch_cli(realcli_path) < 0) {
-        return EXIT_FAILURE;
+    // nothing changed since the last verified launch: exec right away
+    // and leave verification to the background child
+    fast = opt_fast_start && stamp_check() == 0;
+
+    if (!fast) {
+        tr = trace_begin();
+        if (setup_logfp()) {
+            return EXIT_FAILURE;
+        }
+        trace_end("setup_logfp", tr, NULL);
+
+        for (i = 0; i < argc; i++) {
+            I("ARG[%d] = %s", i, argv[i]);
+        }
     }
 
-    if (patch_dir(serverdir_path) < 0) {
-        return EXIT_FAILURE;
+    // the shared daemon patches and watches on behalf of this launch
+    if (opt_daemon) {
+        daemon_fd = daemon_attach(!fast);
     }
 
-    if (patch_extensions(extjson_path) < 0) {
+    if (daemon_fd < 0 && !fast && patch_all() < 0) {
         return EXIT_FAILURE;
     }
 
+    tr = trace_begin();
     if (create_skip_check_file() < 0) {
         return EXIT_FAILURE;
     }
+    trace_end("create_skip_check_file", tr, NULL);
+
+    if (daemon_fd >= 0) {
+        goto exec;
+    }
 
     if (pipe(pipefd) == -1) {
         E("pipe()");
         return EXIT_FAILURE;
     }
 
+    tr = trace_begin();
     child = fork();
 
     if (child < 0) {
         E("fork()");
         return EXIT_FAILURE;
     } else if (child == 0) {
+        trace_disable();
         close(pipefd[1]);
-        return monitor_loop(pipefd[0]);
+        if (fast) {
+            if (setup_logfp()) {
+                _exit(EXIT_FAILURE);
+            }
+            for (i = 0; i < argc; i++) {
+                I("ARG[%d] = %s", i, argv[i]);
+            }
+            I("Fast start, verifying in the background");
+            patch_all();
+        }
+        return monitor_loop(pipefd[0], -1);
     }
 
+    trace_end("fork", tr, NULL);
     close(pipefd[0]);
+
+exec:
+    trace_end("main", tr_main, NULL);
+    trace_write();
+    log_flush();
+
     execv(realcli_path, argv);
     E("execv(): %s", realcli_path);
+    log_flush();
     _exit(EXIT_FAILURE);
 }
@@ -0,0 +1,75 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "elflist.h"
+
+#define ELFLIST_BUFSIZE (256 * 1024)
+
+
+// zero the part of buf (file bytes [off, off + len)) that is in the range
+static void zero_range(unsigned char *buf, uint64_t off, size_t len,
+                       uint64_t start, uint64_t size)
+{
+    uint64_t lo = start > off ? start : off;
+    uint64_t hi = start + size < off + len ? start + size : off + len;
+
+    if (lo < hi) {
+        memset(buf + (lo - off), 0, hi - lo);
+    }
+}
+
+
+int elflist_digest(int fd, const struct elflist_entry *ent,
+                   unsigned char digest[SHA256_DIGEST_SIZE])
+{
+    struct sha256_ctx ctx;
+    unsigned char *buf;
+    uint64_t off = 0;
+    ssize_t n = 0;
+
+    if (!(buf = malloc(ELFLIST_BUFSIZE))) {
+        return -1;
+    }
+
+    sha256_init(&ctx);
+    while (off < ent->size) {
+        size_t len = ent->size - off < ELFLIST_BUFSIZE ? ent->size - off
+                                                       : ELFLIST_BUFSIZE;
+
+        if ((n = pread(fd, buf, len, off)) <= 0) {
+            break;
+        }
+
+        zero_range(buf, off, n, ent->interp_offset, ent->interp_size);
+        zero_range(buf, off, n, ent->runpath_offset, ent->runpath_size);
+        zero_range(buf, off, n, ent->tag_offset, ent->tag_size);
+        sha256_update(&ctx, buf, n);
+        off += n;
+    }
+    free(buf);
+
+    if (n < 0) {
+        return -1;
+    } else if (off < ent->size) {
+        errno = EIO;
+        return -1;
+    }
+
+    sha256_final(&ctx, digest);
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELFLIST_H
+#define ELFLIST_H
+
+#include <stdint.h>
+#include "sha256.h"
+
+#define ELFLIST_MAGIC "VSCPELF1"
+#define ELFLIST_VERSION 1
+
+/*
+ * List of the executables in a tree, written when the tarball is built
+ * (src/prepatch.c) and shipped next to the tree: a header, entries sorted
+ * by path, then the NUL-terminated paths, relative to the tree.
+ */
+struct elflist_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+    uint64_t strings_size;
+    uint64_t reserved;
+};
+
+/*
+ * One executable as shipped. The interpreter and run path slots and the
+ * d_tag of its DT_RUNPATH entry are what patching may change; the digest
+ * is taken with them zeroed, so it holds before and after patching in
+ * place.
+ */
+struct elflist_entry {
+    uint64_t size;
+    uint64_t interp_offset;
+    uint64_t runpath_offset;
+    uint64_t tag_offset;
+    uint32_t interp_size;
+    uint32_t runpath_size;
+    uint32_t tag_size;
+    uint32_t path_offset;
+    unsigned char sha256[SHA256_DIGEST_SIZE];
+};
+
+/*
+ * SHA-256 of the `ent->size` bytes of fd, with the slots of ent read as
+ * zeros. Returns 0, or -1 with errno set on read errors or if the file is
+ * shorter.
+ */
+int elflist_digest(int fd, const struct elflist_entry *ent,
+                   unsigned char digest[SHA256_DIGEST_SIZE]);
+
+#endif /* ELFLIST_H */
@@ -0,0 +1,494 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "extjson.h"
+
+// keys we look for are short, longer ones are skipped without copying
+#define KEY_MAX 16
+
+struct parser {
+    const char *buf;
+    const char *p;
+    const char *end;
+    int depth;
+};
+
+struct entry_state {
+    char id[EXTJSON_MAX_STRING];
+    char version[EXTJSON_MAX_STRING];
+    char path[EXTJSON_MAX_STRING];
+    int has_path;
+};
+
+typedef int (*member_fn)(struct parser *ps, const char *key, void *ctx);
+
+
+static void skip_ws(struct parser *ps)
+{
+    while (ps->p < ps->end && (*ps->p == ' ' || *ps->p == '\n' ||
+                               *ps->p == '\r' || *ps->p == '\t')) {
+        ps->p++;
+    }
+}
+
+
+static int peek(struct parser *ps)
+{
+    skip_ws(ps);
+    return ps->p < ps->end ? (unsigned char) *ps->p : -1;
+}
+
+
+static int hex4(struct parser *ps, uint32_t *out)
+{
+    int i;
+
+    if (ps->end - ps->p < 4) {
+        return -1;
+    }
+
+    *out = 0;
+    for (i = 0; i < 4; i++) {
+        char c = *ps->p++;
+        *out <<= 4;
+        if (c >= '0' && c <= '9') {
+            *out |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            *out |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            *out |= c - 'A' + 10;
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Parse the string at ps->p into `out` (NUL-terminated, up to `cap`
+ * bytes), or only skip it if `out` is NULL. Returns 0, 1 if the string
+ * was valid but did not fit (or contained \u0000), or -1 if invalid.
+ */
+static int parse_string(struct parser *ps, char *out, size_t cap)
+{
+    size_t n = 0;
+    int fits = out != NULL;
+
+    if (ps->p >= ps->end || *ps->p != '"') {
+        return -1;
+    }
+    ps->p++;
+
+    while (ps->p < ps->end) {
+        unsigned char c = *ps->p;
+        unsigned char utf8[4];
+        size_t len = 1;
+        uint32_t cp;
+
+        if (c == '"') {
+            ps->p++;
+            if (fits) {
+                out[n] = '\0';
+            }
+            return fits || !out ? 0 : 1;
+        } else if (c < 0x20) {
+            return -1;
+        } else if (c != '\\') {
+            ps->p++;
+            utf8[0] = c;
+        } else {
+            if (++ps->p >= ps->end) {
+                return -1;
+            }
+            switch (*ps->p++) {
+            case '"':  utf8[0] = '"'; break;
+            case '\\': utf8[0] = '\\'; break;
+            case '/':  utf8[0] = '/'; break;
+            case 'b':  utf8[0] = '\b'; break;
+            case 'f':  utf8[0] = '\f'; break;
+            case 'n':  utf8[0] = '\n'; break;
+            case 'r':  utf8[0] = '\r'; break;
+            case 't':  utf8[0] = '\t'; break;
+            case 'u':
+                if (hex4(ps, &cp) < 0) {
+                    return -1;
+                }
+                if (cp >= 0xd800 && cp < 0xdc00 && ps->end - ps->p >= 6 &&
+                        ps->p[0] == '\\' && ps->p[1] == 'u') {
+                    // surrogate pair
+                    const char *save = ps->p;
+                    uint32_t lo;
+
+                    ps->p += 2;
+                    if (hex4(ps, &lo) < 0) {
+                        return -1;
+                    }
+                    if (lo >= 0xdc00 && lo < 0xe000) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    } else {
+                        ps->p = save;
+                    }
+                }
+                if (cp == 0) {
+                    // would cut the C string short
+                    fits = 0;
+                } else if (cp < 0x80) {
+                    utf8[0] = cp;
+                } else if (cp < 0x800) {
+                    utf8[0] = 0xc0 | (cp >> 6);
+                    utf8[1] = 0x80 | (cp & 0x3f);
+                    len = 2;
+                } else if (cp < 0x10000) {
+                    utf8[0] = 0xe0 | (cp >> 12);
+                    utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+                    utf8[2] = 0x80 | (cp & 0x3f);
+                    len = 3;
+                } else {
+                    utf8[0] = 0xf0 | (cp >> 18);
+                    utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+                    utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+                    utf8[3] = 0x80 | (cp & 0x3f);
+                    len = 4;
+                }
+                break;
+            default:
+                return -1;
+            }
+        }
+
+        if (fits) {
+            if (n + len >= cap) {
+                fits = 0;
+            } else {
+                memcpy(out + n, utf8, len);
+                n += len;
+            }
+        }
+    }
+
+    return -1;
+}
+
+
+static int parse_number(struct parser *ps)
+{
+    const char *start;
+
+    if (ps->p < ps->end && *ps->p == '-') {
+        ps->p++;
+    }
+
+    start = ps->p;
+    while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+        ps->p++;
+    }
+    if (ps->p == start) {
+        return -1;
+    }
+
+    if (ps->p < ps->end && *ps->p == '.') {
+        start = ++ps->p;
+        while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+            ps->p++;
+        }
+        if (ps->p == start) {
+            return -1;
+        }
+    }
+
+    if (ps->p < ps->end && (*ps->p == 'e' || *ps->p == 'E')) {
+        ps->p++;
+        if (ps->p < ps->end && (*ps->p == '+' || *ps->p == '-')) {
+            ps->p++;
+        }
+        start = ps->p;
+        while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+            ps->p++;
+        }
+        if (ps->p == start) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int parse_literal(struct parser *ps, const char *word)
+{
+    size_t len = strlen(word);
+
+    if ((size_t) (ps->end - ps->p) < len || memcmp(ps->p, word, len)) {
+        return -1;
+    }
+    ps->p += len;
+
+    return 0;
+}
+
+
+static int skip_value(struct parser *ps);
+
+
+static int skip_member(struct parser *ps, const char *key, void *ctx)
+{
+    (void) key;
+    (void) ctx;
+
+    return skip_value(ps);
+}
+
+
+/*
+ * Parse the object at ps->p, calling `fn` for every member with ps->p at
+ * its value. `fn` has to consume the value.
+ */
+static int parse_object(struct parser *ps, member_fn fn, void *ctx)
+{
+    char key[KEY_MAX];
+    int ret;
+
+    if (peek(ps) != '{' || ++ps->depth > EXTJSON_MAX_DEPTH) {
+        return -1;
+    }
+    ps->p++;
+
+    if (peek(ps) == '}') {
+        ps->p++;
+        ps->depth--;
+        return 0;
+    }
+
+    for (;;) {
+        if (peek(ps) != '"' || (ret = parse_string(ps, key, sizeof(key))) < 0) {
+            return -1;
+        } else if (ret > 0) {
+            // cannot be one of ours
+            key[0] = '\0';
+        }
+
+        if (peek(ps) != ':') {
+            return -1;
+        }
+        ps->p++;
+        skip_ws(ps);
+
+        if (fn(ps, key, ctx) < 0) {
+            return -1;
+        }
+
+        switch (peek(ps)) {
+        case ',':
+            ps->p++;
+            continue;
+        case '}':
+            ps->p++;
+            ps->depth--;
+            return 0;
+        default:
+            return -1;
+        }
+    }
+}
+
+
+static int skip_array(struct parser *ps)
+{
+    if (peek(ps) != '[' || ++ps->depth > EXTJSON_MAX_DEPTH) {
+        return -1;
+    }
+    ps->p++;
+
+    if (peek(ps) == ']') {
+        ps->p++;
+        ps->depth--;
+        return 0;
+    }
+
+    for (;;) {
+        if (skip_value(ps) < 0) {
+            return -1;
+        }
+
+        switch (peek(ps)) {
+        case ',':
+            ps->p++;
+            continue;
+        case ']':
+            ps->p++;
+            ps->depth--;
+            return 0;
+        default:
+            return -1;
+        }
+    }
+}
+
+
+static int skip_value(struct parser *ps)
+{
+    switch (peek(ps)) {
+    case '"':
+        return parse_string(ps, NULL, 0);
+    case '{':
+        return parse_object(ps, skip_member, NULL);
+    case '[':
+        return skip_array(ps);
+    case 't':
+        return parse_literal(ps, "true");
+    case 'f':
+        return parse_literal(ps, "false");
+    case 'n':
+        return parse_literal(ps, "null");
+    default:
+        return parse_number(ps);
+    }
+}
+
+
+/*
+ * Store a string value in `out`, or "" if it is not a string or too long.
+ */
+static int string_member(struct parser *ps, char *out)
+{
+    int ret;
+
+    out[0] = '\0';
+    if (peek(ps) != '"') {
+        return skip_value(ps);
+    }
+
+    if ((ret = parse_string(ps, out, EXTJSON_MAX_STRING)) > 0) {
+        out[0] = '\0';
+        ret = 0;
+    }
+
+    return ret;
+}
+
+
+static int identifier_member(struct parser *ps, const char *key, void *ctx)
+{
+    struct entry_state *st = ctx;
+
+    if (!strcmp(key, "id")) {
+        return string_member(ps, st->id);
+    }
+
+    return skip_value(ps);
+}
+
+
+static int location_member(struct parser *ps, const char *key, void *ctx)
+{
+    struct entry_state *st = ctx;
+    int ret;
+
+    if (!strcmp(key, "path")) {
+        st->has_path = 0;
+        if (peek(ps) != '"') {
+            return skip_value(ps);
+        }
+        if ((ret = parse_string(ps, st->path, sizeof(st->path))) == 0) {
+            st->has_path = 1;
+        }
+        return ret < 0 ? -1 : 0;
+    }
+
+    return skip_value(ps);
+}
+
+
+static int extension_member(struct parser *ps, const char *key, void *ctx)
+{
+    struct entry_state *st = ctx;
+
+    // like a DOM lookup, the last of duplicate keys wins
+    if (!strcmp(key, "identifier")) {
+        st->id[0] = '\0';
+        if (peek(ps) == '{') {
+            return parse_object(ps, identifier_member, st);
+        }
+    } else if (!strcmp(key, "version")) {
+        return string_member(ps, st->version);
+    } else if (!strcmp(key, "location")) {
+        st->has_path = 0;
+        if (peek(ps) == '{') {
+            return parse_object(ps, location_member, st);
+        }
+    }
+
+    return skip_value(ps);
+}
+
+
+int extjson_parse(const char *buf, size_t len, extjson_cb cb, void *arg,
+                  size_t *err_off)
+{
+    struct parser ps = { buf, buf, buf + len, 1 };
+    struct entry_state st;
+    struct extjson_entry entry = { st.id, st.version, st.path };
+    int ret;
+
+    if (peek(&ps) != '[') {
+        goto invalid;
+    }
+    ps.p++;
+
+    if (peek(&ps) == ']') {
+        return 0;
+    }
+
+    for (;;) {
+        if (peek(&ps) != '{') {
+            if (skip_value(&ps) < 0) {
+                goto invalid;
+            }
+        } else {
+            st.id[0] = st.version[0] = st.path[0] = '\0';
+            st.has_path = 0;
+
+            if (parse_object(&ps, extension_member, &st) < 0) {
+                goto invalid;
+            }
+
+            if (st.has_path && (ret = cb(&entry, arg)) < 0) {
+                return ret;
+            }
+        }
+
+        switch (peek(&ps)) {
+        case ',':
+            ps.p++;
+            continue;
+        case ']':
+            // anything after the array is ignored, as before
+            return 0;
+        default:
+            goto invalid;
+        }
+    }
+
+invalid:
+    if (err_off) {
+        *err_off = ps.p - ps.buf;
+    }
+    errno = EINVAL;
+    return -1;
+}
@@ -0,0 +1,54 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef EXTJSON_H
+#define EXTJSON_H
+
+#include <limits.h>
+#include <stddef.h>
+
+// longer strings are not extracted, see extjson_parse()
+#define EXTJSON_MAX_STRING PATH_MAX
+#define EXTJSON_MAX_DEPTH 64
+
+/*
+ * One element of extensions.json, as far as the wrapper cares. Missing
+ * or non-string id and version are "".
+ */
+struct extjson_entry {
+    const char *id;         // identifier.id
+    const char *version;    // version
+    const char *path;       // location.path
+};
+
+/*
+ * Called for every entry with a location.path. A negative return value
+ * stops the parser, which then returns it.
+ */
+typedef int (*extjson_cb)(const struct extjson_entry *entry, void *arg);
+
+/*
+ * Walk the top-level array of extensions.json in `buf` (`len` bytes, not
+ * NUL-terminated) once, without building a DOM. Memory use is bounded by
+ * EXTJSON_MAX_STRING and EXTJSON_MAX_DEPTH, whatever the file size; an
+ * entry whose path would not fit is skipped, a longer id or version is
+ * reported as "".
+ *
+ * Returns 0, the callback's negative value, or -1 with errno EINVAL and
+ * `*err_off` set to the offending byte if the JSON is invalid.
+ */
+int extjson_parse(const char *buf, size_t len, extjson_cb cb, void *arg,
+                  size_t *err_off);
+
+#endif /* EXTJSON_H */
@@ -0,0 +1,989 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "install.h"
+#include "log.h"
+
+#define TAR_BLOCK 512
+#define INSTALL_BUFSIZE (1024 * 1024)
+
+
+/*
+ * Ensure n bytes (at most INSTALL_BUFSIZE) are buffered. Returns 0, 1 at
+ * the end of the stream and -1 on error.
+ */
+static int tar_fill(struct install *in, size_t n)
+{
+    struct tar_reader *tr = &in->tr;
+    ssize_t r;
+
+    if (tr->len - tr->pos >= n) {
+        return 0;
+    }
+
+    memmove(tr->buf, tr->buf + tr->pos, tr->len - tr->pos);
+    tr->len -= tr->pos;
+    tr->pos = 0;
+
+    while (tr->len < n) {
+        if ((r = read(tr->fd, tr->buf + tr->len, INSTALL_BUFSIZE - tr->len))
+                < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            E("read(): %s", in->tarball);
+            return -1;
+        } else if (r == 0) {
+            return 1;
+        }
+        tr->len += r;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Consume n bytes of the archive: write them to fd if it is not -1 and
+ * copy them to dst if it is not NULL.
+ */
+static int tar_copy(struct install *in, uint64_t n, int fd,
+                    unsigned char *dst, const char *path)
+{
+    struct tar_reader *tr = &in->tr;
+    size_t chunk;
+    ssize_t r;
+
+    while (n > 0) {
+        if (tr->pos == tr->len) {
+            if (dst && fd < 0 && n >= INSTALL_BUFSIZE) {
+                // large members are read straight into their buffer
+                chunk = n > (1 << 30) ? (1 << 30) : n;
+                if ((r = read(tr->fd, dst, chunk)) < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    E("read(): %s", in->tarball);
+                    return -1;
+                } else if (r == 0) {
+                    goto truncated;
+                }
+                dst += r;
+                n -= r;
+                continue;
+            }
+
+            switch (tar_fill(in, 1)) {
+            case 0:
+                break;
+            case 1:
+                goto truncated;
+            default:
+                return -1;
+            }
+        }
+
+        chunk = tr->len - tr->pos < n ? tr->len - tr->pos : n;
+
+        if (fd >= 0 && write(fd, tr->buf + tr->pos, chunk) != (ssize_t) chunk) {
+            E("write(): %s", path);
+            return -1;
+        }
+
+        if (dst) {
+            memcpy(dst, tr->buf + tr->pos, chunk);
+            dst += chunk;
+        }
+
+        tr->pos += chunk;
+        n -= chunk;
+    }
+
+    return 0;
+
+truncated:
+    errno = EINVAL;
+    E("%s: truncated archive", in->tarball);
+    return -1;
+}
+
+
+// octal, or base-256 for values that do not fit
+static int tar_number(const unsigned char *p, size_t n, uint64_t *out)
+{
+    size_t i = 0;
+
+    *out = 0;
+
+    if (p[0] & 0x80) {
+        if (p[0] & 0x40) {
+            // negative
+            return -1;
+        }
+        *out = p[0] & 0x3f;
+        for (i = 1; i < n; i++) {
+            if (*out >> 56) {
+                return -1;
+            }
+            *out = *out << 8 | p[i];
+        }
+        return 0;
+    }
+
+    while (i < n && p[i] == ' ') {
+        i++;
+    }
+
+    for (; i < n && p[i] >= '0' && p[i] <= '7'; i++) {
+        *out = *out << 3 | (p[i] - '0');
+    }
+
+    return i < n && p[i] != ' ' && p[i] != '\0' ? -1 : 0;
+}
+
+
+static int tar_checksum_ok(const unsigned char *h)
+{
+    uint64_t want, sum = 0;
+    int i;
+
+    if (tar_number(h + 148, 8, &want) < 0) {
+        return 0;
+    }
+
+    for (i = 0; i < TAR_BLOCK; i++) {
+        sum += i >= 148 && i < 156 ? ' ' : h[i];
+    }
+
+    return sum == want;
+}
+
+
+static void tar_string(char *dst, const unsigned char *src, size_t n)
+{
+    size_t len = strnlen((const char *) src, n);
+
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+
+static int tar_pax_string(struct install *in, char *dst, const char *val,
+                          size_t len)
+{
+    if (len >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("%s: %.64s...", in->tarball, val);
+        return -1;
+    }
+
+    memcpy(dst, val, len);
+    dst[len] = '\0';
+    return 0;
+}
+
+
+/*
+ * Apply the records of a pax extended header ("<len> <key>=<value>\n",
+ * NUL-terminated in data) to the next member.
+ */
+static int tar_pax(struct install *in, char *data, size_t len,
+                   struct tar_member *m, unsigned *ext)
+{
+    char *p = data, *end = data + len, *rec, *key, *val;
+    unsigned long n;
+
+    while (p < end) {
+        rec = p;
+        n = strtoul(rec, &key, 10);
+        if (key == rec || *key != ' ' || n == 0 || n > (size_t) (end - rec) ||
+            rec[n - 1] != '\n' || !(val = memchr(key, '=', rec + n - key))) {
+            errno = EINVAL;
+            E("%s: invalid pax header", in->tarball);
+            return -1;
+        }
+
+        key++;
+        *val++ = '\0';
+        rec[n - 1] = '\0';
+
+        if (!strcmp(key, "path")) {
+            if (tar_pax_string(in, m->path, val, rec + n - 1 - val) < 0) {
+                return -1;
+            }
+            *ext |= 1;
+        } else if (!strcmp(key, "linkpath")) {
+            if (tar_pax_string(in, m->linkpath, val, rec + n - 1 - val) < 0) {
+                return -1;
+            }
+            *ext |= 2;
+        } else if (!strcmp(key, "size")) {
+            m->size = strtoull(val, NULL, 10);
+            *ext |= 4;
+        } else if (!strcmp(key, "mtime")) {
+            // fractions of a second are dropped
+            m->mtime = strtoll(val, NULL, 10);
+            *ext |= 8;
+        }
+
+        p = rec + n;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Read the headers of the next member, which the caller then consumes
+ * (m->size bytes and the padding). Returns 0, 1 at the end of the archive
+ * and -1 on error.
+ */
+static int tar_next(struct install *in, struct tar_member *m)
+{
+    const unsigned char *h;
+    char *pax;
+    uint64_t size, mode, mtime, pad;
+    unsigned ext = 0;
+    int i;
+
+    memset(m, 0, sizeof(*m));
+
+    for (;;) {
+        switch (tar_fill(in, TAR_BLOCK)) {
+        case 0:
+            break;
+        case 1:
+            if (in->tr.pos == in->tr.len) {
+                // no end-of-archive blocks, which tar accepts as well
+                return 1;
+            }
+            errno = EINVAL;
+            E("%s: truncated archive", in->tarball);
+            return -1;
+        default:
+            return -1;
+        }
+
+        h = in->tr.buf + in->tr.pos;
+
+        for (i = 0; i < TAR_BLOCK && !h[i]; i++);
+        if (i == TAR_BLOCK) {
+            in->tr.pos += TAR_BLOCK;
+            return 1;
+        }
+
+        if (!tar_checksum_ok(h) || tar_number(h + 100, 8, &mode) < 0 ||
+            tar_number(h + 124, 12, &size) < 0 ||
+            tar_number(h + 136, 12, &mtime) < 0) {
+            errno = EINVAL;
+            E("%s: invalid tar header", in->tarball);
+            return -1;
+        }
+
+        in->tr.pos += TAR_BLOCK;
+        pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+        switch (h[156]) {
+        case 'L':
+        case 'K':
+            // GNU long name or link target
+            if (size >= PATH_MAX) {
+                errno = ENAMETOOLONG;
+                E("%s: long name", in->tarball);
+                return -1;
+            }
+            pax = h[156] == 'L' ? m->path : m->linkpath;
+            if (tar_copy(in, size, -1, (unsigned char *) pax, NULL) < 0 ||
+                tar_copy(in, pad, -1, NULL, NULL) < 0) {
+                return -1;
+            }
+            pax[size] = '\0';
+            // not h[156]: reading the name may have moved the buffer
+            ext |= pax == m->path ? 1 : 2;
+            continue;
+        case 'x':
+            if (!(pax = malloc(size + 1))) {
+                E("malloc()");
+                return -1;
+            }
+            if (tar_copy(in, size, -1, (unsigned char *) pax, NULL) < 0 ||
+                tar_copy(in, pad, -1, NULL, NULL) < 0) {
+                free(pax);
+                return -1;
+            }
+            pax[size] = '\0';
+            i = tar_pax(in, pax, size, m, &ext);
+            free(pax);
+            if (i < 0) {
+                return -1;
+            }
+            continue;
+        case 'g':
+            // global pax header: nothing we use
+            if (tar_copy(in, size + pad, -1, NULL, NULL) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (!(ext & 1)) {
+            if (!memcmp(h + 257, "ustar", 6) && h[345]) {
+                // POSIX ustar: prefix/name
+                tar_string(m->path, h + 345, 155);
+                strcat(m->path, "/");
+                tar_string(m->path + strlen(m->path), h, 100);
+            } else {
+                tar_string(m->path, h, 100);
+            }
+        }
+
+        if (!(ext & 2)) {
+            tar_string(m->linkpath, h + 157, 100);
+        }
+
+        if (!(ext & 4)) {
+            m->size = size;
+        }
+
+        if (!(ext & 8)) {
+            m->mtime = mtime;
+        }
+
+        m->type = h[156];
+        m->mode = mode & 07777;
+        return 0;
+    }
+}
+
+
+/*
+ * Where a member goes: its name without the top directory of the archive
+ * ("vscode-server/"), below the install directory. Returns 1 for the top
+ * directory itself.
+ */
+static int install_path(struct install *in, const char *name, char *dst)
+{
+    const char *rel = name, *c;
+    size_t len;
+    int siz;
+
+    while (rel[0] == '.' && rel[1] == '/') {
+        for (rel += 2; *rel == '/'; rel++);
+    }
+
+    if (*rel == '/') {
+        goto invalid;
+    }
+
+    if (!(rel = strchr(rel, '/'))) {
+        return 1;
+    }
+
+    while (*rel == '/') {
+        rel++;
+    }
+
+    if (!*rel) {
+        return 1;
+    }
+
+    for (c = rel;; c += len + 1) {
+        len = strcspn(c, "/");
+        if (len == 2 && c[0] == '.' && c[1] == '.') {
+            goto invalid;
+        }
+        if (!c[len]) {
+            break;
+        }
+    }
+
+    siz = snprintf(dst, PATH_MAX, "%s/%s", in->root, rel);
+    if (siz < 0) {
+        E("snprintf(): %s", name);
+        return -1;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", name);
+        return -1;
+    }
+
+    while (siz > 1 && dst[siz - 1] == '/') {
+        dst[--siz] = '\0';
+    }
+
+    return 0;
+
+invalid:
+    errno = EINVAL;
+    E("%s: unsafe path: %s", in->tarball, name);
+    return -1;
+}
+
+
+/*
+ * Whether the directories between the install directory and path are no
+ * symlinks, so that path is below the install directory. The archive's
+ * own symlinks are only made at the end, and members come in directory
+ * order: the last directory found safe is remembered.
+ */
+static int install_safe(struct install *in, const char *path)
+{
+    char dir[PATH_MAX], *p;
+    size_t root_len = strlen(in->root), len;
+    struct stat sb;
+
+    if (!(p = strrchr(path, '/')) || (len = p - path) <= root_len ||
+        (len == in->safe_len && !memcmp(path, in->safe_dir, len))) {
+        return 0;
+    }
+
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+
+    for (p = dir + root_len + 1;; *p++ = '/') {
+        if ((p = strchr(p, '/'))) {
+            *p = '\0';
+        }
+
+        if (lstat(dir, &sb) < 0) {
+            if (errno != ENOENT) {
+                E("lstat(): %s", dir);
+                return -1;
+            }
+            // made by install_mkdirs()
+            errno = 0;
+            break;
+        }
+
+        if (S_ISLNK(sb.st_mode)) {
+            errno = ELOOP;
+            E("%s: unsafe path through a symlink: %s", in->tarball, dir);
+            return -1;
+        }
+
+        if (!p) {
+            break;
+        }
+    }
+
+    memcpy(in->safe_dir, path, len);
+    in->safe_len = len;
+    return 0;
+}
+
+
+// the parents of path below the install directory
+static int install_mkdirs(struct install *in, const char *path)
+{
+    char dir[PATH_MAX], *p;
+
+    snprintf(dir, PATH_MAX, "%s", path);
+
+    for (p = dir + strlen(in->root) + 1; (p = strchr(p, '/')); p++) {
+        *p = '\0';
+        if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+            E("mkdir(): %s", dir);
+            return -1;
+        }
+        *p = '/';
+    }
+
+    return 0;
+}
+
+
+int install_attrs(struct install *in, const struct tar_member *m, int fd,
+                  const char *tmppath, struct stat *sb)
+{
+    struct timespec times[2] = { { 0, UTIME_NOW }, { m->mtime, 0 } };
+
+    if (fchmod(fd, m->mode & ~in->umask) < 0) {
+        E("fchmod(): %s", tmppath);
+        return -1;
+    }
+
+    if (futimens(fd, times) < 0) {
+        E("futimens(): %s", tmppath);
+        return -1;
+    }
+
+    if (fstat(fd, sb) < 0) {
+        E("fstat(): %s", tmppath);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int install_file(struct install *in, const struct tar_member *m,
+                        const char *dst)
+{
+    struct stat tsb;
+    char tmppath[PATH_MAX];
+    unsigned char *data = NULL;
+    int ret = -1, fd = -1, patched, elf = 0;
+
+    patched = in->ops->patched(dst, in->arg);
+
+    if (in->ops->tmppath(dst, tmppath, in->arg) < 0) {
+        goto end;
+    }
+
+    if ((fd = open(tmppath, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR)) < 0 &&
+        errno == ENOENT && install_mkdirs(in, dst) == 0) {
+        fd = open(tmppath, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR);
+    }
+
+    if (fd < 0) {
+        E("open(): %s", tmppath);
+        goto end;
+    }
+
+    if (patched && m->size > 4) {
+        switch (tar_fill(in, SELFMAG)) {
+        case 0:
+            elf = !memcmp(in->tr.buf + in->tr.pos, ELFMAG, SELFMAG);
+            break;
+        case 1:
+            // reported by tar_copy()
+            break;
+        default:
+            goto end;
+        }
+    }
+
+    if (elf) {
+        // probed and patched in memory, written once
+        if (!(data = malloc(m->size))) {
+            E("malloc(): %s", dst);
+            goto end;
+        }
+        if (tar_copy(in, m->size, -1, data, dst) < 0 ||
+            in->ops->elf(in, m, dst, fd, tmppath, data, in->arg) < 0) {
+            goto end;
+        }
+    } else if (tar_copy(in, m->size, fd, NULL, tmppath) < 0 ||
+               install_attrs(in, m, fd, tmppath, &tsb) < 0) {
+        goto end;
+    }
+
+    close(fd);
+    fd = -1;
+
+    if (rename(tmppath, dst) < 0) {
+        E("rename(): %s => %s", tmppath, dst);
+        goto end;
+    }
+
+    in->ops->installed(dst, m->type, in->arg);
+    in->n_files++;
+    in->n_bytes += m->size;
+    ret = 0;
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (ret < 0) {
+        unlink(tmppath);
+    }
+
+    free(data);
+    return ret;
+}
+
+
+static int install_link(struct install *in, const struct install_link *l)
+{
+    char target[PATH_MAX], tmppath[PATH_MAX];
+    int ret, tried = 0;
+
+    // links made so far may be parents of this one
+    in->safe_len = 0;
+    if (install_safe(in, l->dst) < 0) {
+        return -1;
+    }
+
+    if (l->type == '1') {
+        if (install_path(in, l->linkpath, target) != 0) {
+            return -1;
+        }
+        in->safe_len = 0;
+        if (install_safe(in, target) < 0) {
+            return -1;
+        }
+    }
+
+    if (in->ops->tmppath(l->dst, tmppath, in->arg) < 0) {
+        return -1;
+    }
+
+    unlink(tmppath);
+
+    for (;;) {
+        ret = l->type == '1' ? link(target, tmppath)
+                             : symlink(l->linkpath, tmppath);
+        if (ret == 0 || errno != ENOENT || tried++) {
+            break;
+        }
+        if (install_mkdirs(in, l->dst) < 0) {
+            return -1;
+        }
+    }
+
+    if (ret < 0) {
+        E("%s(): %s", l->type == '1' ? "link" : "symlink", tmppath);
+        return -1;
+    }
+
+    if (rename(tmppath, l->dst) < 0) {
+        E("rename(): %s => %s", tmppath, l->dst);
+        unlink(tmppath);
+        return -1;
+    }
+
+    in->ops->installed(l->dst, l->type, in->arg);
+    in->n_files++;
+    return 0;
+}
+
+
+/*
+ * Note a link member, to be made by install_links(). Made right away, a
+ * symlink could send the members after it outside of the install
+ * directory; GNU tar delays them as well.
+ */
+static int install_defer_link(struct install *in, const struct tar_member *m,
+                              const char *dst)
+{
+    char target[PATH_MAX];
+    struct install_link *l;
+    size_t cap;
+    int ret;
+
+    if (m->type == '1' && (ret = install_path(in, m->linkpath, target))) {
+        if (ret > 0) {
+            errno = EINVAL;
+            E("%s: invalid link target: %s", in->tarball, m->linkpath);
+        }
+        return -1;
+    }
+
+    if (in->n_links == in->cap_links) {
+        cap = in->cap_links ? in->cap_links * 2 : 64;
+        if (!(l = realloc(in->links, cap * sizeof(*l)))) {
+            E("realloc()");
+            return -1;
+        }
+        in->links = l;
+        in->cap_links = cap;
+    }
+
+    l = &in->links[in->n_links];
+    l->type = m->type;
+    if (!(l->dst = strdup(dst))) {
+        E("strdup()");
+        return -1;
+    }
+    if (!(l->linkpath = strdup(m->linkpath))) {
+        E("strdup()");
+        free(l->dst);
+        return -1;
+    }
+
+    in->n_links++;
+    return 0;
+}
+
+
+// in archive order, so hard links to symlinks find them
+static int install_links(struct install *in)
+{
+    size_t i;
+
+    for (i = 0; i < in->n_links; i++) {
+        if (install_link(in, &in->links[i]) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int install_dir(struct install *in, const struct tar_member *m,
+                       const char *dst)
+{
+    int tried = 0;
+
+    while (mkdir(dst, m->mode | S_IRWXU) < 0) {
+        if (errno == EEXIST) {
+            break;
+        } else if (errno != ENOENT || tried++) {
+            E("mkdir(): %s", dst);
+            return -1;
+        } else if (install_mkdirs(in, dst) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Extract one member, consuming its m->size bytes.
+ */
+static int install_member(struct install *in, const struct tar_member *m)
+{
+    char dst[PATH_MAX];
+
+    switch (install_path(in, m->path, dst)) {
+    case 0:
+        break;
+    case 1:
+        return tar_copy(in, m->size, -1, NULL, NULL);
+    default:
+        return -1;
+    }
+
+    if (install_safe(in, dst) < 0) {
+        return -1;
+    }
+
+    switch (m->type) {
+    case '0':
+    case '\0':
+    case '7':
+        return install_file(in, m, dst);
+    case '1':
+    case '2':
+        if (install_defer_link(in, m, dst) < 0) {
+            return -1;
+        }
+        break;
+    case '5':
+        if (install_dir(in, m, dst) < 0) {
+            return -1;
+        }
+        break;
+    default:
+        W("%s: skipping %s (type '%c')", in->tarball, m->path, m->type);
+        break;
+    }
+
+    return tar_copy(in, m->size, -1, NULL, NULL);
+}
+
+
+/*
+ * Start the decompressor for the archive at fd, preferring the tools that
+ * use several threads. Returns the fd to read the tar stream from: a pipe,
+ * or fd itself for an uncompressed archive.
+ */
+static int install_decompressor(struct install *in, int fd, pid_t *child)
+{
+    static const struct {
+        const char *magic;
+        size_t len;
+        const char *const argv[2][4];
+    } tools[] = {
+        { "\x1f\x8b", 2, { { "pigz", "-dc", NULL }, { "gzip", "-dc", NULL } } },
+        { "\x28\xb5\x2f\xfd", 4,
+          { { "pzstd", "-dc", "-", NULL }, { "zstd", "-dc", NULL } } },
+        { "\xfd" "7zXZ", 6, { { "xz", "-dc", "-T0", NULL }, { NULL } } },
+        { "BZh", 3, { { "lbzip2", "-dc", NULL }, { "bzip2", "-dc", NULL } } },
+    };
+    unsigned char magic[6] = {0};
+    size_t i, j;
+    int pipefd[2];
+
+    *child = -1;
+
+    if (pread(fd, magic, sizeof(magic), 0) < 0) {
+        E("pread(): %s", in->tarball);
+        return -1;
+    }
+
+    for (i = 0; i < sizeof(tools) / sizeof(tools[0]); i++) {
+        if (!memcmp(magic, tools[i].magic, tools[i].len)) {
+            break;
+        }
+    }
+
+    if (i == sizeof(tools) / sizeof(tools[0])) {
+        return fd;
+    }
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        E("pipe2()");
+        return -1;
+    }
+
+    if ((*child = fork()) < 0) {
+        E("fork()");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    } else if (*child == 0) {
+        if (dup2(fd, STDIN_FILENO) < 0 || dup2(pipefd[1], STDOUT_FILENO) < 0) {
+            E("dup2()");
+            log_flush();
+            _exit(EXIT_FAILURE);
+        }
+        for (j = 0; j < 2 && tools[i].argv[j][0]; j++) {
+            execvp(tools[i].argv[j][0], (char *const *) tools[i].argv[j]);
+            if (errno != ENOENT) {
+                break;
+            }
+        }
+        E("execvp(): %s", tools[i].argv[j < 2 && tools[i].argv[j][0] ?
+                                        j : 0][0]);
+        log_flush();
+        _exit(EXIT_FAILURE);
+    }
+
+    close(pipefd[1]);
+    return pipefd[0];
+}
+
+
+/*
+ * Extract a release tarball over the install directory in one pass,
+ * writing each member once. The ELF files the caller patches are read
+ * into memory and handed to in->ops->elf() on the way.
+ */
+int install_tarball(struct install *in, const char *tarball, const char *root,
+                    const struct install_ops *ops, void *arg)
+{
+    struct tar_member m;
+    pid_t child = -1;
+    int ret = -1, fd = -1, status, r, siz;
+
+    memset(in, 0, sizeof(*in));
+    in->tarball = tarball;
+    in->ops = ops;
+    in->arg = arg;
+    in->tr.fd = -1;
+    in->umask = umask(0);
+    umask(in->umask);
+
+    siz = snprintf(in->root, PATH_MAX, "%s", root);
+    if (siz < 0) {
+        E("snprintf(): %s", root);
+        goto end;
+    } else if (siz >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        E("snprintf(): %s", root);
+        goto end;
+    }
+
+    if (!(in->tr.buf = malloc(INSTALL_BUFSIZE))) {
+        E("malloc()");
+        goto end;
+    }
+
+    if ((fd = open(tarball, O_RDONLY | O_CLOEXEC)) < 0) {
+        E("open(): %s", tarball);
+        goto end;
+    }
+
+    if ((in->tr.fd = install_decompressor(in, fd, &child)) < 0) {
+        goto end;
+    }
+
+    I("Installing %s into %s", tarball, in->root);
+
+    while ((r = tar_next(in, &m)) == 0) {
+        if (install_member(in, &m) < 0 ||
+            tar_copy(in, (TAR_BLOCK - m.size % TAR_BLOCK) % TAR_BLOCK, -1,
+                     NULL, NULL) < 0) {
+            goto end;
+        }
+    }
+
+    if (r < 0 || install_links(in) < 0) {
+        goto end;
+    }
+
+    if (child > 0) {
+        // the zero blocks after the end, so the decompressor exits cleanly
+        in->tr.pos = in->tr.len;
+        while ((r = tar_fill(in, 1)) == 0) {
+            in->tr.pos = in->tr.len;
+        }
+        if (r < 0) {
+            goto end;
+        }
+
+        close(in->tr.fd);
+        in->tr.fd = -1;
+
+        if (waitpid(child, &status, 0) < 0) {
+            E("waitpid()");
+            goto end;
+        }
+        child = -1;
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            errno = 0;
+            E("%s: decompression failed (status %d)", tarball, status);
+            goto end;
+        }
+    }
+
+    ret = 0;
+
+end:
+    if (in->tr.fd >= 0 && in->tr.fd != fd) {
+        close(in->tr.fd);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (child > 0) {
+        // stopped early: the decompressor gets EPIPE
+        waitpid(child, &status, 0);
+    }
+
+    for (size_t i = 0; i < in->n_links; i++) {
+        free(in->links[i].dst);
+        free(in->links[i].linkpath);
+    }
+    free(in->links);
+    free(in->tr.buf);
+    in->links = NULL;
+    in->n_links = in->cap_links = 0;
+    in->tr.buf = NULL;
+    in->tr.fd = -1;
+    return ret;
+}
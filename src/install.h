@@ -0,0 +1,89 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INSTALL_H
+#define INSTALL_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * A tar stream read through a buffer, with the member being extracted.
+ * Long names come from GNU 'L'/'K' entries or pax 'x' headers.
+ */
+struct tar_reader {
+    int fd;
+    unsigned char *buf;
+    size_t pos, len;
+};
+
+struct tar_member {
+    int type;
+    mode_t mode;
+    uint64_t size;
+    int64_t mtime;
+    char path[PATH_MAX];
+    char linkpath[PATH_MAX];
+};
+
+// a link member, made once every other member is in place
+struct install_link {
+    int type;
+    char *dst;
+    char *linkpath;
+};
+
+struct install;
+
+// what the caller of install_tarball() does with the members
+struct install_ops {
+    // whether the regular file dst is to be handed to elf() if it is one
+    int (*patched)(const char *dst, void *arg);
+    // the temporary file dst is written to, then renamed over it
+    int (*tmppath)(const char *dst, char *tmppath, void *arg);
+    // write an ELF member, which is in data, to fd, then set its
+    // attributes with install_attrs()
+    int (*elf)(struct install *in, const struct tar_member *m,
+               const char *dst, int fd, const char *tmppath,
+               const unsigned char *data, void *arg);
+    // dst is in place: a hard link ('1'), a symlink ('2') or else a
+    // regular file
+    void (*installed)(const char *dst, int type, void *arg);
+};
+
+struct install {
+    const char *tarball;
+    char root[PATH_MAX];
+    mode_t umask;
+    struct tar_reader tr;
+    const struct install_ops *ops;
+    void *arg;
+    size_t n_files;
+    uint64_t n_bytes;
+    struct install_link *links;
+    size_t n_links, cap_links;
+    // the last directory found to have no symlink below the root
+    char safe_dir[PATH_MAX];
+    size_t safe_len;
+};
+
+int install_attrs(struct install *in, const struct tar_member *m, int fd,
+                  const char *tmppath, struct stat *sb);
+int install_tarball(struct install *in, const char *tarball, const char *root,
+                    const struct install_ops *ops, void *arg);
+
+#endif
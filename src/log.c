@@ -0,0 +1,592 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "log.h"
+
+#define LOG_SLOTS 256
+#define LOG_MSG_MAX (PATH_MAX + 512)
+#define LOG_BATCH_MAX 65536
+#define LOG_FLUSH_MS 50
+#define LOG_RATE_BURST 50
+#define LOG_MAX_SIZE_DEFAULT (8LL << 20)
+#define LOG_KEEP 3
+
+/*
+ * Bounded multi-producer queue of formatted lines (Vyukov): producers
+ * claim a slot with a CAS on `head` and publish it through its sequence
+ * number, so logging never takes a lock. The single consumer, serialized
+ * by `drain_lock`, writes whole batches with one write().
+ */
+struct log_slot {
+    atomic_size_t seq;
+    size_t len;
+    char buf[LOG_MSG_MAX];
+};
+
+int log_level = LOG_INFO;
+
+static int log_json = 0;
+static long long log_max_size = LOG_MAX_SIZE_DEFAULT;
+static int log_fd = STDERR_FILENO;
+static char log_path[PATH_MAX];
+static long long log_size = 0;
+
+static struct log_slot *ring = NULL;
+static atomic_size_t ring_head;
+static size_t ring_tail = 0;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static atomic_int flusher_running;
+
+static __thread FILE *capture_fp = NULL;
+static __thread time_t stime_last = 0;
+static __thread char stime_buf[32];
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+
+static int64_t log_monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static void log_drain_locked(void);
+
+
+static void log_atfork_prepare(void)
+{
+    // the child starts with an empty queue and nothing half-written
+    pthread_mutex_lock(&drain_lock);
+    log_drain_locked();
+    // nor with wake_lock held by a thread that is not forked along
+    pthread_mutex_lock(&wake_lock);
+}
+
+
+static void log_atfork_parent(void)
+{
+    pthread_mutex_unlock(&wake_lock);
+    pthread_mutex_unlock(&drain_lock);
+}
+
+
+static void log_atfork_child(void)
+{
+    atomic_store(&flusher_running, 0);
+    pthread_mutex_unlock(&wake_lock);
+    pthread_mutex_unlock(&drain_lock);
+}
+
+
+static void log_init(void)
+{
+    size_t i;
+
+    if (!(ring = calloc(LOG_SLOTS, sizeof(*ring)))) {
+        return;
+    }
+
+    for (i = 0; i < LOG_SLOTS; i++) {
+        atomic_init(&ring[i].seq, i);
+    }
+
+    atomic_init(&ring_head, 0);
+    atomic_init(&flusher_running, 0);
+    pthread_atfork(log_atfork_prepare, log_atfork_parent, log_atfork_child);
+    atexit(log_flush);
+}
+
+
+static void log_fallback(const char *buf, size_t len)
+{
+    // no queue: write through
+    if (write(log_fd, buf, len) < 0) {
+        return;
+    }
+}
+
+
+static void log_reopen(void)
+{
+    int fd;
+
+    if ((fd = open(log_path, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        return;
+    }
+
+    if (log_fd != STDERR_FILENO) {
+        close(log_fd);
+    }
+
+    log_fd = fd;
+    log_size = lseek(fd, 0, SEEK_END);
+}
+
+
+/*
+ * patch.log -> patch.log.1 -> ... -> patch.log.LOG_KEEP. Other processes
+ * appending to the same log notice the new inode and reopen.
+ */
+static void log_rotate(void)
+{
+    char from[PATH_MAX + 16], to[PATH_MAX + 16];
+    struct stat sb, fsb;
+    int i;
+
+    if (!log_path[0]) {
+        return;
+    }
+
+    if (stat(log_path, &sb) == 0 && fstat(log_fd, &fsb) == 0 &&
+        (sb.st_ino != fsb.st_ino || sb.st_dev != fsb.st_dev)) {
+        // rotated by someone else
+        log_reopen();
+        return;
+    }
+
+    if (log_max_size <= 0 || log_size < log_max_size) {
+        return;
+    }
+
+    for (i = LOG_KEEP; i > 0; i--) {
+        snprintf(to, sizeof(to), "%s.%d", log_path, i);
+        if (i > 1) {
+            snprintf(from, sizeof(from), "%s.%d", log_path, i - 1);
+        } else {
+            snprintf(from, sizeof(from), "%s", log_path);
+        }
+        rename(from, to);
+    }
+
+    log_reopen();
+}
+
+
+static void log_drain_locked(void)
+{
+    static char batch[LOG_BATCH_MAX];
+    size_t len = 0;
+
+    if (!ring) {
+        return;
+    }
+
+    for (;;) {
+        struct log_slot *slot = &ring[ring_tail % LOG_SLOTS];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if (seq != ring_tail + 1) {
+            // empty, or the next slot is still being written
+            break;
+        }
+
+        if (len + slot->len > sizeof(batch)) {
+            log_fallback(batch, len);
+            log_size += len;
+            len = 0;
+        }
+
+        memcpy(batch + len, slot->buf, slot->len);
+        len += slot->len;
+
+        atomic_store_explicit(&slot->seq, ring_tail + LOG_SLOTS,
+                              memory_order_release);
+        ring_tail++;
+    }
+
+    if (len) {
+        log_fallback(batch, len);
+        log_size += len;
+        log_rotate();
+    }
+}
+
+
+void log_flush(void)
+{
+    pthread_mutex_lock(&drain_lock);
+    log_drain_locked();
+    pthread_mutex_unlock(&drain_lock);
+}
+
+
+static void *log_flusher(void *arg)
+{
+    struct timespec ts;
+
+    (void) arg;
+
+    for (;;) {
+        pthread_mutex_lock(&wake_lock);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        if ((ts.tv_nsec += LOG_FLUSH_MS * 1000000L) >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wake_cond, &wake_lock, &ts);
+        pthread_mutex_unlock(&wake_lock);
+
+        log_flush();
+    }
+
+    return NULL;
+}
+
+
+void log_start(void)
+{
+    pthread_attr_t attr;
+
+    pthread_once(&ring_once, log_init);
+
+    if (!ring || atomic_exchange(&flusher_running, 1)) {
+        return;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&flusher, &attr, log_flusher, NULL) != 0) {
+        // producers drain the queue themselves
+        atomic_store(&flusher_running, 0);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+
+static struct log_slot *log_claim(size_t *pos)
+{
+    struct log_slot *slot;
+    size_t seq;
+    intptr_t diff;
+
+    *pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+
+    for (;;) {
+        slot = &ring[*pos % LOG_SLOTS];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (intptr_t) seq - (intptr_t) *pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_head, pos,
+                                                      *pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                return slot;
+            }
+        } else if (diff < 0) {
+            // full
+            return NULL;
+        } else {
+            *pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        }
+    }
+}
+
+
+static void log_wake(void)
+{
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
+}
+
+
+static void log_enqueue(const char *buf, size_t len)
+{
+    struct timespec ts = {0, 1000000L};
+    struct log_slot *slot;
+    size_t pos;
+
+    pthread_once(&ring_once, log_init);
+
+    if (!ring) {
+        log_fallback(buf, len);
+        return;
+    }
+
+    while (!(slot = log_claim(&pos))) {
+        if (atomic_load(&flusher_running)) {
+            log_wake();
+            nanosleep(&ts, NULL);
+        } else {
+            log_flush();
+        }
+    }
+
+    memcpy(slot->buf, buf, len);
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    if ((pos + 1) % (LOG_SLOTS / 2) == 0) {
+        if (atomic_load(&flusher_running)) {
+            log_wake();
+        } else {
+            log_flush();
+        }
+    }
+}
+
+
+void log_submit(const char *text, size_t len)
+{
+    size_t n;
+    const char *nl;
+
+    while (len) {
+        // one slot per line, or per LOG_MSG_MAX bytes of a longer one
+        nl = memchr(text, '\n', len < LOG_MSG_MAX ? len : LOG_MSG_MAX);
+        n = nl ? (size_t) (nl - text) + 1 : len < LOG_MSG_MAX ? len : LOG_MSG_MAX;
+        log_enqueue(text, n);
+        text += n;
+        len -= n;
+    }
+}
+
+
+void log_capture(FILE *fp)
+{
+    capture_fp = fp;
+}
+
+
+static size_t log_put_json(char *buf, size_t pos, size_t cap, const char *s)
+{
+    for (; *s && pos + 7 < cap; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\') {
+            buf[pos++] = '\\';
+            buf[pos++] = ch;
+        } else if (ch < 0x20) {
+            pos += snprintf(buf + pos, cap - pos, "\\u%04x", ch);
+        } else {
+            buf[pos++] = ch;
+        }
+    }
+
+    return pos;
+}
+
+
+/*
+ * Errors and warnings are limited to LOG_RATE_BURST per second and call
+ * site; returns the number of messages dropped in the previous second if
+ * this one may be logged, -1 if it has to be dropped too.
+ */
+static long log_ratelimit(struct log_site *site)
+{
+    long long now = log_monotonic_ns() / 1000000000LL;
+    long long window = atomic_load(&site->window);
+
+    if (window != now && atomic_compare_exchange_strong(&site->window,
+                                                        &window, now)) {
+        atomic_store(&site->count, 1);
+        return atomic_exchange(&site->suppressed, 0);
+    }
+
+    if (atomic_fetch_add(&site->count, 1) >= LOG_RATE_BURST) {
+        atomic_fetch_add(&site->suppressed, 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void log_write(struct log_site *site, int level, const char *filename,
+               const char *funcname, long line, int errnum,
+               const char *fmt, ...)
+{
+    va_list args;
+    char buf[LOG_MSG_MAX], msg[LOG_MSG_MAX], errbuf[256], *errmsg = NULL;
+    time_t t;
+    size_t len;
+    long dropped = 0;
+
+    if (level <= LOG_WARN && (dropped = log_ratelimit(site)) < 0) {
+        return;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+
+    if (errnum) {
+        errmsg = strerror_r(errnum, errbuf, sizeof(errbuf));
+    }
+
+    if (log_json) {
+        len = snprintf(buf, sizeof(buf),
+                       "{\"mono_ns\":%lld,\"time\":%lld,\"level\":\"%s\","
+                       "\"pid\":%ld,\"tid\":%ld,\"src\":\"%s:%s():%ld\","
+                       "\"msg\":\"", (long long) log_monotonic_ns(),
+                       (long long) time(NULL), level_names[level],
+                       (long) getpid(), (long) syscall(SYS_gettid),
+                       filename, funcname, line);
+        len = log_put_json(buf, len, sizeof(buf) - 64, msg);
+        if (errmsg) {
+            len += snprintf(buf + len, sizeof(buf) - len,
+                            "\",\"errno\":%d,\"error\":\"", errnum);
+            len = log_put_json(buf, len, sizeof(buf) - 64, errmsg);
+        }
+        if (dropped) {
+            len += snprintf(buf + len, sizeof(buf) - len,
+                            "\",\"suppressed\":%ld}\n", dropped);
+        } else {
+            len += snprintf(buf + len, sizeof(buf) - len, "\"}\n");
+        }
+    } else {
+        if ((t = time(NULL)) != stime_last) {
+            // ctime_r() only once per second and thread
+            stime_last = t;
+            if (ctime_r(&t, stime_buf)) {
+                stime_buf[strlen(stime_buf) - 1] = '\0';
+            } else {
+                stime_buf[0] = '\0';
+            }
+        }
+        len = snprintf(buf, sizeof(buf), "%s [%s:%s():%ld] %s%s%s", stime_buf,
+                       filename, funcname, line, msg, errmsg ? ": " : "",
+                       errmsg ? errmsg : "");
+        if (len >= sizeof(buf) - 48) {
+            len = sizeof(buf) - 48;
+        }
+        if (dropped) {
+            len += snprintf(buf + len, sizeof(buf) - len,
+                            " (%ld similar suppressed)", dropped);
+        }
+        buf[len++] = '\n';
+    }
+
+    if (len > sizeof(buf)) {
+        len = sizeof(buf);
+        buf[len - 1] = '\n';
+    }
+
+    if (capture_fp) {
+        fwrite(buf, 1, len, capture_fp);
+        return;
+    }
+
+    log_enqueue(buf, len);
+}
+
+
+static long long log_parse_size(const char *s)
+{
+    char *endp;
+    long long n;
+
+    errno = 0;
+    n = strtoll(s, &endp, 10);
+    if (errno || n < 0) {
+        return -1;
+    }
+
+    switch (*endp) {
+    case 'k': case 'K':
+        n <<= 10;
+        endp++;
+        break;
+    case 'm': case 'M':
+        n <<= 20;
+        endp++;
+        break;
+    case 'g': case 'G':
+        n <<= 30;
+        endp++;
+        break;
+    }
+
+    return *endp ? -1 : n;
+}
+
+
+void log_setup(void)
+{
+    const char *env;
+    int i;
+
+    if ((env = getenv("VSCODE_PATCH_LOG_FORMAT")) && !strcmp(env, "json")) {
+        log_json = 1;
+    }
+
+    if ((env = getenv("VSCODE_PATCH_LOG_LEVEL")) && *env) {
+        for (i = LOG_ERROR; i <= LOG_DEBUG; i++) {
+            if (!strcmp(env, level_names[i])) {
+                log_level = i;
+                break;
+            }
+        }
+        if (i > LOG_DEBUG) {
+            W("invalid VSCODE_PATCH_LOG_LEVEL=%s", env);
+        }
+    }
+
+    if ((env = getenv("VSCODE_PATCH_LOG_MAX_SIZE")) && *env) {
+        long long n = log_parse_size(env);
+        if (n < 0) {
+            W("invalid VSCODE_PATCH_LOG_MAX_SIZE=%s", env);
+        } else {
+            log_max_size = n;
+        }
+    }
+}
+
+
+int log_open(const char *path)
+{
+    size_t len = strlen(path);
+
+    if (len >= sizeof(log_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memcpy(log_path, path, len + 1);
+
+    log_flush();
+    log_reopen();
+
+    if (log_fd == STDERR_FILENO) {
+        log_path[0] = '\0';
+        return -1;
+    }
+
+    log_start();
+    return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LOG_H
+#define LOG_H
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum log_level {
+    LOG_ERROR = 0,
+    LOG_WARN = 1,
+    LOG_INFO = 2,
+    LOG_DEBUG = 3,
+};
+
+/*
+ * Per call site state for rate limiting, see log_write(). One is created
+ * statically by every E(), W(), I() and D().
+ */
+struct log_site {
+    atomic_llong window;
+    atomic_uint count;
+    atomic_uint suppressed;
+};
+
+#define LOG_(level, errnum, ...) \
+    do { \
+        static struct log_site log_site_; \
+        if ((level) <= log_level) { \
+            log_write(&log_site_, (level), __FILE__, __FUNCTION__, __LINE__, \
+                      (errnum), __VA_ARGS__); \
+        } \
+        errno = 0; \
+    } while (0)
+
+// error with the current errno, as before
+#define E(...) LOG_(LOG_ERROR, errno, __VA_ARGS__)
+#define W(...) LOG_(LOG_WARN, 0, __VA_ARGS__)
+#define I(...) LOG_(LOG_INFO, 0, __VA_ARGS__)
+#define D(...) LOG_(LOG_DEBUG, 0, __VA_ARGS__)
+
+extern int log_level;
+
+/*
+ * Read VSCODE_PATCH_LOG_FORMAT, VSCODE_PATCH_LOG_LEVEL and
+ * VSCODE_PATCH_LOG_MAX_SIZE.
+ */
+void log_setup(void);
+
+/*
+ * Send messages to `path` (appended, rotated by size) instead of stderr
+ * and start the background flush thread. Returns 0 or -1 on error.
+ */
+int log_open(const char *path);
+
+/*
+ * (Re)start the background flush thread, e.g. in a forked child.
+ */
+void log_start(void);
+
+/*
+ * Write out everything queued so far. Called before exec and at exit;
+ * messages are otherwise written in batches.
+ */
+void log_flush(void);
+
+/*
+ * Format the messages of the calling thread into `fp` instead of the
+ * queue, until called again with NULL.
+ */
+void log_capture(FILE *fp);
+
+/*
+ * Queue already formatted lines, e.g. a capture buffer.
+ */
+void log_submit(const char *text, size_t len);
+
+void log_write(struct log_site *site, int level, const char *filename,
+               const char *funcname, long line, int errnum,
+               const char *fmt, ...)
+    __attribute__((format(printf, 7, 8)));
+
+#endif /* LOG_H */
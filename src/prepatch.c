@@ -0,0 +1,309 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build step: give every dynamically linked ELF file below the given
+ * paths padded interpreter and DT_RUNPATH slots (patchelf_prepatch()).
+ * The files keep running as before; on the target the wrapper then fills
+ * the slots with a few bytes of pwrite() instead of rewriting the file.
+ *
+ * With -l, the executables of the one given directory are also written
+ * to a list (src/elflist.h), so the wrapper need not walk it. -s 0 only
+ * writes the list.
+ *
+ * Usage: prepatch [-s slot_size] [-l list] <path> ...
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <elf.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libpatchelf/libpatchelf.h>
+#include "elflist.h"
+
+// room for a home directory of about 450 characters
+#define PREPATCH_SLOT_DEFAULT 512
+#define PREPATCH_TMPEXT ".prepatchtmp"
+
+struct list_item {
+    struct elflist_entry ent;
+    char *path;
+};
+
+static size_t slot_size = PREPATCH_SLOT_DEFAULT;
+static size_t n_elf = 0;
+static size_t n_prepatched = 0;
+static size_t n_errors = 0;
+static const char *list_root = NULL;
+static struct list_item *items = NULL;
+static size_t n_items = 0, cap_items = 0;
+
+
+/*
+ * Add fpath, as it is now, to the list.
+ */
+static int list_add(const char *fpath)
+{
+    struct patchelf_probe probe;
+    struct elflist_entry *ent;
+    struct stat sb;
+    int fd, ret = -1;
+
+    if ((fd = open(fpath, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    if (n_items == cap_items) {
+        size_t cap = cap_items ? cap_items * 2 : 256;
+        struct list_item *tmp = realloc(items, cap * sizeof(*items));
+
+        if (!tmp) {
+            goto end;
+        }
+        items = tmp;
+        cap_items = cap;
+    }
+
+    // nftw() gives paths below the root as "<root>/..."
+    if (strlen(fpath) <= strlen(list_root)) {
+        errno = ENOTDIR;
+        goto end;
+    }
+
+    if (fstat(fd, &sb) < 0 || patchelf_probe_fd(fd, &probe) != 0 ||
+        !(items[n_items].path = strdup(fpath + strlen(list_root) + 1))) {
+        goto end;
+    }
+
+    ent = &items[n_items].ent;
+    memset(ent, 0, sizeof(*ent));
+    ent->size = sb.st_size;
+    ent->interp_offset = probe.interp_offset;
+    ent->interp_size = probe.interp_size;
+    if (probe.runpath_tag) {
+        ent->runpath_offset = probe.runpath_offset;
+        ent->runpath_size = probe.runpath_size;
+        ent->tag_size = probe.elf_class == ELFCLASS32 ? sizeof(Elf32_Sword)
+                                                      : sizeof(Elf64_Sxword);
+        ent->tag_offset = probe.dynamic_offset +
+                          probe.runpath_index * (probe.elf_class == ELFCLASS32
+                                                 ? sizeof(Elf32_Dyn)
+                                                 : sizeof(Elf64_Dyn));
+    }
+
+    if (elflist_digest(fd, ent, ent->sha256) < 0) {
+        free(items[n_items].path);
+        goto end;
+    }
+
+    n_items++;
+    ret = 0;
+
+end:
+    close(fd);
+    return ret;
+}
+
+
+static int list_item_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct list_item *) a)->path,
+                  ((const struct list_item *) b)->path);
+}
+
+
+static int list_save(const char *path)
+{
+    struct elflist_header hdr = {0};
+    char tmppath[PATH_MAX];
+    FILE *fp;
+    size_t i;
+    uint32_t off = 0;
+
+    if (snprintf(tmppath, PATH_MAX, "%s" PREPATCH_TMPEXT, path) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    qsort(items, n_items, sizeof(*items), list_item_cmp);
+
+    memcpy(hdr.magic, ELFLIST_MAGIC, sizeof(hdr.magic));
+    hdr.version = ELFLIST_VERSION;
+    hdr.n_entries = n_items;
+    for (i = 0; i < n_items; i++) {
+        items[i].ent.path_offset = off;
+        off += strlen(items[i].path) + 1;
+    }
+    hdr.strings_size = off;
+
+    if (!(fp = fopen(tmppath, "wb"))) {
+        return -1;
+    }
+
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    for (i = 0; i < n_items; i++) {
+        fwrite(&items[i].ent, sizeof(items[i].ent), 1, fp);
+    }
+    for (i = 0; i < n_items; i++) {
+        fputs(items[i].path, fp);
+        fputc('\0', fp);
+    }
+
+    if (ferror(fp) | fclose(fp) || chmod(tmppath, 0644) < 0 ||
+        rename(tmppath, path) < 0) {
+        unlink(tmppath);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int prepatch_ent(const char *fpath, const struct stat *sb, int flag,
+                        struct FTW *ftwbuf)
+{
+    struct patchelf_probe probe;
+    struct timespec times[2];
+    char tmppath[PATH_MAX];
+    int ret;
+
+    (void) ftwbuf;
+
+    if (flag != FTW_F || !S_ISREG(sb->st_mode) || sb->st_size <= 4) {
+        return 0;
+    }
+
+    // a cheap look first: most files are not ELF
+    if ((ret = patchelf_probe(fpath, &probe)) == 1 || (ret == 0 &&
+            !probe.has_interp)) {
+        return 0;
+    } else if (ret < 0) {
+        fprintf(stderr, "prepatch: %s: cannot probe\n", fpath);
+        n_errors++;
+        return 0;
+    }
+
+    n_elf++;
+
+    if (!slot_size) {
+        goto list;
+    } else if (sb->st_nlink != 1) {
+        // would lose the link; the wrapper rewrites those anyway
+        fprintf(stderr, "prepatch: %s: has %lu links, skipped\n", fpath,
+                (unsigned long) sb->st_nlink);
+        goto list;
+    }
+
+    if (snprintf(tmppath, PATH_MAX, "%s" PREPATCH_TMPEXT, fpath) >=
+            PATH_MAX) {
+        fprintf(stderr, "prepatch: %s: %s\n", fpath, strerror(ENAMETOOLONG));
+        n_errors++;
+        return 0;
+    }
+
+    switch (patchelf_prepatch(fpath, tmppath, slot_size, 1)) {
+    case 0:
+        break;
+    case 1:
+        // done before
+        goto list;
+    default:
+        fprintf(stderr, "prepatch: %s: failed\n", fpath);
+        unlink(tmppath);
+        n_errors++;
+        return 0;
+    }
+
+    // same mode and times, so the tarball only differs in these files' data
+    times[0] = sb->st_atim;
+    times[1] = sb->st_mtim;
+    if (chmod(tmppath, sb->st_mode & 07777) < 0 ||
+        utimensat(AT_FDCWD, tmppath, times, 0) < 0 ||
+        rename(tmppath, fpath) < 0) {
+        fprintf(stderr, "prepatch: %s: %s\n", fpath, strerror(errno));
+        unlink(tmppath);
+        n_errors++;
+        return 0;
+    }
+
+    n_prepatched++;
+
+list:
+    if (list_root && list_add(fpath) < 0) {
+        fprintf(stderr, "prepatch: %s: cannot list: %s\n", fpath,
+                strerror(errno));
+        n_errors++;
+    }
+
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *list_path = NULL;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "s:l:")) != -1) {
+        switch (opt) {
+        case 's':
+            slot_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            list_path = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind >= argc || slot_size == 1 ||
+        slot_size > sizeof(((struct patchelf_edit *) 0)->data) ||
+        (list_path && optind + 1 != argc)) {
+        goto usage;
+    }
+
+    if (list_path) {
+        list_root = argv[optind];
+    }
+
+    for (i = optind; i < argc; i++) {
+        if (nftw(argv[i], prepatch_ent, 64, FTW_PHYS) < 0) {
+            fprintf(stderr, "prepatch: nftw(): %s: %s\n", argv[i],
+                    strerror(errno));
+            return 1;
+        }
+    }
+
+    if (list_path && list_save(list_path) < 0) {
+        fprintf(stderr, "prepatch: %s: %s\n", list_path, strerror(errno));
+        return 1;
+    }
+
+    fprintf(stderr, "prepatch: %zu of %zu ELF files given %zu byte slots, "
+            "%zu errors\n", n_prepatched, n_elf, slot_size, n_errors);
+    return n_errors ? 1 : 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-s slot_size] [-l list] <path> ...\n",
+            argv[0]);
+    return 1;
+}
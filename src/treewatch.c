@@ -0,0 +1,753 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "treewatch.h"
+
+#define TREEWATCH_BUFLEN 16384
+
+// the root follows a symlink and reports being replaced
+#define TREEWATCH_ROOT_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                             IN_CREATE | IN_DELETE_SELF | IN_MOVE_SELF | \
+                             IN_ONLYDIR)
+#define TREEWATCH_DIR_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                            IN_CREATE | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+struct treewatch_dir {
+    int wd;
+    // watch of the parent, -1 for the root
+    int parent;
+    int depth;
+    char *name;
+};
+
+struct treewatch_handle {
+    struct file_handle fh;
+    unsigned char data[MAX_HANDLE_SZ];
+};
+
+
+static int dir_cmp(const void *a, const void *b)
+{
+    int x = ((const struct treewatch_dir *) a)->wd;
+    int y = ((const struct treewatch_dir *) b)->wd;
+
+    return (x > y) - (x < y);
+}
+
+
+static struct treewatch_dir *dir_find(const struct treewatch *tw, int wd)
+{
+    struct treewatch_dir key = { .wd = wd };
+
+    return tw->n_dirs ? bsearch(&key, tw->dirs, tw->n_dirs,
+                                sizeof(*tw->dirs), dir_cmp) : NULL;
+}
+
+
+/*
+ * Record wd as the directory name of parent, or move it there if it is
+ * known already: adding a watch twice returns the same descriptor.
+ */
+static int dir_set(struct treewatch *tw, int wd, int parent, int depth,
+                   const char *name)
+{
+    struct treewatch_dir *d;
+    char *copy = NULL;
+    size_t lo = 0, hi = tw->n_dirs;
+
+    if (name && !(copy = strdup(name))) {
+        return -1;
+    }
+
+    if ((d = dir_find(tw, wd))) {
+        free(d->name);
+        goto set;
+    }
+
+    if (tw->n_dirs == tw->cap_dirs) {
+        size_t cap = tw->cap_dirs ? tw->cap_dirs * 2 : 64;
+        void *p = realloc(tw->dirs, cap * sizeof(*tw->dirs));
+
+        if (!p) {
+            free(copy);
+            return -1;
+        }
+        tw->dirs = p;
+        tw->cap_dirs = cap;
+    }
+
+    // descriptors mostly grow: this is nearly always an append
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (tw->dirs[mid].wd < wd) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    memmove(&tw->dirs[lo + 1], &tw->dirs[lo],
+            (tw->n_dirs - lo) * sizeof(*tw->dirs));
+    tw->n_dirs++;
+    d = &tw->dirs[lo];
+    d->wd = wd;
+
+set:
+    d->parent = parent;
+    d->depth = depth;
+    d->name = copy;
+    return 0;
+}
+
+
+static void dir_remove(struct treewatch *tw, struct treewatch_dir *d)
+{
+    size_t i = d - tw->dirs;
+
+    free(d->name);
+    memmove(d, d + 1, (tw->n_dirs - i - 1) * sizeof(*d));
+    tw->n_dirs--;
+}
+
+
+// stop watching wd and everything recorded below it
+static void dir_drop(struct treewatch *tw, int wd)
+{
+    struct treewatch_dir *d;
+    size_t i;
+
+    if (!(d = dir_find(tw, wd))) {
+        return;
+    }
+
+    inotify_rm_watch(tw->fd, wd);
+    dir_remove(tw, d);
+
+    for (i = 0; i < tw->n_dirs;) {
+        if (tw->dirs[i].parent == wd) {
+            dir_drop(tw, tw->dirs[i].wd);
+            // the array moved under us
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+}
+
+
+static struct treewatch_dir *dir_child(const struct treewatch *tw, int wd,
+                                       const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < tw->n_dirs; i++) {
+        if (tw->dirs[i].parent == wd && !strcmp(tw->dirs[i].name, name)) {
+            return &tw->dirs[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static int path_append(char *path, size_t *len, const char *name)
+{
+    size_t l = strlen(name);
+
+    if (*len + 1 + l >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    path[(*len)++] = '/';
+    memcpy(path + *len, name, l);
+    *len += l;
+    return 0;
+}
+
+
+/*
+ * Path of the directory wd, or of name in it, from the names of its
+ * ancestors.
+ */
+static int dir_path(const struct treewatch *tw, int wd, const char *name,
+                    char *path)
+{
+    const struct treewatch_dir *chain[TREEWATCH_DEPTH + 1], *d;
+    size_t n = 0, len = tw->root_len;
+
+    while ((d = dir_find(tw, wd)) && d->parent >= 0) {
+        if (n == TREEWATCH_DEPTH + 1) {
+            errno = ELOOP;
+            return -1;
+        }
+        chain[n++] = d;
+        wd = d->parent;
+    }
+
+    if (!d) {
+        // an ancestor was dropped
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (len >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(path, tw->root, len);
+
+    while (n-- > 0) {
+        if (path_append(path, &len, chain[n]->name) < 0) {
+            return -1;
+        }
+    }
+
+    if (name && path_append(path, &len, name) < 0) {
+        return -1;
+    }
+
+    path[len] = '\0';
+    return 0;
+}
+
+
+/*
+ * Watch the directories below top, breadth first, until max_dirs are.
+ */
+static int watch_below(struct treewatch *tw, int top)
+{
+    int *queue = NULL, ret = 0;
+    size_t head = 0, n = 0, cap = 0;
+    char path[PATH_MAX], child[PATH_MAX];
+    struct treewatch_dir *d;
+    struct dirent *ent;
+    DIR *dir;
+
+    if (!(queue = malloc(64 * sizeof(*queue)))) {
+        return -1;
+    }
+    cap = 64;
+    queue[n++] = top;
+
+    while (head < n && ret == 0) {
+        int wd = queue[head++], depth, cwd;
+
+        if (!(d = dir_find(tw, wd)) || dir_path(tw, wd, NULL, path) < 0) {
+            continue;
+        }
+        depth = d->depth;
+
+        if (!(dir = opendir(path))) {
+            // gone already, or not ours to read
+            continue;
+        }
+
+        while ((ent = readdir(dir))) {
+            if ((ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN) ||
+                !strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+                continue;
+            }
+
+            if (depth >= TREEWATCH_DEPTH || tw->n_dirs > tw->max_dirs) {
+                tw->n_skipped++;
+                continue;
+            }
+
+            if (snprintf(child, PATH_MAX, "%s/%s", path, ent->d_name) >=
+                    PATH_MAX) {
+                continue;
+            }
+
+            if ((cwd = inotify_add_watch(tw->fd, child,
+                                         TREEWATCH_DIR_MASK)) < 0) {
+                // not a directory, gone, or out of watches
+                if (errno == ENOSPC) {
+                    tw->n_skipped++;
+                }
+                continue;
+            }
+
+            if (n == cap) {
+                int *p = realloc(queue, cap * 2 * sizeof(*queue));
+
+                if (!p) {
+                    inotify_rm_watch(tw->fd, cwd);
+                    ret = -1;
+                    break;
+                }
+                queue = p;
+                cap *= 2;
+            }
+
+            if (dir_set(tw, cwd, wd, depth + 1, ent->d_name) < 0) {
+                inotify_rm_watch(tw->fd, cwd);
+                ret = -1;
+                break;
+            }
+            queue[n++] = cwd;
+        }
+
+        closedir(dir);
+    }
+
+    free(queue);
+    return ret;
+}
+
+
+// name, a directory that appeared in the directory wd
+static int watch_new(struct treewatch *tw, int wd, const char *name,
+                     const char *path)
+{
+    struct treewatch_dir *d;
+    int depth, cwd;
+
+    if (!(d = dir_find(tw, wd))) {
+        return 0;
+    }
+    depth = d->depth;
+
+    if (depth >= TREEWATCH_DEPTH || tw->n_dirs > tw->max_dirs) {
+        tw->n_skipped++;
+        return 0;
+    }
+
+    if ((cwd = inotify_add_watch(tw->fd, path, TREEWATCH_DIR_MASK)) < 0) {
+        if (errno == ENOSPC) {
+            tw->n_skipped++;
+        }
+        return 0;
+    }
+
+    if (dir_set(tw, cwd, wd, depth + 1, name) < 0) {
+        inotify_rm_watch(tw->fd, cwd);
+        return -1;
+    }
+
+    return watch_below(tw, cwd);
+}
+
+
+/*
+ * Report the files below path, a directory created before its watch was
+ * added: what was written to it meanwhile raised no event.
+ */
+static void report_files(const char *path, int depth, treewatch_cb cb,
+                         void *arg)
+{
+    char child[PATH_MAX];
+    struct dirent *ent;
+    struct stat sb;
+    DIR *dir;
+    int type;
+
+    if (!(dir = opendir(path))) {
+        return;
+    }
+
+    while ((ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") ||
+            snprintf(child, PATH_MAX, "%s/%s", path, ent->d_name) >=
+                PATH_MAX) {
+            continue;
+        }
+
+        if ((type = ent->d_type) == DT_UNKNOWN) {
+            if (lstat(child, &sb) < 0) {
+                continue;
+            }
+            type = S_ISDIR(sb.st_mode) ? DT_DIR :
+                   S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_REG) {
+            cb(child, TREEWATCH_FILE, arg);
+        } else if (type == DT_DIR && depth < TREEWATCH_DEPTH) {
+            report_files(child, depth + 1, cb, arg);
+        }
+    }
+
+    closedir(dir);
+}
+
+
+static int inotify_start(struct treewatch *tw)
+{
+    int wd;
+
+    if ((wd = inotify_add_watch(tw->fd, tw->root, TREEWATCH_ROOT_MASK)) < 0 ||
+        dir_set(tw, wd, -1, 0, NULL) < 0) {
+        return -1;
+    }
+
+    return watch_below(tw, wd);
+}
+
+
+static void inotify_stop(struct treewatch *tw)
+{
+    size_t i;
+
+    for (i = 0; i < tw->n_dirs; i++) {
+        inotify_rm_watch(tw->fd, tw->dirs[i].wd);
+        free(tw->dirs[i].name);
+    }
+    tw->n_dirs = 0;
+    tw->n_skipped = 0;
+}
+
+
+static int inotify_read(struct treewatch *tw, treewatch_cb cb, void *arg)
+{
+    char buf[TREEWATCH_BUFLEN]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    struct treewatch_dir *d;
+    ssize_t len;
+    char *p;
+    int depth;
+
+    while ((len = read(tw->fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len;
+             p += sizeof(struct inotify_event) +
+                  ((struct inotify_event *) p)->len) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                cb(tw->root, TREEWATCH_LOST, arg);
+                continue;
+            }
+
+            if (!(d = dir_find(tw, ev->wd))) {
+                // dropped, or from before a rescan
+                continue;
+            }
+
+            if (d->parent < 0 &&
+                ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                cb(tw->root, TREEWATCH_ROOT, arg);
+                continue;
+            }
+
+            if (ev->mask & IN_IGNORED) {
+                // removed: whatever was below it went first
+                dir_remove(tw, d);
+                continue;
+            }
+
+            if (!ev->len || dir_path(tw, ev->wd, ev->name, path) < 0) {
+                continue;
+            }
+
+            if (!(ev->mask & IN_ISDIR)) {
+                if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                    cb(path, TREEWATCH_FILE, arg);
+                }
+            } else if (ev->mask & IN_MOVED_FROM) {
+                // its watch would follow it out of the tree
+                if ((d = dir_child(tw, ev->wd, ev->name))) {
+                    dir_drop(tw, d->wd);
+                }
+            } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                depth = d->depth + 1;
+                if (watch_new(tw, ev->wd, ev->name, path) < 0) {
+                    return -1;
+                }
+                if (ev->mask & IN_MOVED_TO) {
+                    cb(path, TREEWATCH_DIR, arg);
+                } else {
+                    report_files(path, depth, cb, arg);
+                }
+            }
+        }
+    }
+
+    if (len < 0 && errno != EAGAIN && errno != EINTR) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int fanotify_start(struct treewatch *tw)
+{
+    struct treewatch_handle h;
+    int mount_id, fd;
+
+    free(tw->real_root);
+    if (!(tw->real_root = realpath(tw->root, NULL))) {
+        return -1;
+    }
+    tw->real_root_len = strlen(tw->real_root);
+
+    if (tw->root_fd >= 0) {
+        close(tw->root_fd);
+    }
+    if ((tw->root_fd = open(tw->root, O_RDONLY | O_DIRECTORY |
+                            O_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    // events name their directory by handle: check it can be opened
+    h.fh.handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at(tw->root_fd, "", &h.fh, &mount_id,
+                          AT_EMPTY_PATH) < 0 ||
+        (fd = open_by_handle_at(tw->root_fd, &h.fh, O_PATH | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    close(fd);
+
+    if (fanotify_mark(tw->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                      FAN_CLOSE_WRITE | FAN_MOVED_TO | FAN_ONDIR,
+                      tw->root_fd, NULL) < 0 ||
+        fanotify_mark(tw->fd, FAN_MARK_ADD, FAN_DELETE_SELF | FAN_MOVE_SELF,
+                      tw->root_fd, NULL) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void fanotify_stop(struct treewatch *tw)
+{
+    fanotify_mark(tw->fd, FAN_MARK_FLUSH | FAN_MARK_FILESYSTEM, 0,
+                  AT_FDCWD, NULL);
+    fanotify_mark(tw->fd, FAN_MARK_FLUSH, 0, AT_FDCWD, NULL);
+    free(tw->last_dir);
+    tw->last_dir = NULL;
+}
+
+
+/*
+ * Path below the root of the directory fh, as the root was given, or NULL
+ * if it is elsewhere on the filesystem. The last one is kept: a burst of
+ * events mostly comes from one directory.
+ */
+static const char *fanotify_dir(struct treewatch *tw,
+                                const struct file_handle *fh)
+{
+    struct treewatch_handle *last = tw->last_handle;
+    char proc[64], real[PATH_MAX];
+    const char *rest;
+    ssize_t len;
+    int fd;
+
+    if (tw->last_dir && last->fh.handle_type == fh->handle_type &&
+        last->fh.handle_bytes == fh->handle_bytes &&
+        !memcmp(last->fh.f_handle, fh->f_handle, fh->handle_bytes)) {
+        return *tw->last_dir ? tw->last_dir : NULL;
+    }
+
+    free(tw->last_dir);
+    tw->last_dir = NULL;
+
+    if (fh->handle_bytes > MAX_HANDLE_SZ ||
+        (fd = open_by_handle_at(tw->root_fd, (struct file_handle *) fh,
+                                O_PATH | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    len = readlink(proc, real, sizeof(real) - 1);
+    close(fd);
+    if (len < 0) {
+        return NULL;
+    }
+    real[len] = '\0';
+
+    rest = real + tw->real_root_len;
+    if (strncmp(real, tw->real_root, tw->real_root_len) != 0 ||
+        (*rest && *rest != '/')) {
+        rest = NULL;
+    }
+
+    memcpy(&last->fh, fh, sizeof(*fh) + fh->handle_bytes);
+    if (!rest) {
+        tw->last_dir = strdup("");
+        return NULL;
+    } else if (asprintf(&tw->last_dir, "%s%s", tw->root, rest) < 0) {
+        tw->last_dir = NULL;
+        return NULL;
+    }
+
+    return tw->last_dir;
+}
+
+
+static int fanotify_read(struct treewatch *tw, treewatch_cb cb, void *arg)
+{
+    char buf[TREEWATCH_BUFLEN]
+        __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    char path[PATH_MAX];
+    struct fanotify_event_metadata *meta;
+    struct fanotify_event_info_fid *info;
+    struct file_handle *fh;
+    const char *dir, *name;
+    ssize_t len;
+
+    // directories may have been renamed since the last read
+    free(tw->last_dir);
+    tw->last_dir = NULL;
+
+    while ((len = read(tw->fd, buf, sizeof(buf))) > 0) {
+        for (meta = (struct fanotify_event_metadata *) buf;
+             FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+            if (meta->vers != FANOTIFY_METADATA_VERSION) {
+                errno = EPROTO;
+                return -1;
+            }
+
+            if (meta->mask & FAN_Q_OVERFLOW) {
+                cb(tw->root, TREEWATCH_LOST, arg);
+                continue;
+            }
+
+            if (meta->mask & (FAN_DELETE_SELF | FAN_MOVE_SELF)) {
+                cb(tw->root, TREEWATCH_ROOT, arg);
+                continue;
+            }
+
+            info = (struct fanotify_event_info_fid *) (meta + 1);
+            if (meta->event_len < sizeof(*meta) + sizeof(*info) ||
+                info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                continue;
+            }
+            fh = (struct file_handle *) info->handle;
+            name = (const char *) fh->f_handle + fh->handle_bytes;
+
+            if (!(dir = fanotify_dir(tw, fh)) ||
+                snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+                continue;
+            }
+
+            if (meta->mask & FAN_ONDIR) {
+                free(tw->last_dir);
+                tw->last_dir = NULL;
+                cb(path, TREEWATCH_DIR, arg);
+            } else {
+                cb(path, TREEWATCH_FILE, arg);
+            }
+        }
+    }
+
+    if (len < 0 && errno != EAGAIN && errno != EINTR) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int treewatch_init(struct treewatch *tw, const char *root, size_t max_dirs,
+                   int use_fanotify)
+{
+    int err;
+
+    memset(tw, 0, sizeof(*tw));
+    tw->fd = -1;
+    tw->root_fd = -1;
+    tw->max_dirs = max_dirs;
+    if (!(tw->root = strdup(root))) {
+        return -1;
+    }
+    tw->root_len = strlen(root);
+
+    if (use_fanotify && (tw->last_handle = malloc(sizeof(
+            struct treewatch_handle))) &&
+        (tw->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC |
+                                FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+                                O_RDONLY | O_CLOEXEC)) >= 0) {
+        if (fanotify_start(tw) == 0) {
+            tw->fanotify = 1;
+            return 1;
+        }
+        // unprivileged, or a filesystem without file handles
+        close(tw->fd);
+        if (tw->root_fd >= 0) {
+            close(tw->root_fd);
+            tw->root_fd = -1;
+        }
+    }
+
+    if ((tw->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ||
+        inotify_start(tw) < 0) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    err = errno;
+    treewatch_free(tw);
+    errno = err;
+    return -1;
+}
+
+
+int treewatch_rescan(struct treewatch *tw)
+{
+    if (tw->fanotify) {
+        fanotify_stop(tw);
+        return fanotify_start(tw);
+    }
+
+    inotify_stop(tw);
+    return inotify_start(tw);
+}
+
+
+int treewatch_read(struct treewatch *tw, treewatch_cb cb, void *arg)
+{
+    return tw->fanotify ? fanotify_read(tw, cb, arg)
+                        : inotify_read(tw, cb, arg);
+}
+
+
+void treewatch_free(struct treewatch *tw)
+{
+    if (tw->fd >= 0) {
+        if (!tw->fanotify) {
+            inotify_stop(tw);
+        }
+        close(tw->fd);
+    }
+
+    if (tw->root_fd >= 0) {
+        close(tw->root_fd);
+    }
+
+    free(tw->dirs);
+    free(tw->root);
+    free(tw->real_root);
+    free(tw->last_handle);
+    free(tw->last_dir);
+    memset(tw, 0, sizeof(*tw));
+    tw->fd = -1;
+    tw->root_fd = -1;
+}
@@ -0,0 +1,92 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TREEWATCH_H
+#define TREEWATCH_H
+
+#include <stddef.h>
+
+// what the callback of treewatch_read() is told about path
+// a file was written and closed, or moved into the tree, or found in a
+// directory that was created
+#define TREEWATCH_FILE 1
+// a directory was moved into the tree, with whatever it holds
+#define TREEWATCH_DIR 2
+// events were dropped: anything below the root may have changed
+#define TREEWATCH_LOST 3
+// the root itself was removed or moved away
+#define TREEWATCH_ROOT 4
+
+// deepest directory watched below the root
+#define TREEWATCH_DEPTH 64
+
+struct treewatch_dir;
+
+typedef void (*treewatch_cb)(const char *path, int what, void *arg);
+
+/*
+ * Watches a directory tree for files written or moved into it.
+ *
+ * With fanotify, which takes CAP_SYS_ADMIN and CAP_DAC_READ_SEARCH, one
+ * mark on the filesystem covers every directory, and the events are
+ * mapped back to paths through their file handles.
+ *
+ * Otherwise, each directory takes an inotify watch, added as it appears.
+ * Directories are kept as (watch, parent, name), not as paths, and at
+ * most max_dirs below the root are watched, shallowest first, so that a
+ * huge tree costs neither the kernel's watch limit nor unbounded memory.
+ * Files written to a new directory before its watch is added are reported
+ * once it is.
+ */
+struct treewatch {
+    int fd;
+    int fanotify;
+    char *root;
+    size_t root_len;
+    size_t max_dirs;
+    // inotify: sorted by watch descriptor, the root first added
+    struct treewatch_dir *dirs;
+    size_t n_dirs, cap_dirs;
+    // directories left unwatched by the last additions
+    size_t n_skipped;
+    // fanotify: the root as the kernel reports it, and the last directory
+    char *real_root;
+    size_t real_root_len;
+    int root_fd;
+    void *last_handle;
+    char *last_dir;
+};
+
+/*
+ * Starts watching the tree below root, with fanotify if use_fanotify is
+ * set and the process may. Returns 1 with fanotify, 0 with inotify and -1
+ * on error. Poll tw->fd for events.
+ */
+int treewatch_init(struct treewatch *tw, const char *root, size_t max_dirs,
+                   int use_fanotify);
+
+/*
+ * Watches the tree again from the root, after TREEWATCH_LOST or
+ * TREEWATCH_ROOT.
+ */
+int treewatch_rescan(struct treewatch *tw);
+
+/*
+ * Reads the pending events and calls cb for each. Returns -1 on error.
+ */
+int treewatch_read(struct treewatch *tw, treewatch_cb cb, void *arg);
+
+void treewatch_free(struct treewatch *tw);
+
+#endif /* TREEWATCH_H */
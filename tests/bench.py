@@ -0,0 +1,489 @@
+#!/usr/bin/python3
+#
+# Hermetic benchmark of the wrapper's patch engine.
+#
+# Generates a synthetic server and extension tree (dynamic ELFs, static
+# ELFs and scripts in a node_modules-like layout), runs the wrapper on it
+# cold and warm, and prints the results as JSON. With --baseline, the
+# results are compared against a previous run and the exit status is 1 if
+# any metric regressed by more than --tolerance.
+#
+# With --mode fast-start, the same tree is patched once, and the median
+# latency from starting the wrapper to the start of the real CLI is
+# measured over --runs launches: with the fast-start stamp, with full
+# verification (VSCODE_PATCH_FAST_START=0), and without the wrapper.
+#
+# With --mode install, the tree is packed into a release tarball, the
+# wrapper first, and the median time of `tar xf` followed by --patch-now is
+# compared with that of --install, which patches while extracting, over
+# --runs installs. A zstd tarball is measured too if pzstd or zstd exists.
+#
+# Usage: tests/bench.py [options] <code-binary>
+#
+import argparse
+import json
+import os
+import random
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+COMMIT = '0123456789abcdef0123456789abcdef01234567'
+
+# metrics where a larger value is better; all others should not grow
+HIGHER_IS_BETTER = ('files_per_s', 'mb_per_s')
+COMPARED = ('files_per_s', 'mb_per_s', 'syscalls', 'peak_rss_kb')
+
+
+def eprint(msg):
+    sys.stderr.write("%s\n" % (msg,))
+
+
+def parse_sizes(spec):
+    units = {'': 1, 'k': 1 << 10, 'm': 1 << 20, 'g': 1 << 30}
+    sizes = []
+    for item in spec.split(','):
+        size, weight = item.split(':')
+        m = re.fullmatch(r'([0-9]+)([kmg]?)', size.strip().lower())
+        if not m:
+            raise ValueError("invalid size: %s" % (size,))
+        sizes.append((int(m.group(1)) * units[m.group(2)], float(weight)))
+    return sizes
+
+
+def read_elf_header(path):
+    with open(path, 'rb') as f:
+        ehdr = f.read(64)
+    if len(ehdr) < 52 or ehdr[:4] != b'\x7fELF':
+        raise ValueError("not an ELF file: %s" % (path,))
+    return ehdr
+
+
+def has_interp(path):
+    ehdr = read_elf_header(path)
+    is64 = ehdr[4] == 2
+    endian = '<' if ehdr[5] == 1 else '>'
+    if is64:
+        phoff, = struct.unpack_from(endian + 'Q', ehdr, 32)
+        phentsize, phnum = struct.unpack_from(endian + 'HH', ehdr, 54)
+    else:
+        phoff, = struct.unpack_from(endian + 'I', ehdr, 28)
+        phentsize, phnum = struct.unpack_from(endian + 'HH', ehdr, 42)
+    with open(path, 'rb') as f:
+        for i in range(phnum):
+            f.seek(phoff + i * phentsize)
+            p_type, = struct.unpack(endian + 'I', f.read(4))
+            if p_type == 3:
+                return True
+    return False
+
+
+def find_dynamic_template():
+    for path in ('/bin/true', '/usr/bin/true', '/bin/ls', '/usr/bin/env'):
+        try:
+            if has_interp(path):
+                return path
+        except (OSError, ValueError):
+            pass
+    raise RuntimeError("no dynamic ELF executable found, use --elf-template")
+
+
+def static_elf(template_hdr, size):
+    # a bare ELF_EXEC with one PT_LOAD and no PT_INTERP, for the host machine
+    is64 = template_hdr[4] == 2
+    endian = '<' if template_hdr[5] == 1 else '>'
+    machine, = struct.unpack_from(endian + 'H', template_hdr, 18)
+    ident = template_hdr[:7] + b'\0' * 9
+    if is64:
+        ehdr = ident + struct.pack(endian + 'HHIQQQIHHHHHH', 2, machine, 1,
+                                   0x400078, 64, 0, 0, 64, 56, 1, 64, 0, 0)
+        phdr = struct.pack(endian + 'IIQQQQQQ', 1, 5, 0, 0x400000, 0x400000,
+                           size, size, 0x1000)
+    else:
+        ehdr = ident + struct.pack(endian + 'HHIIIIIHHHHHH', 2, machine, 1,
+                                   0x8048054, 52, 0, 0, 52, 32, 1, 40, 0, 0)
+        phdr = struct.pack(endian + 'IIIIIIII', 1, 0, 0x8048000, 0x8048000,
+                           size, size, 5, 0x1000)
+    return ehdr + phdr
+
+
+class TreeGen:
+    def __init__(self, args, rng):
+        self.args = args
+        self.rng = rng
+        self.sizes = parse_sizes(args.sizes)
+        self.template = args.elf_template or find_dynamic_template()
+        with open(self.template, 'rb') as f:
+            self.template_data = f.read()
+        self.template_hdr = self.template_data[:64]
+        self.filler = bytes(rng.getrandbits(8) for _ in range(1 << 16))
+        self.n_files = 0
+        self.n_bytes = 0
+
+    def pick_size(self):
+        sizes, weights = zip(*self.sizes)
+        return self.rng.choices(sizes, weights)[0]
+
+    def pick_dir(self, root):
+        parts = [root, 'node_modules']
+        for level in range(self.rng.randint(1, self.args.depth)):
+            parts.append('pkg%d' % (self.rng.randrange(self.args.fanout),))
+            if level + 1 < self.args.depth and self.rng.random() < 0.5:
+                parts.append(self.rng.choice(('lib', 'dist', 'bin', 'build')))
+        path = os.path.join(*parts)
+        os.makedirs(path, exist_ok=True)
+        return path
+
+    def pad(self, f, size):
+        while size > 0:
+            n = min(size, len(self.filler))
+            f.write(self.filler[:n])
+            size -= n
+
+    def write(self, path, head, size, mode):
+        size = max(size, len(head))
+        with open(path, 'wb') as f:
+            f.write(head)
+            self.pad(f, size - len(head))
+        os.chmod(path, mode)
+        self.n_files += 1
+        self.n_bytes += size
+
+    def populate(self, root, n_dynamic, n_static, n_scripts):
+        for i in range(n_dynamic):
+            self.write(os.path.join(self.pick_dir(root), 'dyn%d' % (i,)),
+                       self.template_data, self.pick_size(), 0o755)
+        for i in range(n_static):
+            size = self.pick_size()
+            self.write(os.path.join(self.pick_dir(root), 'static%d' % (i,)),
+                       static_elf(self.template_hdr, size), size, 0o755)
+        for i in range(n_scripts):
+            head = b'#!/bin/sh\n# module %d\n' % (i,)
+            name = 'f%d.%s' % (i, self.rng.choice(('js', 'json', 'sh', 'py')))
+            self.write(os.path.join(self.pick_dir(root), name), head,
+                       min(self.pick_size(), 1 << 16), 0o644)
+
+
+def split(n, parts):
+    return [n // parts + (1 if i < n % parts else 0) for i in range(parts)]
+
+
+def generate(args, workdir, cli_script='#!/bin/sh\nexit 0\n',
+             installdir=None):
+    # extensions.json holds absolute paths: where the tree will be used
+    rng = random.Random(args.seed)
+    gen = TreeGen(args, rng)
+    srvdir = os.path.join(workdir, 'cli', 'servers', 'Stable-' + COMMIT,
+                          'server')
+    extdir = os.path.join(workdir, 'extensions')
+    os.makedirs(srvdir)
+    os.makedirs(os.path.join(workdir, 'gnu'))
+    os.makedirs(extdir)
+
+    shutil.copy(args.code, os.path.join(workdir, 'code-' + COMMIT))
+    cli = os.path.join(workdir, 'code-' + COMMIT + '-cli')
+    with open(cli, 'w') as f:
+        f.write(cli_script)
+    os.chmod(cli, 0o755)
+
+    # half of everything goes to the server, the rest to the extensions
+    n_ext = max(args.extensions, 1)
+    dyn = split(args.dynamic, 2)
+    sta = split(args.static, 2)
+    scr = split(args.scripts, 2)
+    gen.populate(srvdir, dyn[0], sta[0], scr[0])
+
+    entries = []
+    per_ext = zip(split(dyn[1], n_ext), split(sta[1], n_ext),
+                  split(scr[1], n_ext))
+    for i, (d, s, c) in enumerate(per_ext):
+        name = 'bench.ext%d-1.0.0' % (i,)
+        path = os.path.join(extdir, name)
+        os.makedirs(path)
+        gen.populate(path, d, s, c)
+        location = os.path.join(installdir or workdir, 'extensions', name)
+        entries.append({'identifier': {'id': 'bench.ext%d' % (i,)},
+                        'version': '1.0.0',
+                        'location': {'$mid': 1, 'path': location,
+                                     'scheme': 'file'}})
+
+    with open(os.path.join(extdir, 'extensions.json'), 'w') as f:
+        json.dump(entries, f)
+
+    return gen.n_files, gen.n_bytes
+
+
+def count_syscalls(summary):
+    # strace -c ends with: 100.00 <secs> <usecs/call> <calls> [errors] total
+    for line in reversed(summary.splitlines()):
+        fields = line.split()
+        if len(fields) >= 5 and fields[-1] == 'total':
+            return int(fields[3])
+    return None
+
+
+def run_wrapper(workdir, strace):
+    code = os.path.join(workdir, 'code-' + COMMIT)
+    argv = [code, '--version']
+    summary = None
+    if strace:
+        summary = os.path.join(workdir, '.strace')
+        argv = ['strace', '-f', '-c', '-o', summary] + argv
+
+    start = time.monotonic()
+    proc = subprocess.Popen(argv, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    _, status, rusage = os.wait4(proc.pid, 0)
+    seconds = time.monotonic() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode != 0:
+        raise RuntimeError("%s exited with %d" % (argv[0], proc.returncode))
+
+    syscalls = None
+    if summary:
+        with open(summary) as f:
+            syscalls = count_syscalls(f.read())
+        os.unlink(summary)
+
+    return seconds, rusage.ru_maxrss, syscalls
+
+
+def measure(workdir, n_files, n_bytes):
+    seconds, peak_rss, _ = run_wrapper(workdir, False)
+    return {
+        'seconds': round(seconds, 4),
+        'files_per_s': round(n_files / seconds, 1),
+        'mb_per_s': round(n_bytes / seconds / (1 << 20), 2),
+        'peak_rss_kb': peak_rss,
+    }
+
+
+def start_latency(argv, env=None):
+    # the CLI prints the time it was started
+    start = time.time_ns()
+    out = subprocess.run(argv, stdout=subprocess.PIPE,
+                         stderr=subprocess.DEVNULL, env=env, check=True)
+    return (int(out.stdout.split()[-1]) - start) / 1e9
+
+
+def median_start(argv, runs, env=None):
+    seconds = sorted(start_latency(argv, env) for _ in range(runs))
+    return {'seconds': round(seconds[(len(seconds) - 1) // 2], 6)}
+
+
+def run_fast_start(args, result, workdir):
+    eprint("Generating tree in %s ..." % (workdir,))
+    result['files'], result['bytes'] = generate(
+        args, workdir, '#!/bin/sh\ndate +%s%N\n')
+
+    code = os.path.join(workdir, 'code-' + COMMIT)
+    full_env = dict(os.environ, VSCODE_PATCH_FAST_START='0')
+
+    # the first launch patches everything and writes the stamp
+    start_latency([code])
+
+    eprint("Measuring %d launches of each ..." % (args.runs,))
+    result['runs']['direct'] = median_start([code + '-cli'], args.runs)
+    result['runs']['full_verify'] = median_start([code], args.runs,
+                                                 full_env)
+    result['runs']['fast_start'] = median_start([code], args.runs)
+
+
+def median_install(cmds, dest, runs, env):
+    seconds = []
+    for _ in range(runs):
+        shutil.rmtree(dest, ignore_errors=True)
+        os.makedirs(dest)
+        os.sync()
+        start = time.monotonic()
+        for argv in cmds:
+            subprocess.run(argv, stdout=subprocess.DEVNULL,
+                           stderr=subprocess.DEVNULL, env=env, check=True)
+        seconds.append(time.monotonic() - start)
+    seconds.sort()
+    return {'seconds': round(seconds[(len(seconds) - 1) // 2], 4)}
+
+
+def run_install(args, result, workdir):
+    srcdir = os.path.join(workdir, 'src')
+    top = os.path.join(srcdir, 'vscode-server')
+    dest = os.path.join(workdir, 'dest')
+    wrapper = 'vscode-server/code-' + COMMIT
+    code = os.path.join(dest, 'code-' + COMMIT)
+
+    eprint("Generating tree in %s ..." % (top,))
+    result['files'], result['bytes'] = generate(args, top, installdir=dest)
+    os.symlink('code-' + COMMIT, os.path.join(top, 'code-latest'))
+
+    # packed like the Makefile does, the wrapper first
+    listing = subprocess.run(['find', 'vscode-server', '!', '-path', wrapper],
+                             cwd=srcdir, stdout=subprocess.PIPE,
+                             check=True).stdout
+    tarballs = {'gz': os.path.join(workdir, 'release.tar.gz')}
+    subprocess.run(['tar', '--no-recursion', '-czf', tarballs['gz'], '-T',
+                    '-'], cwd=srcdir, input=wrapper.encode() + b'\n' + listing,
+                   check=True)
+
+    zstd = shutil.which('pzstd') or shutil.which('zstd')
+    if zstd:
+        tarballs['zst'] = os.path.join(workdir, 'release.tar.zst')
+        with open(tarballs['zst'], 'wb') as f:
+            gz = subprocess.Popen(['gzip', '-dc', tarballs['gz']],
+                                  stdout=subprocess.PIPE)
+            subprocess.run([zstd, '-c', '-'], stdin=gz.stdout, stdout=f,
+                           stderr=subprocess.DEVNULL, check=True)
+            gz.stdout.close()
+            gz.wait()
+
+    # every ELF file counts, whatever the host glibc
+    env = dict(os.environ, VSCODE_PATCH_ALL='1')
+    extract = ['tar', 'xf', None, '-C', dest, '--strip-components', '1']
+
+    for name, tarball in tarballs.items():
+        extract[2] = tarball
+        eprint("Measuring %d installs of %s ..." % (args.runs, tarball))
+        result['runs']['tar_patch_now_' + name] = median_install(
+            [extract, [code, '--patch-now']], dest, args.runs, env)
+        result['runs']['install_' + name] = median_install(
+            [extract + ['--occurrence', wrapper],
+             [code, '--install', tarball]], dest, args.runs, env)
+
+
+def run_benchmark(args):
+    result = {
+        'config': {k: v for k, v in vars(args).items()
+                   if k not in ('code', 'baseline', 'output', 'keep')},
+        'runs': {},
+    }
+
+    if args.mode != 'patch':
+        workdir = tempfile.mkdtemp(prefix='vscode-bench.')
+        try:
+            if args.mode == 'fast-start':
+                run_fast_start(args, result, workdir)
+            else:
+                run_install(args, result, workdir)
+        finally:
+            if not args.keep:
+                shutil.rmtree(workdir, ignore_errors=True)
+        return result
+
+    use_strace = args.strace and shutil.which('strace') is not None
+    if args.strace and not use_strace:
+        eprint("strace not found, syscall counts are not reported")
+
+    workdir = tempfile.mkdtemp(prefix='vscode-bench.')
+    try:
+        eprint("Generating tree in %s ..." % (workdir,))
+        n_files, n_bytes = generate(args, workdir)
+        result['files'] = n_files
+        result['bytes'] = n_bytes
+
+        # timed runs and counted runs are separate: strace distorts timings
+        if use_strace:
+            shutil.copytree(workdir, workdir + '.strace', symlinks=True)
+
+        eprint("Cold run ...")
+        result['runs']['cold'] = measure(workdir, n_files, n_bytes)
+        eprint("Warm run ...")
+        result['runs']['warm'] = measure(workdir, n_files, n_bytes)
+
+        if use_strace:
+            for name in ('cold', 'warm'):
+                _, _, syscalls = run_wrapper(workdir + '.strace', True)
+                result['runs'][name]['syscalls'] = syscalls
+    finally:
+        if not args.keep:
+            shutil.rmtree(workdir, ignore_errors=True)
+            shutil.rmtree(workdir + '.strace', ignore_errors=True)
+
+    return result
+
+
+def compare(result, baseline, tolerance):
+    regressions = []
+    for name, run in result['runs'].items():
+        base = baseline.get('runs', {}).get(name, {})
+        for metric in COMPARED:
+            new, old = run.get(metric), base.get(metric)
+            if new is None or not old:
+                continue
+            change = (new - old) / old
+            run.setdefault('change', {})[metric] = round(change, 4)
+            worse = -change if metric in HIGHER_IS_BETTER else change
+            if worse > tolerance:
+                regressions.append("%s.%s: %s -> %s" %
+                                   (name, metric, old, new))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Benchmark the patch engine on a synthetic tree.')
+    parser.add_argument('code', help='the code wrapper binary')
+    parser.add_argument('--mode', choices=('patch', 'fast-start', 'install'),
+                        default='patch',
+                        help='what to measure (default: %(default)s)')
+    parser.add_argument('--runs', type=int,
+                        help='launches measured by fast-start (default: 50) '
+                             'or installs by install (default: 5)')
+    parser.add_argument('--dynamic', type=int, default=200,
+                        help='dynamic ELF executables (default: %(default)s)')
+    parser.add_argument('--static', type=int, default=50,
+                        help='static ELF executables (default: %(default)s)')
+    parser.add_argument('--scripts', type=int, default=20000,
+                        help='scripts and other files (default: %(default)s)')
+    parser.add_argument('--extensions', type=int, default=10,
+                        help='extension directories (default: %(default)s)')
+    parser.add_argument('--depth', type=int, default=6,
+                        help='maximum package nesting (default: %(default)s)')
+    parser.add_argument('--fanout', type=int, default=20,
+                        help='packages per level (default: %(default)s)')
+    parser.add_argument('--sizes', default='4k:50,64k:35,1m:13,16m:2',
+                        help='size:weight distribution of files, scripts '
+                             'are capped at 64k (default: %(default)s)')
+    parser.add_argument('--seed', type=int, default=1,
+                        help='random seed (default: %(default)s)')
+    parser.add_argument('--elf-template',
+                        help='dynamic executable to copy (default: /bin/true)')
+    parser.add_argument('--no-strace', dest='strace', action='store_false',
+                        help='do not count syscalls')
+    parser.add_argument('--baseline',
+                        help='compare against this result file')
+    parser.add_argument('--tolerance', type=float, default=0.15,
+                        help='allowed regression ratio (default: %(default)s)')
+    parser.add_argument('--output', help='also write the result to this file')
+    parser.add_argument('--keep', action='store_true',
+                        help='keep the generated tree')
+    args = parser.parse_args()
+    if args.runs is None:
+        args.runs = 5 if args.mode == 'install' else 50
+
+    result = run_benchmark(args)
+    regressions = []
+
+    if args.baseline:
+        if os.path.exists(args.baseline):
+            with open(args.baseline) as f:
+                regressions = compare(result, json.load(f), args.tolerance)
+        else:
+            eprint("No baseline at %s, nothing to compare" % (args.baseline,))
+
+    text = json.dumps(result, indent=2, sort_keys=True)
+    print(text)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + '\n')
+
+    for r in regressions:
+        eprint("REGRESSION: " + r)
+
+    return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,265 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per-file latency of what the patch workers do before patch_file(): an
+ * lstat() of every file and a read of the first bytes of each, through
+ * src/batchio.c with and without io_uring. Files are generated in a new
+ * directory below dir (default /tmp); give a network mount to see the
+ * round trips add up. With "cold" (needs root), the page, dentry and inode
+ * caches are dropped before each run. Both ways must find the same.
+ *
+ * Usage: bench_batchio [n_runs] [n_files] [dir] [cold]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "src/batchio.h"
+
+struct digest {
+    size_t n_heads;
+    uint64_t hash;
+};
+
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static uint64_t fnv1a64(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--) {
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+// scripts, with an ELF header in one file of 20, like a server tree
+static int generate(char **paths, size_t n_files)
+{
+    size_t i;
+    FILE *fp;
+
+    for (i = 0; i < n_files; i++) {
+        if (!(fp = fopen(paths[i], "w"))) {
+            return -1;
+        }
+        if (i % 20 == 0) {
+            fwrite("\177ELF\2\1\1", 1, 7, fp);
+            fprintf(fp, "%*zu", BATCHIO_HEAD * 2, i);
+        } else {
+            fprintf(fp, "module.exports = %zu;\n", i);
+        }
+        if (fclose(fp) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int run(struct batchio *io, char **paths, size_t n_files,
+               struct digest *d)
+{
+    struct batchio_req reqs[BATCHIO_MAX], *heads[BATCHIO_MAX];
+    size_t off, n, n_heads, i;
+
+    d->n_heads = 0;
+    d->hash = 0xcbf29ce484222325ULL;
+
+    for (off = 0; off < n_files; off += n) {
+        n = n_files - off < BATCHIO_MAX ? n_files - off : BATCHIO_MAX;
+        for (i = 0; i < n; i++) {
+            reqs[i].path = paths[off + i];
+        }
+
+        batchio_stat(io, reqs, n);
+
+        for (i = 0, n_heads = 0; i < n; i++) {
+            if (reqs[i].err) {
+                errno = reqs[i].err;
+                perror(reqs[i].path);
+                return -1;
+            }
+            d->hash = fnv1a64(d->hash, &reqs[i].sb.st_ino,
+                              sizeof(reqs[i].sb.st_ino));
+            d->hash = fnv1a64(d->hash, &reqs[i].sb.st_size,
+                              sizeof(reqs[i].sb.st_size));
+            d->hash = fnv1a64(d->hash, &reqs[i].sb.st_mtim,
+                              sizeof(reqs[i].sb.st_mtim));
+            if (reqs[i].sb.st_size > 4) {
+                heads[n_heads++] = &reqs[i];
+            }
+        }
+
+        batchio_head(io, heads, n_heads);
+
+        for (i = 0; i < n_heads; i++) {
+            if (heads[i]->err) {
+                errno = heads[i]->err;
+                perror(heads[i]->path);
+                return -1;
+            }
+            d->hash = fnv1a64(d->hash, heads[i]->head, heads[i]->head_len);
+        }
+        d->n_heads += n_heads;
+    }
+
+    return 0;
+}
+
+
+static int drop_caches(void)
+{
+    FILE *fp;
+
+    sync();
+    if (!(fp = fopen("/proc/sys/vm/drop_caches", "w"))) {
+        return -1;
+    }
+    fputs("3\n", fp);
+    return fclose(fp);
+}
+
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+int main(int argc, char **argv)
+{
+    int n_runs = argc > 1 ? atoi(argv[1]) : 20, i, ret = 1;
+    size_t n_files = argc > 2 ? strtoul(argv[2], NULL, 10) : 20000, j;
+    char dir[PATH_MAX], **paths = NULL;
+    struct batchio sync_io, uring_io;
+    struct digest d_sync, d_uring;
+    int64_t *t_sync, *t_uring, start;
+    int has_uring, cold = argc > 4 && !strcmp(argv[4], "cold");
+
+    if (n_runs <= 0 || !n_files || argc > 5 || (argc > 4 && !cold)) {
+        fprintf(stderr, "Usage: %s [n_runs] [n_files] [dir] [cold]\n",
+                argv[0]);
+        return 1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s/bench_batchio.XXXXXX",
+             argc > 3 ? argv[3] : "/tmp");
+    if (!mkdtemp(dir)) {
+        perror(dir);
+        return 1;
+    }
+
+    t_sync = calloc(n_runs, sizeof(*t_sync));
+    t_uring = calloc(n_runs, sizeof(*t_uring));
+    paths = calloc(n_files, sizeof(*paths));
+    if (!t_sync || !t_uring || !paths) {
+        perror("calloc()");
+        goto end;
+    }
+
+    for (j = 0; j < n_files; j++) {
+        if (asprintf(&paths[j], "%s/f%zu", dir, j) < 0) {
+            paths[j] = NULL;
+            perror("asprintf()");
+            goto end;
+        }
+    }
+
+    if (generate(paths, n_files) < 0) {
+        perror("generate()");
+        goto end;
+    }
+
+    batchio_init(&sync_io, 0);
+    if (!(has_uring = batchio_init(&uring_io, 1))) {
+        fprintf(stderr, "io_uring unavailable, both runs are synchronous\n");
+    }
+
+    // alternated, so that both see the same cache state
+    for (i = 0; i < n_runs; i++) {
+        if (cold && drop_caches() < 0) {
+            perror("/proc/sys/vm/drop_caches");
+            goto end;
+        }
+        start = now_ns();
+        if (run(&sync_io, paths, n_files, &d_sync) < 0) {
+            goto end;
+        }
+        t_sync[i] = now_ns() - start;
+
+        if (cold && drop_caches() < 0) {
+            perror("/proc/sys/vm/drop_caches");
+            goto end;
+        }
+        start = now_ns();
+        if (run(&uring_io, paths, n_files, &d_uring) < 0) {
+            goto end;
+        }
+        t_uring[i] = now_ns() - start;
+    }
+
+    if (d_sync.n_heads != d_uring.n_heads || d_sync.hash != d_uring.hash) {
+        fprintf(stderr, "results differ: %zu != %zu heads\n",
+                d_sync.n_heads, d_uring.n_heads);
+        goto end;
+    }
+
+    qsort(t_sync, n_runs, sizeof(*t_sync), cmp_i64);
+    qsort(t_uring, n_runs, sizeof(*t_uring), cmp_i64);
+
+    printf("%10s %10s %8s %6s %12s %12s %8s\n", "files", "heads", "uring",
+           "cache", "sync_us", "uring_us", "speedup");
+    printf("%10zu %10zu %8s %6s %12.2f %12.2f %8.2f\n", n_files,
+           d_sync.n_heads, has_uring ? "yes" : "no", cold ? "cold" : "warm",
+           t_sync[n_runs / 2] / 1e3 / n_files,
+           t_uring[n_runs / 2] / 1e3 / n_files,
+           (double) t_sync[n_runs / 2] / t_uring[n_runs / 2]);
+    ret = 0;
+
+    batchio_free(&sync_io);
+    batchio_free(&uring_io);
+
+end:
+    for (j = 0; paths && j < n_files; j++) {
+        if (paths[j]) {
+            unlink(paths[j]);
+            free(paths[j]);
+        }
+    }
+    rmdir(dir);
+    free(paths);
+    free(t_sync);
+    free(t_uring);
+    return ret;
+}
@@ -0,0 +1,256 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares the streaming extensions.json extractor (src/extjson.c) with
+ * the libfastjson DOM it replaced, on generated files of growing size.
+ * Both must find the same entries.
+ *
+ * Usage: bench_extjson [n_runs] [n_extensions ...]
+ */
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libfastjson/json.h>
+#include "src/extjson.h"
+
+struct digest {
+    size_t n;
+    uint64_t hash;
+};
+
+
+static uint64_t fnv1a64(uint64_t h, const char *s)
+{
+    for (; *s; s++) {
+        h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+    }
+    return (h ^ 0xff) * 0x100000001b3ULL;
+}
+
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static size_t heap_used(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+
+    return mi.uordblks + mi.hblkhd;
+}
+
+
+// roughly what VS Code writes: an identifier, a location and metadata
+static char *generate(size_t n_ext, size_t *len)
+{
+    size_t cap = 4096 + n_ext * 2048, off = 0, i;
+    char *buf = malloc(cap);
+
+    if (!buf) {
+        return NULL;
+    }
+
+    off += snprintf(buf + off, cap - off, "[");
+    for (i = 0; i < n_ext; i++) {
+        if (cap - off < 2048) {
+            char *tmp;
+
+            cap *= 2;
+            if (!(tmp = realloc(buf, cap))) {
+                free(buf);
+                return NULL;
+            }
+            buf = tmp;
+        }
+        off += snprintf(buf + off, cap - off,
+            "%s{\"identifier\":{\"id\":\"publisher%zu.extension-%zu\","
+            "\"uuid\":\"%08zx-1234-5678-9abc-def012345678\"},"
+            "\"version\":\"1.%zu.%zu\","
+            "\"location\":{\"$mid\":1,\"fsPath\":\"/home/user/.vscode-server"
+            "/extensions/publisher%zu.extension-%zu-1.%zu.%zu\","
+            "\"external\":\"file:///home/user/.vscode-server/extensions/"
+            "publisher%zu.extension-%zu-1.%zu.%zu\",\"path\":\"/home/user/"
+            ".vscode-server/extensions/publisher%zu.extension-%zu-1.%zu.%zu"
+            "\",\"scheme\":\"file\"},"
+            "\"relativeLocation\":\"publisher%zu.extension-%zu-1.%zu.%zu\","
+            "\"metadata\":{\"installedTimestamp\":17%011zu,\"pinned\":false,"
+            "\"source\":\"gallery\",\"id\":\"%08zx-aaaa-bbbb-cccc-"
+            "dddddddddddd\",\"publisherId\":\"%08zx-eeee-ffff-0000-"
+            "111111111111\",\"publisherDisplayName\":\"Publisher \\u00e9 "
+            "%zu\",\"targetPlatform\":\"linux-x64\",\"updated\":true,"
+            "\"isPreReleaseVersion\":false,\"hasPreReleaseVersion\":false,"
+            "\"isApplicationScoped\":false,\"isMachineScoped\":false,"
+            "\"isBuiltin\":false,\"preRelease\":false,"
+            "\"size\":%zu,\"tags\":[\"lang\",\"debug\",\"snippets\"]}}",
+            i ? "," : "", i, i, i, i % 10, i % 7, i, i, i % 10, i % 7, i, i,
+            i % 10, i % 7, i, i, i % 10, i % 7, i, i, i % 10, i % 7, i, i,
+            i, i, i * 4096);
+    }
+    off += snprintf(buf + off, cap - off, "]");
+
+    *len = off;
+    return buf;
+}
+
+
+static int extjson_cb_digest(const struct extjson_entry *entry, void *arg)
+{
+    struct digest *d = arg;
+
+    d->n++;
+    d->hash = fnv1a64(d->hash, entry->path);
+    d->hash = fnv1a64(d->hash, entry->version);
+    return 0;
+}
+
+
+static int run_extjson(const char *buf, size_t len, struct digest *d)
+{
+    size_t err_off;
+
+    d->n = 0;
+    d->hash = 0xcbf29ce484222325ULL;
+    return extjson_parse(buf, len, extjson_cb_digest, d, &err_off);
+}
+
+
+// the former patch_extensions() walk
+static int run_fjson(const char *buf, struct digest *d, size_t *heap)
+{
+    struct fjson_object *parsed, *extension, *location, *path, *version;
+    const char *dirpath, *version_str;
+    size_t base = heap_used();
+    int n_ext, i;
+
+    d->n = 0;
+    d->hash = 0xcbf29ce484222325ULL;
+
+    if (!(parsed = fjson_tokener_parse(buf))) {
+        return -1;
+    }
+    *heap = heap_used() - base;
+
+    n_ext = fjson_object_array_length(parsed);
+    for (i = 0; i < n_ext; i++) {
+        version_str = "";
+        if (!(extension = fjson_object_array_get_idx(parsed, i)) ||
+            !fjson_object_object_get_ex(extension, "location", &location) ||
+            !fjson_object_object_get_ex(location, "path", &path) ||
+            !(dirpath = fjson_object_get_string(path))) {
+            continue;
+        }
+        if (fjson_object_object_get_ex(extension, "version", &version) &&
+            !(version_str = fjson_object_get_string(version))) {
+            version_str = "";
+        }
+        d->n++;
+        d->hash = fnv1a64(d->hash, dirpath);
+        d->hash = fnv1a64(d->hash, version_str);
+    }
+
+    fjson_object_put(parsed);
+    return 0;
+}
+
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+int main(int argc, char **argv)
+{
+    static const size_t default_sizes[] = { 100, 1000, 10000 };
+    int n_runs = argc > 1 ? atoi(argv[1]) : 20, i, j, n_sizes;
+    int64_t *t_stream, *t_dom, start;
+
+    if (n_runs <= 0) {
+        fprintf(stderr, "Usage: %s [n_runs] [n_extensions ...]\n", argv[0]);
+        return 1;
+    }
+
+    n_sizes = argc > 2 ? argc - 2 : 3;
+    t_stream = calloc(n_runs, sizeof(*t_stream));
+    t_dom = calloc(n_runs, sizeof(*t_dom));
+    if (!t_stream || !t_dom) {
+        perror("calloc()");
+        return 1;
+    }
+
+    printf("%10s %10s %12s %12s %10s %10s %12s\n", "extensions", "bytes",
+           "stream_us", "dom_us", "stream_MBs", "dom_MBs", "dom_heap_kb");
+
+    for (j = 0; j < n_sizes; j++) {
+        size_t n_ext = argc > 2 ? strtoul(argv[j + 2], NULL, 10)
+                                : default_sizes[j];
+        size_t len, heap = 0;
+        struct digest d_stream, d_dom;
+        char *buf = generate(n_ext, &len);
+
+        if (!buf) {
+            perror("generate()");
+            return 1;
+        }
+
+        for (i = 0; i < n_runs; i++) {
+            start = now_ns();
+            if (run_extjson(buf, len, &d_stream) < 0) {
+                fprintf(stderr, "extjson_parse() failed\n");
+                return 1;
+            }
+            t_stream[i] = now_ns() - start;
+
+            // libfastjson needs the NUL that mmap happened to provide
+            start = now_ns();
+            if (run_fjson(buf, &d_dom, &heap) < 0) {
+                fprintf(stderr, "fjson_tokener_parse() failed\n");
+                return 1;
+            }
+            t_dom[i] = now_ns() - start;
+        }
+
+        if (d_stream.n != d_dom.n || d_stream.hash != d_dom.hash) {
+            fprintf(stderr, "results differ: %zu != %zu entries\n",
+                    d_stream.n, d_dom.n);
+            return 1;
+        }
+
+        qsort(t_stream, n_runs, sizeof(*t_stream), cmp_i64);
+        qsort(t_dom, n_runs, sizeof(*t_dom), cmp_i64);
+
+        printf("%10zu %10zu %12.1f %12.1f %10.1f %10.1f %12zu\n", n_ext, len,
+               t_stream[n_runs / 2] / 1e3, t_dom[n_runs / 2] / 1e3,
+               len / (t_stream[n_runs / 2] / 1e9) / (1 << 20),
+               len / (t_dom[n_runs / 2] / 1e9) / (1 << 20), heap / 1024);
+
+        free(buf);
+    }
+
+    free(t_stream);
+    free(t_dom);
+    return 0;
+}
@@ -0,0 +1,133 @@
+#!/bin/bash
+#
+# Compares memcpy/strlen, libm and libstdc++ heavy code on the bundled
+# runtime with the glibc-hwcaps variants in gnu/glibc-hwcaps/ and with the
+# generic libraries only (--glibc-hwcaps-mask matching no subdirectory).
+#
+# Usage: tests/bench_hwcaps.sh <vscode-server-dir> [n_runs]
+#
+set -euo pipefail
+
+if [ "$#" -lt 1 ] || [ "$#" -gt 2 ]; then
+    echo "Usage: $0 <vscode-server-dir> [n_runs]" >&2
+    exit 1
+fi
+
+GNUDIR=$(realpath "$1")/gnu
+N_RUNS=${2:-5}
+CXX=${CXX:-c++}
+WORKDIR=$(mktemp -d)
+LOADER=$(ls "$GNUDIR"/ld-linux*.so.* | head -n 1)
+
+trap 'rm -rf "$WORKDIR"' EXIT
+
+INFO() {
+    echo "$@" >&2
+}
+
+if [ ! -d "$GNUDIR/glibc-hwcaps" ]; then
+    INFO "$GNUDIR/glibc-hwcaps not found, build with HWCAPS='x86-64-v3 ...'"
+    exit 1
+fi
+
+cat > "$WORKDIR/bench.cc" <<'EOS'
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+static volatile size_t sink;
+
+template <typename F> static long long run_us(F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+        .count();
+}
+
+int main()
+{
+    std::vector<char> src(1 << 20, 'x'), dst(1 << 20);
+    std::vector<std::string> strs;
+    for (size_t len = 1; len <= 4096; len *= 2) {
+        for (int i = 0; i < 16; i++) {
+            strs.push_back(std::string(len + i, 'a' + i));
+        }
+    }
+    std::vector<double> xs(1 << 16);
+    for (size_t i = 0; i < xs.size(); i++) {
+        xs[i] = 0.5 + i * 1e-4;
+    }
+
+    long long memcpy_us = run_us([&] {
+        for (int n = 0; n < 2000; n++) {
+            size_t len = 256 << (n % 12);
+            memcpy(dst.data(), src.data() + (n % 64), len);
+            sink += dst[len - 1];
+        }
+    });
+    long long strlen_us = run_us([&] {
+        for (int n = 0; n < 2000; n++) {
+            for (const auto &s : strs) {
+                sink += strlen(s.c_str());
+            }
+        }
+    });
+    long long libm_us = run_us([&] {
+        double sum = 0;
+        for (int n = 0; n < 40; n++) {
+            for (double x : xs) {
+                sum += exp(-x) + log(x) + sin(x) * cos(x) + pow(x, 1.5);
+            }
+        }
+        sink += (size_t) sum;
+    });
+    long long hash_us = run_us([&] {
+        std::hash<std::string> h;
+        for (int n = 0; n < 500; n++) {
+            for (const auto &s : strs) {
+                sink += h(s);
+            }
+        }
+    });
+
+    printf("%lld %lld %lld %lld\n", memcpy_us, strlen_us, libm_us, hash_us);
+    return 0;
+}
+EOS
+
+"$CXX" -O2 -o "$WORKDIR/bench" "$WORKDIR/bench.cc"
+
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+# prints the median of each column of the runs
+measure() {
+    local i out="$WORKDIR/runs"
+    for ((i = 0; i < N_RUNS; i++)); do
+        "$LOADER" --library-path "$GNUDIR" "$@" "$WORKDIR/bench"
+    done > "$out"
+    for i in 1 2 3 4; do
+        cut -d ' ' -f "$i" "$out" | median
+    done | paste -s -d ' '
+}
+
+INFO "Running $N_RUNS times with $LOADER ..."
+
+read -r g_memcpy g_strlen g_libm g_hash < <(measure --glibc-hwcaps-mask none)
+read -r h_memcpy h_strlen h_libm h_hash < <(measure)
+
+echo "runs=$N_RUNS" \
+     "generic_memcpy_us=$g_memcpy generic_strlen_us=$g_strlen" \
+     "generic_libm_us=$g_libm generic_hash_us=$g_hash"
+echo "runs=$N_RUNS" \
+     "hwcaps_memcpy_us=$h_memcpy hwcaps_strlen_us=$h_strlen" \
+     "hwcaps_libm_us=$h_libm hwcaps_hash_us=$h_hash"
+"$LOADER" --library-path "$GNUDIR" --list "$WORKDIR/bench" | \
+    grep -E 'libm\.|libstdc\+\+|libgcc_s' >&2 || true
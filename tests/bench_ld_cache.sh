@@ -0,0 +1,80 @@
+#!/bin/bash
+#
+# Compares library lookups and startup time of `node -e 0` with the
+# bundled gnu/ld.so.cache and without it (moved aside for the run).
+#
+# The server must have been patched already, i.e. the wrapper was started
+# at least once in the unpacked directory.
+#
+# Usage: tests/bench_ld_cache.sh <vscode-server-dir> [n_runs]
+#
+set -euo pipefail
+
+if [ "$#" -lt 1 ] || [ "$#" -gt 2 ]; then
+    echo "Usage: $0 <vscode-server-dir> [n_runs]" >&2
+    exit 1
+fi
+
+SRVROOT=$(realpath "$1")
+N_RUNS=${2:-50}
+CACHE="$SRVROOT/gnu/ld.so.cache"
+NODE=$(ls -d "$SRVROOT"/cli/servers/Stable-*/server/node | head -n 1)
+
+INFO() {
+    echo "$@" >&2
+}
+
+if [ ! -x "$NODE" ]; then
+    INFO "node not found in $SRVROOT"
+    exit 1
+fi
+
+if [ ! -e "$CACHE" ]; then
+    INFO "$CACHE not found"
+    exit 1
+fi
+
+# put the cache back whatever happens
+trap 'if [ -e "$CACHE.off" ]; then mv "$CACHE.off" "$CACHE"; fi' EXIT
+
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+# prints the number of open/openat calls, or n/a without strace
+count_opens() {
+    local out
+    if ! command -v strace >/dev/null; then
+        echo n/a
+        return
+    fi
+    out=$(mktemp)
+    strace -f -qq -e trace=open,openat -o "$out" "$NODE" -e 0
+    wc -l < "$out"
+    rm -f "$out"
+}
+
+# prints the median run time of `node -e 0` in microseconds
+measure() {
+    local i start end
+    for ((i = 0; i < N_RUNS; i++)); do
+        start=$(date +%s%N)
+        "$NODE" -e 0
+        end=$(date +%s%N)
+        echo $(( (end - start) / 1000 ))
+    done | median
+}
+
+# warm up the page cache
+"$NODE" -e 0
+
+opens_cache=$(count_opens)
+time_cache=$(measure)
+
+mv "$CACHE" "$CACHE.off"
+opens_nocache=$(count_opens)
+time_nocache=$(measure)
+
+echo "runs=$N_RUNS" \
+     "cache_opens=$opens_cache cache_us=$time_cache" \
+     "nocache_opens=$opens_nocache nocache_us=$time_nocache"
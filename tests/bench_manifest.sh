@@ -0,0 +1,73 @@
+#!/bin/bash
+#
+# Measures the cost of re-running the wrapper on an unchanged extension
+# tree, with and without the per-file patch manifest.
+#
+# Usage: tests/bench_manifest.sh <code-binary> [n_files]
+#
+set -euo pipefail
+
+if [ "$#" -lt 1 ] || [ "$#" -gt 2 ]; then
+    echo "Usage: $0 <code-binary> [n_files]" >&2
+    exit 1
+fi
+
+CODEBIN=$(realpath "$1")
+N_FILES=${2:-50000}
+COMMIT=0123456789abcdef0123456789abcdef01234567
+WORKDIR=$(mktemp -d)
+SRVDIR="$WORKDIR/cli/servers/Stable-$COMMIT/server"
+EXTDIR="$WORKDIR/extensions/bench.extension-1.0.0"
+
+trap 'rm -rf "$WORKDIR"' EXIT
+
+INFO() {
+    echo "$@" >&2
+}
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+run_wrapper() {
+    local start end
+    start=$(now_ms)
+    "$WORKDIR/code-$COMMIT" --version >/dev/null
+    end=$(now_ms)
+    echo $(( end - start ))
+}
+
+INFO "Generating $N_FILES files in $WORKDIR ..."
+
+mkdir -p "$SRVDIR" "$WORKDIR/gnu" "$EXTDIR"
+cp "$CODEBIN" "$WORKDIR/code-$COMMIT"
+printf '#!/bin/sh\nexit 0\n' > "$WORKDIR/code-$COMMIT-cli"
+chmod +x "$WORKDIR/code-$COMMIT-cli"
+
+# node_modules-like layout: 100 packages, each with a few nested levels
+for ((i = 0; i < N_FILES; i++)); do
+    pkg=$(( i % 100 ))
+    sub=$(( (i / 100) % 10 ))
+    dir="$EXTDIR/node_modules/pkg$pkg/lib/sub$sub"
+    [ -d "$dir" ] || mkdir -p "$dir"
+    echo "module.exports = $i;" > "$dir/f$i.js"
+done
+
+# a handful of dynamic executables, as shipped by language servers
+for ((i = 0; i < 20; i++)); do
+    cp /bin/true "$EXTDIR/node_modules/pkg$i/tool$i"
+done
+
+cat > "$WORKDIR/extensions/extensions.json" <<EOF
+[{"identifier":{"id":"bench.extension"},"version":"1.0.0","location":{"\$mid":1,"path":"$EXTDIR","scheme":"file"}}]
+EOF
+
+cold=$(run_wrapper)
+warm=$(run_wrapper)
+
+# without a manifest every file is opened and probed again
+find "$WORKDIR" -name '*.manifest' -delete
+noindex=$(run_wrapper)
+
+echo "files=$N_FILES cold_ms=$cold warm_manifest_ms=$warm" \
+     "warm_no_manifest_ms=$noindex"
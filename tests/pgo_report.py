@@ -0,0 +1,59 @@
+#!/usr/bin/python3
+#
+# Prints what `make pgo` gained: patch throughput and startup latency of
+# the plain build (before) and the profile-optimized build (after).
+#
+# Usage: tests/pgo_report.py <pgo-dir>
+#
+# <pgo-dir> holds before.json, after.json, before-start.json and
+# after-start.json from tests/bench.py, the latter with --mode fast-start.
+#
+import json
+import os
+import sys
+
+
+def eprint(msg):
+    sys.stderr.write("%s\n" % (msg,))
+
+
+def delta(old, new):
+    return "%+.1f%%" % ((new - old) / old * 100.0,) if old else "n/a"
+
+
+def main():
+    if len(sys.argv) != 2:
+        eprint("Usage: %s <pgo-dir>" % (sys.argv[0],))
+        return 1
+
+    pgodir = sys.argv[1]
+    with open(os.path.join(pgodir, 'before.json')) as f:
+        before = json.load(f)['runs']
+    with open(os.path.join(pgodir, 'after.json')) as f:
+        after = json.load(f)['runs']
+    with open(os.path.join(pgodir, 'before-start.json')) as f:
+        start_before = json.load(f)['runs']
+    with open(os.path.join(pgodir, 'after-start.json')) as f:
+        start_after = json.load(f)['runs']
+
+    rows = [
+        ("patch throughput, cold (files/s)",
+         before['cold']['files_per_s'], after['cold']['files_per_s']),
+        ("patch throughput, cold (MB/s)",
+         before['cold']['mb_per_s'], after['cold']['mb_per_s']),
+        ("startup, nothing to patch (ms)",
+         before['warm']['seconds'] * 1000, after['warm']['seconds'] * 1000),
+    ]
+    for key, name in (('full_verify', "startup, full verify (ms)"),
+                      ('fast_start', "startup, fast start (ms)")):
+        rows.append((name, start_before[key]['seconds'] * 1000,
+                     start_after[key]['seconds'] * 1000))
+
+    print("%-36s %12s %12s %8s" % ("", "plain", "pgo+lto", "delta"))
+    for name, old, new in rows:
+        print("%-36s %12.2f %12.2f %8s" % (name, old, new, delta(old, new)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())